@@ -2,7 +2,8 @@ local colors = require 'colors'
 local settings = require 'settings'
 
 -- Execute the trash_monitor binary which provides the count of items in the trash
-sbar.exec '$CONFIG_DIR/trash/trash_monitor &'
+-- and, with --size, the bytes emptying it would reclaim
+sbar.exec '$CONFIG_DIR/trash/trash_monitor --size &'
 
 local ICON_TRASH_EMPTY = ''
 local ICON_TRASH_FULL = ''
@@ -23,9 +24,20 @@ local trash = sbar.add('item', 'trash', {
   },
 })
 
+local function format_size(bytes)
+  local units = { 'B', 'K', 'M', 'G', 'T' }
+  local unit = 1
+  while bytes >= 1024 and unit < #units do
+    bytes = bytes / 1024
+    unit = unit + 1
+  end
+  return string.format(unit == 1 and '%d%s' or '%.1f%s', bytes, units[unit])
+end
+
 local function update_trash(env)
-  -- Read the count from the TRASH_COUNT variable sent by trash_monitor
+  -- Read the count (and size, when present) sent by trash_monitor
   local count = tonumber(env.TRASH_COUNT)
+  local size = tonumber(env.TRASH_SIZE)
 
   if count == 0 then
     -- Trash is empty
@@ -43,7 +55,7 @@ local function update_trash(env)
         color = colors.red,
       },
       label = {
-        string = tostring(count),
+        string = size and (count .. ' · ' .. format_size(size)) or tostring(count),
         color = colors.red,
         drawing = true,
       },
@@ -0,0 +1,130 @@
+#pragma once
+
+/* Requests on the daemon's command channel, one line each:
+
+     toggle menu|dock|both   set menu|dock|both 0|1   query   stats
+     exec<TAB>-l   exec<TAB>-s<TAB><id|Owner,Name>
+
+   Parsing is free of macOS APIs so the grammar can be checked anywhere;
+   menus.c applies the result. Anything else, including a valid request
+   with trailing words, is COMMAND_INVALID.
+
+   An exec reply is "<status> <stdout length>\n" followed by stdout and
+   stderr, of any size; the client reads it until the daemon closes the
+   connection. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+typedef enum {
+  COMMAND_INVALID,
+  COMMAND_QUERY,
+  COMMAND_STATS,
+  COMMAND_EXEC,
+  COMMAND_TOGGLE,
+  COMMAND_SET,
+} CommandVerb;
+
+struct command {
+  CommandVerb verb;
+  bool menu, dock; /* toggle and set */
+  bool hide;       /* set */
+  char *args;      /* exec: the tab separated arguments, inside the request */
+};
+
+/* `request` has its line ending stripped */
+static inline struct command command_parse(char *request) {
+  struct command command = {COMMAND_INVALID, false, false, false, NULL};
+  if (!strncmp(request, "exec\t", 5)) {
+    command.verb = COMMAND_EXEC;
+    command.args = request + 5;
+    return command;
+  }
+
+  /* Each %n marks the end of the last word read; a word cut short by its
+     field width leaves the rest of it behind and fails the request. */
+  char verb[16], target[16];
+  int value = 0, end = 0;
+  int fields = sscanf(request, "%15s%n %15s%n %d%n", verb, &end, target, &end,
+                      &value, &end);
+  if (fields < 1 || request[end + strspn(request + end, " ")])
+    return command;
+
+  if (fields == 1) {
+    if (!strcmp(verb, "query"))
+      command.verb = COMMAND_QUERY;
+    else if (!strcmp(verb, "stats"))
+      command.verb = COMMAND_STATS;
+    return command;
+  }
+
+  command.menu = !strcmp(target, "menu") || !strcmp(target, "both");
+  command.dock = !strcmp(target, "dock") || !strcmp(target, "both");
+  if (!command.menu && !command.dock)
+    return command;
+  if (fields == 2 && !strcmp(verb, "toggle")) {
+    command.verb = COMMAND_TOGGLE;
+  } else if (fields == 3 && !strcmp(verb, "set") &&
+             (value == 0 || value == 1)) {
+    command.verb = COMMAND_SET;
+    command.hide = value;
+  }
+  return command;
+}
+
+/* Everything the peer sends until it closes, NUL terminated; NULL when
+   nothing arrived. A timeout or error part way keeps what came before it. */
+static inline char *command_recv_all(int fd, size_t *length) {
+  size_t capacity = 4096, used = 0;
+  char *reply = malloc(capacity);
+  while (reply) {
+    if (capacity - used < 2) {
+      char *grown = realloc(reply, capacity * 2);
+      if (!grown)
+        break;
+      reply = grown;
+      capacity *= 2;
+    }
+    ssize_t got = recv(fd, reply + used, capacity - 1 - used, 0);
+    if (got <= 0)
+      break;
+    used += (size_t)got;
+  }
+  if (reply && !used) {
+    free(reply);
+    reply = NULL;
+  }
+  if (reply)
+    reply[used] = '\0';
+  *length = used;
+  return reply;
+}
+
+struct command_output {
+  int status;
+  const char *out, *err; /* inside the reply */
+  size_t out_len, err_len;
+  bool complete; /* false when stdout came up short of its length */
+};
+
+/* False when `reply` has no exec header, e.g. an "error" from a daemon
+   that predates exec */
+static inline bool command_parse_output(const char *reply, size_t length,
+                                        struct command_output *output) {
+  const char *body = memchr(reply, '\n', length);
+  if (!body || sscanf(reply, "%d %zu", &output->status, &output->out_len) != 2)
+    return false;
+  body++;
+  size_t body_len = length - (size_t)(body - reply);
+  output->complete = output->out_len <= body_len;
+  if (!output->complete)
+    output->out_len = body_len;
+  output->out = body;
+  output->err = body + output->out_len;
+  output->err_len = body_len - output->out_len;
+  return true;
+}
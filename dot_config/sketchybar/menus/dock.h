@@ -0,0 +1,75 @@
+#pragma once
+
+/* Relaunching the Dock so it picks up new autohide preferences. Only the
+   sequencing and timeouts live here, free of macOS APIs: menus.c supplies the
+   operations, a stub table can drive the same logic anywhere.
+
+     preferences -> find Dock -> terminate -> wait for exit -> wait for the
+     replacement launchd starts
+
+   Both waits share one deadline, so a toggle never blocks longer than the
+   timeout passed to dock_apply. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DOCK_TIMEOUT_MS 3000
+#define DOCK_LAUNCH_POLL_MS 10
+
+struct dock_ops {
+  void *context;
+  bool (*write_preferences)(void *context, bool hide);
+  /* The user's running Dock other than `except`, or 0 when there is none */
+  pid_t (*find_dock)(void *context, pid_t except);
+  bool (*terminate)(void *context, pid_t pid);
+  /* True once `pid` has exited, false when timeout_ms passed first */
+  bool (*wait_exit)(void *context, pid_t pid, int timeout_ms);
+  void (*sleep_ms)(void *context, int ms);
+  uint64_t (*now_ms)(void *context);
+};
+
+typedef enum {
+  DOCK_RELAUNCHED,
+  DOCK_NOT_RUNNING, /* preferences written, applied on next launch */
+  DOCK_PREFERENCES_FAILED,
+  DOCK_TERMINATE_FAILED,
+  DOCK_EXIT_TIMEOUT,
+  DOCK_LAUNCH_TIMEOUT,
+} DockResult;
+
+static inline int dock_remaining_ms(const struct dock_ops *ops,
+                                    uint64_t deadline) {
+  uint64_t now = ops->now_ms(ops->context);
+  return now >= deadline ? 0 : (int)(deadline - now);
+}
+
+static inline DockResult dock_apply(const struct dock_ops *ops, bool hide,
+                                    int timeout_ms) {
+  if (!ops->write_preferences(ops->context, hide))
+    return DOCK_PREFERENCES_FAILED;
+
+  pid_t old_pid = ops->find_dock(ops->context, 0);
+  if (!old_pid)
+    return DOCK_NOT_RUNNING;
+
+  uint64_t deadline = ops->now_ms(ops->context) + (uint64_t)timeout_ms;
+  if (!ops->terminate(ops->context, old_pid))
+    return DOCK_TERMINATE_FAILED;
+  if (!ops->wait_exit(ops->context, old_pid,
+                      dock_remaining_ms(ops, deadline)))
+    return DOCK_EXIT_TIMEOUT;
+
+  /* launchd gives no event for the respawn, but the process table is cheap
+     to query in-process. */
+  for (;;) {
+    if (ops->find_dock(ops->context, old_pid))
+      return DOCK_RELAUNCHED;
+    int remaining = dock_remaining_ms(ops, deadline);
+    if (!remaining)
+      return DOCK_LAUNCH_TIMEOUT;
+    ops->sleep_ms(ops->context, remaining < DOCK_LAUNCH_POLL_MS
+                                    ? remaining
+                                    : DOCK_LAUNCH_POLL_MS);
+  }
+}
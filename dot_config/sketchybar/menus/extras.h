@@ -0,0 +1,133 @@
+#pragma once
+
+/* Status bar extras indexed by their "Owner,Name" alias. The index is built
+   from one window list snapshot and only holds plain values, so the matching
+   can be replayed against recorded window lists away from macOS; menus.c
+   fills it from CGWindowList and caches each extra's AX element once it has
+   been resolved.
+
+     extra_index_build(&index, windows, count, release);
+     struct extra *extra = extra_index_find(&index, "Control Center,WiFi");
+
+   Like the window list walk it replaces, the first window with an alias
+   wins. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define EXTRA_LAYER 0x19 /* kCGStatusWindowLevel */
+#define EXTRA_ALIAS_SIZE 512
+
+/* One window list record, as far as the index cares */
+struct extra_window {
+  const char *owner;
+  const char *name;
+  pid_t pid;
+  long long layer;
+  double x, y, width, height;
+};
+
+struct extra {
+  char alias[EXTRA_ALIAS_SIZE];
+  pid_t pid;
+  double x, y, width, height;
+  void *element; /* owned, resolved lazily by the caller */
+};
+
+struct extra_index {
+  struct extra *extras;
+  uint32_t count;
+  uint32_t *slots; /* 1-based positions in extras, 0 marks a free slot */
+  uint32_t capacity; /* power of two */
+  bool valid;        /* cleared when the window list may have changed */
+};
+
+static inline uint32_t extra_hash(const char *alias) {
+  uint32_t hash = 2166136261u;
+  while (*alias) {
+    hash ^= (unsigned char)*alias++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static inline void extra_index_clear(struct extra_index *index,
+                                     void (*release)(void *element)) {
+  for (uint32_t i = 0; i < index->count; i++) {
+    if (index->extras[i].element && release)
+      release(index->extras[i].element);
+  }
+  free(index->extras);
+  free(index->slots);
+  *index = (struct extra_index){0};
+}
+
+static inline struct extra *extra_index_find(struct extra_index *index,
+                                             const char *alias) {
+  if (!index->capacity)
+    return NULL;
+  uint32_t mask = index->capacity - 1;
+  for (uint32_t i = extra_hash(alias) & mask; index->slots[i];
+       i = (i + 1) & mask) {
+    struct extra *extra = &index->extras[index->slots[i] - 1];
+    if (!strcmp(extra->alias, alias))
+      return extra;
+  }
+  return NULL;
+}
+
+/* Replaces the index with the status bar windows among `windows`. Returns
+   false when out of memory, leaving the index empty and invalid. */
+static inline bool extra_index_build(struct extra_index *index,
+                                     const struct extra_window *windows,
+                                     uint32_t count,
+                                     void (*release)(void *element)) {
+  extra_index_clear(index, release);
+
+  uint32_t capacity = 16;
+  while (capacity < 2 * count)
+    capacity *= 2;
+  index->extras = calloc(count ? count : 1, sizeof(*index->extras));
+  index->slots = calloc(capacity, sizeof(*index->slots));
+  if (!index->extras || !index->slots) {
+    extra_index_clear(index, release);
+    return false;
+  }
+  index->capacity = capacity;
+
+  for (uint32_t w = 0; w < count; w++) {
+    const struct extra_window *window = &windows[w];
+    if (window->layer != EXTRA_LAYER || !window->owner || !window->name)
+      continue;
+
+    struct extra *extra = &index->extras[index->count];
+    snprintf(extra->alias, sizeof(extra->alias), "%s,%s", window->owner,
+             window->name);
+
+    uint32_t mask = capacity - 1;
+    uint32_t i = extra_hash(extra->alias) & mask;
+    bool duplicate = false;
+    for (; index->slots[i]; i = (i + 1) & mask) {
+      if (!strcmp(index->extras[index->slots[i] - 1].alias, extra->alias)) {
+        duplicate = true;
+        break;
+      }
+    }
+    if (duplicate)
+      continue;
+
+    extra->pid = window->pid;
+    extra->x = window->x;
+    extra->y = window->y;
+    extra->width = window->width;
+    extra->height = window->height;
+    extra->element = NULL;
+    index->slots[i] = ++index->count;
+  }
+  index->valid = true;
+  return true;
+}
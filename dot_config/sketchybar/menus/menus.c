@@ -3,25 +3,33 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libproc.h>
 #include <math.h>
+#include <objc/message.h>
+#include <objc/runtime.h>
 #include <signal.h>
-#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/event.h>
 #include <sys/file.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
-extern char **environ;
+#include "command.h"
+#include "dock.h"
+#include "extras.h"
+#include "rehide.h"
 
 #define STATE_FILE_MENU "/tmp/uiviz_menu"
 #define STATE_FILE_DOCK "/tmp/uiviz_dock"
 #define DAEMON_LOCK_FILE "/tmp/uiviz.daemon.lock"
 #define STATE_LOCK_FILE "/tmp/uiviz.state.lock"
+#define DAEMON_SOCKET "/tmp/uiviz.socket"
 
 /* ------------------------------------------------------------------ */
 /* SkyLight                                                             */
@@ -100,254 +108,109 @@ static void write_state(const char *path, bool hidden) {
 }
 
 /* ------------------------------------------------------------------ */
-/* Exec                                                                 */
+/* Dock relaunch                                                        */
 /* ------------------------------------------------------------------ */
 
-static void run(char *const argv[]) {
-  pid_t pid;
-  if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) == 0)
-    waitpid(pid, NULL, 0);
+/* The dock_ops of dock.h: preferences go through cfprefsd directly and the
+   Dock is found, signalled and awaited in-process instead of spawning
+   defaults, killall and pgrep. */
+
+static bool dock_write_preferences(void *context, bool hide) {
+  (void)context;
+  CFStringRef app = CFSTR("com.apple.dock");
+  float delay = hide ? 1000.0f : 0.0f;
+  float modifier = hide ? 0.0f : 0.1f;
+  CFNumberRef delay_ref =
+      CFNumberCreate(kCFAllocatorDefault, kCFNumberFloatType, &delay);
+  CFNumberRef modifier_ref =
+      CFNumberCreate(kCFAllocatorDefault, kCFNumberFloatType, &modifier);
+
+  CFPreferencesSetAppValue(CFSTR("autohide"), kCFBooleanTrue, app);
+  CFPreferencesSetAppValue(CFSTR("autohide-delay"), delay_ref, app);
+  CFPreferencesSetAppValue(CFSTR("autohide-time-modifier"), modifier_ref, app);
+  CFRelease(delay_ref);
+  CFRelease(modifier_ref);
+  return CFPreferencesAppSynchronize(app);
 }
 
-/* ------------------------------------------------------------------ */
-/* Menu / Dock                                                          */
-/* ------------------------------------------------------------------ */
-
-static void apply_menu(bool hide) {
-  int cid = fn_conn();
-  if (hide) {
-    fn_vis(cid, 0, true);
-    fn_inset(cid, -200.0, 1.0, 0.0f);
-  } else {
-    fn_vis(cid, 0, false);
-    fn_inset(cid, 0.0, 1.0, 1.0f);
+static pid_t dock_find(void *context, pid_t except) {
+  (void)context;
+  pid_t pids[4096];
+  int bytes = proc_listpids(PROC_UID_ONLY, getuid(), pids, sizeof(pids));
+  for (int i = 0; i < bytes / (int)sizeof(pid_t); i++) {
+    if (!pids[i] || pids[i] == except)
+      continue;
+    char name[2 * MAXCOMLEN + 1];
+    if (proc_name(pids[i], name, sizeof(name)) > 0 && !strcmp(name, "Dock"))
+      return pids[i];
   }
+  return 0;
 }
 
-static void apply_dock(bool hide) {
-  char *autohide[] = {"/usr/bin/defaults",
-                      "write",
-                      "com.apple.dock",
-                      "autohide",
-                      "-bool",
-                      "true",
-                      NULL};
-  run(autohide);
-
-  if (hide) {
-    char *delay[] = {"/usr/bin/defaults",
-                     "write",
-                     "com.apple.dock",
-                     "autohide-delay",
-                     "-float",
-                     "1000",
-                     NULL};
-    char *speed[] = {"/usr/bin/defaults",
-                     "write",
-                     "com.apple.dock",
-                     "autohide-time-modifier",
-                     "-float",
-                     "0",
-                     NULL};
-    run(delay);
-    run(speed);
-  } else {
-    char *delay[] = {"/usr/bin/defaults",
-                     "write",
-                     "com.apple.dock",
-                     "autohide-delay",
-                     "-float",
-                     "0",
-                     NULL};
-    char *speed[] = {"/usr/bin/defaults",
-                     "write",
-                     "com.apple.dock",
-                     "autohide-time-modifier",
-                     "-float",
-                     "0.1",
-                     NULL};
-    run(delay);
-    run(speed);
-  }
-
-  char *kill[] = {"/usr/bin/killall", "Dock", NULL};
-  run(kill);
-
-  char *pgrep[] = {"/usr/bin/pgrep", "Dock", NULL};
-  for (int i = 0; i < 30; i++) {
-    usleep(100000);
-    pid_t pid;
-    if (posix_spawn(&pid, pgrep[0], NULL, NULL, pgrep, environ) == 0) {
-      int status;
-      if (waitpid(pid, &status, 0) > 0 && WIFEXITED(status) &&
-          WEXITSTATUS(status) == 0)
-        break;
-    }
-  }
+static bool dock_terminate(void *context, pid_t pid) {
+  (void)context;
+  return kill(pid, SIGTERM) == 0 || errno == ESRCH;
 }
 
-/* ------------------------------------------------------------------ */
-/* Locks                                                                */
-/* ------------------------------------------------------------------ */
-
-static int daemon_fd = -1;
-static int state_fd = -1;
+static bool dock_wait_exit(void *context, pid_t pid, int timeout_ms) {
+  (void)context;
+  int kq = kqueue();
+  if (kq < 0)
+    return false;
 
-static void singleton_lock(void) {
-  daemon_fd = open(DAEMON_LOCK_FILE, O_CREAT | O_RDWR, 0644);
-  if (daemon_fd < 0)
-    exit(1);
-  if (flock(daemon_fd, LOCK_EX | LOCK_NB) < 0)
-    exit(0); /* already running */
+  struct kevent ev;
+  EV_SET(&ev, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+  struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+  int n = kevent(kq, &ev, 1, &ev, 1, &timeout);
+  close(kq);
+  if (n <= 0)
+    return false;
+  /* ESRCH: it was already gone before the watch was registered */
+  if (ev.flags & EV_ERROR)
+    return ev.data == ESRCH;
+  return true;
 }
 
-static void lock(void) {
-  state_fd = open(STATE_LOCK_FILE, O_CREAT | O_RDWR, 0644);
-  if (state_fd >= 0)
-    flock(state_fd, LOCK_EX);
+static void dock_sleep_ms(void *context, int ms) {
+  (void)context;
+  usleep((useconds_t)ms * 1000);
 }
 
-static void unlock(void) {
-  if (state_fd >= 0) {
-    flock(state_fd, LOCK_UN);
-    close(state_fd);
-    state_fd = -1;
-  }
+static uint64_t dock_now_ms(void *context) {
+  (void)context;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
 }
 
-/* ------------------------------------------------------------------ */
-/* Watch                                                                */
-/* ------------------------------------------------------------------ */
-
-struct Watch {
-  int fd;
-  const char *path;
+static const struct dock_ops macos_dock_ops = {
+    .write_preferences = dock_write_preferences,
+    .find_dock = dock_find,
+    .terminate = dock_terminate,
+    .wait_exit = dock_wait_exit,
+    .sleep_ms = dock_sleep_ms,
+    .now_ms = dock_now_ms,
 };
 
-static void watch_register(int kq, struct Watch *w) {
-  if (w->fd >= 0)
-    close(w->fd);
-
-  w->fd = open(w->path, O_EVTONLY | O_CREAT, 0644);
-  if (w->fd < 0)
-    return;
-
-  struct kevent ev;
-  EV_SET(&ev, w->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
-         NOTE_WRITE | NOTE_DELETE | NOTE_RENAME, 0, NULL);
-  kevent(kq, &ev, 1, NULL, 0, NULL);
-}
-
 /* ------------------------------------------------------------------ */
-/* Daemon                                                               */
+/* Menu / Dock                                                          */
 /* ------------------------------------------------------------------ */
 
-static void daemonize(void) {
-  if (fork() > 0)
-    exit(0);
-  setsid();
-  if (fork() > 0)
-    exit(0);
-  chdir("/");
-
-  int fd = open("/dev/null", O_RDWR);
-  if (fd >= 0) {
-    dup2(fd, 0);
-    dup2(fd, 1);
-    dup2(fd, 2);
-    if (fd > 2)
-      close(fd);
-  }
-}
-
-static void run_daemon(void) {
-  skylight_init();
-  daemonize();
-  singleton_lock();
-
-  int kq = kqueue();
-
-  struct kevent sigs[2];
-  EV_SET(&sigs[0], SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
-  EV_SET(&sigs[1], SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
-  kevent(kq, sigs, 2, NULL, 0, NULL);
-  signal(SIGTERM, SIG_IGN);
-  signal(SIGINT, SIG_IGN);
-
-  struct kevent timer;
-  EV_SET(&timer, 1, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, 1000, NULL);
-  kevent(kq, &timer, 1, NULL, 0, NULL);
-
-  struct Watch menu = {.fd = -1, .path = STATE_FILE_MENU};
-  struct Watch dock = {.fd = -1, .path = STATE_FILE_DOCK};
-  watch_register(kq, &menu);
-  watch_register(kq, &dock);
-
-  bool menu_hidden = true;
-  bool dock_hidden = true;
-
-  write_state(STATE_FILE_MENU, true);
-  write_state(STATE_FILE_DOCK, true);
-  apply_menu(true);
-  apply_dock(true);
-
-  struct kevent ev;
-  int running = 1;
-
-  while (running) {
-    if (kevent(kq, NULL, 0, &ev, 1, NULL) <= 0)
-      continue;
-
-    if (ev.filter == EVFILT_SIGNAL) {
-      running = 0;
-      continue;
-    }
-
-    if (ev.filter == EVFILT_TIMER) {
-      if (menu_hidden)
-        apply_menu(true);
-      continue;
-    }
-
-    struct Watch *w = NULL;
-    if (ev.ident == (uintptr_t)menu.fd)
-      w = &menu;
-    else if (ev.ident == (uintptr_t)dock.fd)
-      w = &dock;
-    if (!w)
-      continue;
-
-    if (ev.fflags & (NOTE_DELETE | NOTE_RENAME))
-      watch_register(kq, w);
-
-    lock();
-    UIState m = read_state(STATE_FILE_MENU);
-    UIState d = read_state(STATE_FILE_DOCK);
-
-    if (m != ST_UNKNOWN && (m == ST_HIDDEN) != menu_hidden) {
-      menu_hidden = (m == ST_HIDDEN);
-      apply_menu(menu_hidden);
-    }
-    if (d != ST_UNKNOWN && (d == ST_HIDDEN) != dock_hidden) {
-      dock_hidden = (d == ST_HIDDEN);
-      apply_dock(dock_hidden);
-    }
-    unlock();
+static void apply_menu(bool hide) {
+  int cid = fn_conn();
+  if (hide) {
+    fn_vis(cid, 0, true);
+    fn_inset(cid, -200.0, 1.0, 0.0f);
+  } else {
+    fn_vis(cid, 0, false);
+    fn_inset(cid, 0.0, 1.0, 1.0f);
   }
-
-  apply_menu(false);
-  apply_dock(false);
 }
 
-/* ------------------------------------------------------------------ */
-/* CLI toggle                                                           */
-/* ------------------------------------------------------------------ */
-
-static void toggle(const char *path) {
-  lock();
-  UIState s = read_state(path);
-  write_state(path, s == ST_HIDDEN ? false : true);
-  unlock();
+static void apply_dock(bool hide) {
+  DockResult result = dock_apply(&macos_dock_ops, hide, DOCK_TIMEOUT_MS);
+  if (result != DOCK_RELAUNCHED && result != DOCK_NOT_RUNNING)
+    fprintf(stderr, "Dock relaunch failed (%d)\n", result);
 }
 
 /* ------------------------------------------------------------------ */
@@ -368,12 +231,12 @@ static void ax_init(void) {
   }
 }
 
-static void ax_perform_click(AXUIElementRef element) {
+static AXError ax_perform_click(AXUIElementRef element) {
   if (!element)
-    return;
+    return kAXErrorInvalidUIElement;
   AXUIElementPerformAction(element, kAXCancelAction);
   usleep(150000);
-  AXUIElementPerformAction(element, kAXPressAction);
+  return AXUIElementPerformAction(element, kAXPressAction);
 }
 
 static CFStringRef ax_get_title(AXUIElementRef element) {
@@ -384,11 +247,17 @@ static CFStringRef ax_get_title(AXUIElementRef element) {
   return (CFStringRef)title;
 }
 
-/* Returns the front app as an AXUIElementRef via SkyLight PSN lookup.
-   Caller must CFRelease the result. */
-static AXUIElementRef ax_get_front_app(void) {
+/* The active app's pid, kept current by the daemon from NSWorkspace
+   activation notifications; 0 when unknown. */
+static pid_t front_pid;
+
+/* Returns the front app as an AXUIElementRef, via SkyLight PSN lookup unless
+   the daemon already knows it. Caller must CFRelease the result. */
+static AXUIElementRef ax_get_front_app(FILE *err) {
+  if (front_pid)
+    return AXUIElementCreateApplication(front_pid);
   if (!fn_front_process || !fn_get_cid_for_psn || !fn_conn_get_pid) {
-    fprintf(stderr, "SkyLight PSN symbols unavailable\n");
+    fprintf(err, "SkyLight PSN symbols unavailable\n");
     return NULL;
   }
   ProcessSerialNumber psn;
@@ -401,7 +270,7 @@ static AXUIElementRef ax_get_front_app(void) {
 }
 
 /* Print all visible menu bar items of the front app */
-static void ax_print_menu_options(AXUIElementRef app) {
+static void ax_print_menu_options(AXUIElementRef app, FILE *out) {
   AXUIElementRef menubar = NULL;
   CFArrayRef children = NULL;
 
@@ -420,7 +289,7 @@ static void ax_print_menu_options(AXUIElementRef app) {
         CFIndex len = CFStringGetLength(title);
         char buf[2 * len + 1];
         CFStringGetCString(title, buf, sizeof(buf), kCFStringEncodingUTF8);
-        printf("%lld: %s\n", (long long)i, buf);
+        fprintf(out, "%lld: %s\n", (long long)i, buf);
         CFRelease(title);
       }
     }
@@ -452,16 +321,26 @@ static void ax_select_menu_option(AXUIElementRef app, int id) {
   CFRelease(menubar);
 }
 
-/* Find a status-bar extra by "OwnerName,WindowName" alias using CGWindowList,
-   then click it while briefly revealing the menu bar. */
-static void ax_select_menu_extra(const char *alias) {
-  pid_t pid = 0;
-  CGRect bounds = CGRectNull;
+/* Status bar extras by "OwnerName,WindowName" alias (see extras.h). The
+   index is built from CGWindowList on first use and kept until something
+   invalidates it: app launch/termination and display changes in the daemon,
+   or a stale entry found while clicking. */
+
+static struct extra_index extras;
+
+static void extras_release(void *element) { CFRelease(element); }
 
+static void extras_invalidate(void) { extras.valid = false; }
+
+static void extras_rebuild(void) {
   CFArrayRef wlist =
       CGWindowListCopyWindowInfo(kCGWindowListOptionAll, kCGNullWindowID);
-  CFIndex n = CFArrayGetCount(wlist);
-  for (CFIndex i = 0; i < n; i++) {
+  CFIndex n = wlist ? CFArrayGetCount(wlist) : 0;
+  struct extra_window *windows = calloc(n + 1, sizeof(*windows));
+  char(*names)[2][256] = calloc(n + 1, sizeof(*names));
+  uint32_t count = 0;
+
+  for (CFIndex i = 0; windows && names && i < n; i++) {
     CFDictionaryRef d = CFArrayGetValueAtIndex(wlist, i);
     if (!d)
       continue;
@@ -475,67 +354,63 @@ static void ax_select_menu_extra(const char *alias) {
     if (!owner_ref || !name_ref || !pid_ref || !layer_ref || !bounds_ref)
       continue;
 
+    /* Only status bar windows are converted to C strings */
     long long layer = 0;
     CFNumberGetValue(layer_ref, kCFNumberLongLongType, &layer);
-    if (layer != 0x19)
+    if (layer != EXTRA_LAYER)
       continue;
 
     CGRect r = CGRectNull;
     if (!CGRectMakeWithDictionaryRepresentation(bounds_ref, &r))
       continue;
 
-    char owner[256], name[256], combined[512];
-    CFStringGetCString(owner_ref, owner, sizeof(owner), kCFStringEncodingUTF8);
-    CFStringGetCString(name_ref, name, sizeof(name), kCFStringEncodingUTF8);
-    snprintf(combined, sizeof(combined), "%s,%s", owner, name);
-
-    if (strcmp(combined, alias) == 0) {
-      uint64_t p = 0;
-      CFNumberGetValue(pid_ref, kCFNumberSInt64Type, &p);
-      pid = (pid_t)p;
-      bounds = r;
-      break;
-    }
-  }
-  CFRelease(wlist);
-  if (!pid) {
-    fprintf(stderr, "Menu extra not found: %s\n", alias);
-    return;
+    uint64_t p = 0;
+    CFNumberGetValue(pid_ref, kCFNumberSInt64Type, &p);
+    CFStringGetCString(owner_ref, names[count][0], sizeof(names[count][0]),
+                       kCFStringEncodingUTF8);
+    CFStringGetCString(name_ref, names[count][1], sizeof(names[count][1]),
+                       kCFStringEncodingUTF8);
+    windows[count] = (struct extra_window){
+        names[count][0], names[count][1], (pid_t)p, layer,
+        r.origin.x,      r.origin.y,      r.size.width, r.size.height};
+    count++;
   }
 
-  AXUIElementRef app = AXUIElementCreateApplication(pid);
+  extra_index_build(&extras, windows, count, extras_release);
+  free(windows);
+  free(names);
+  if (wlist)
+    CFRelease(wlist);
+}
+
+/* The AX element among the app's extras at the window's position */
+static AXUIElementRef extras_resolve(const struct extra *extra) {
+  AXUIElementRef app = AXUIElementCreateApplication(extra->pid);
   if (!app)
-    return;
+    return NULL;
 
-  CFTypeRef extras = NULL;
+  CFTypeRef bar = NULL;
   CFArrayRef children = NULL;
   AXUIElementRef result = NULL;
 
-  if (AXUIElementCopyAttributeValue(app, kAXExtrasMenuBarAttribute, &extras) ==
+  if (AXUIElementCopyAttributeValue(app, kAXExtrasMenuBarAttribute, &bar) ==
       kAXErrorSuccess) {
-    if (AXUIElementCopyAttributeValue(extras, kAXVisibleChildrenAttribute,
+    if (AXUIElementCopyAttributeValue(bar, kAXVisibleChildrenAttribute,
                                       (CFTypeRef *)&children) ==
         kAXErrorSuccess) {
       CFIndex count = CFArrayGetCount(children);
       for (CFIndex i = 0; i < count; i++) {
         AXUIElementRef item =
             (AXUIElementRef)CFArrayGetValueAtIndex(children, i);
-        CFTypeRef pos_ref = NULL, size_ref = NULL;
+        CFTypeRef pos_ref = NULL;
         AXUIElementCopyAttributeValue(item, kAXPositionAttribute, &pos_ref);
-        AXUIElementCopyAttributeValue(item, kAXSizeAttribute, &size_ref);
-        if (!pos_ref || !size_ref) {
-          if (pos_ref)
-            CFRelease(pos_ref);
-          if (size_ref)
-            CFRelease(size_ref);
+        if (!pos_ref)
           continue;
-        }
         CGPoint pos = CGPointZero;
         AXValueGetValue((AXValueRef)pos_ref, kAXValueCGPointType, &pos);
         CFRelease(pos_ref);
-        CFRelease(size_ref);
 
-        if (fabs(pos.x - bounds.origin.x) <= 10) {
+        if (fabs(pos.x - extra->x) <= 10) {
           result = item;
           CFRetain(result);
           break;
@@ -543,27 +418,641 @@ static void ax_select_menu_extra(const char *alias) {
       }
       CFRelease(children);
     }
-    CFRelease(extras);
+    CFRelease(bar);
   }
   CFRelease(app);
+  return result;
+}
 
-  if (!result) {
-    fprintf(stderr, "Could not locate extra element\n");
-    return;
-  }
-
-  /* Briefly reveal the menu bar, click, then re-hide */
+/* Click an extra while briefly revealing the menu bar */
+static bool ax_click_extra(AXUIElementRef element) {
   int cid = fn_conn();
   fn_vis(cid, 0, false);
   fn_inset(cid, 0.0, 1.0, 1.0f);
   usleep(50000);
 
-  ax_perform_click(result);
+  AXError error = ax_perform_click(element);
 
   fn_vis(cid, 0, true);
   fn_inset(cid, -200.0, 1.0, 0.0f);
+  return error == kAXErrorSuccess;
+}
+
+/* Resolves through the index; a miss or a stale element rebuilds it once,
+   since extras come and go without their app launching or quitting. */
+static bool ax_select_menu_extra(const char *alias, FILE *err) {
+  bool rebuilt = false;
+  if (!extras.valid) {
+    extras_rebuild();
+    rebuilt = true;
+  }
+
+  for (;;) {
+    struct extra *extra = extra_index_find(&extras, alias);
+    if (extra && !extra->element)
+      extra->element = (void *)extras_resolve(extra);
+    if (extra && extra->element && ax_click_extra(extra->element))
+      return true;
+    if (rebuilt) {
+      if (!extra)
+        fprintf(err, "Menu extra not found: %s\n", alias);
+      else
+        fprintf(err, "Could not locate extra element\n");
+      return false;
+    }
+    extras_rebuild();
+    rebuilt = true;
+  }
+}
+
+/* -l and -s <id|alias>, shared by the CLI and the daemon; args start at the
+   option. Expects SkyLight and AX to be set up. Returns the exit status. */
+static int ax_command(int argc, char **argv, FILE *out, FILE *err) {
+  bool list = !strcmp(argv[0], "-l");
+  if (!list && (strcmp(argv[0], "-s") || argc != 2)) {
+    fprintf(err, "Unknown option: %s\n", argv[0]);
+    return 1;
+  }
+
+  int id = 0;
+  if (!list && sscanf(argv[1], "%d", &id) != 1)
+    return ax_select_menu_extra(argv[1], err) ? 0 : 1;
 
-  CFRelease(result);
+  AXUIElementRef app = ax_get_front_app(err);
+  if (!app)
+    return 1;
+  if (list)
+    ax_print_menu_options(app, out);
+  else
+    ax_select_menu_option(app, id);
+  CFRelease(app);
+  return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Locks                                                                */
+/* ------------------------------------------------------------------ */
+
+static int daemon_fd = -1;
+static int state_fd = -1;
+
+static void singleton_lock(void) {
+  daemon_fd = open(DAEMON_LOCK_FILE, O_CREAT | O_RDWR, 0644);
+  if (daemon_fd < 0)
+    exit(1);
+  if (flock(daemon_fd, LOCK_EX | LOCK_NB) < 0)
+    exit(0); /* already running */
+}
+
+static void lock(void) {
+  state_fd = open(STATE_LOCK_FILE, O_CREAT | O_RDWR, 0644);
+  if (state_fd >= 0)
+    flock(state_fd, LOCK_EX);
+}
+
+static void unlock(void) {
+  if (state_fd >= 0) {
+    flock(state_fd, LOCK_UN);
+    close(state_fd);
+    state_fd = -1;
+  }
+}
+
+/* ------------------------------------------------------------------ */
+/* Watch                                                                */
+/* ------------------------------------------------------------------ */
+
+struct Watch {
+  int fd;
+  const char *path;
+};
+
+static void watch_register(int kq, struct Watch *w) {
+  if (w->fd >= 0)
+    close(w->fd);
+
+  w->fd = open(w->path, O_EVTONLY | O_CREAT, 0644);
+  if (w->fd < 0)
+    return;
+
+  struct kevent ev;
+  EV_SET(&ev, w->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+         NOTE_WRITE | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+  kevent(kq, &ev, 1, NULL, 0, NULL);
+}
+
+/* ------------------------------------------------------------------ */
+/* Command channel                                                      */
+/* ------------------------------------------------------------------ */
+
+/* One request per connection, one line each way; command.h has the grammar.
+   The reply ("menu=1 dock=1", or "error") is sent once the change has been
+   applied, so a client's round trip is the full keypress-to-apply time. The
+   state files stay as persistence and for writers that predate the socket.
+   "stats" answers with how often each cause re-hid the menu bar. "exec" runs
+   -l/-s in the daemon, where SkyLight, AX and the extras index are already
+   warm, and answers "<status> <stdout length>" followed by stdout and
+   stderr. */
+
+struct UI {
+  bool menu_hidden;
+  bool dock_hidden;
+  unsigned long rehides[REHIDE_CAUSES];
+};
+
+static int command_listen(void) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", DAEMON_SOCKET);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  /* Holding the singleton lock means any existing socket file is stale */
+  unlink(DAEMON_SOCKET);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 8) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void set_socket_timeouts(int fd, int ms) {
+  struct timeval timeout = {ms / 1000, (ms % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+static void set_menu(struct UI *ui, bool hidden) {
+  if (ui->menu_hidden == hidden)
+    return;
+  ui->menu_hidden = hidden;
+  apply_menu(hidden);
+}
+
+static void set_dock(struct UI *ui, bool hidden) {
+  if (ui->dock_hidden == hidden)
+    return;
+  ui->dock_hidden = hidden;
+  apply_dock(hidden);
+}
+
+static void command_apply(struct UI *ui, const struct command *command) {
+  if (command->verb == COMMAND_TOGGLE) {
+    if (command->menu)
+      set_menu(ui, !ui->menu_hidden);
+    if (command->dock)
+      set_dock(ui, !ui->dock_hidden);
+  } else if (command->verb == COMMAND_SET) {
+    if (command->menu)
+      set_menu(ui, command->hide);
+    if (command->dock)
+      set_dock(ui, command->hide);
+  } else {
+    return;
+  }
+
+  lock();
+  write_state(STATE_FILE_MENU, ui->menu_hidden);
+  write_state(STATE_FILE_DOCK, ui->dock_hidden);
+  unlock();
+}
+
+static void send_all(int fd, const char *data, size_t len) {
+  while (len) {
+    ssize_t sent = send(fd, data, len, 0);
+    if (sent <= 0)
+      return;
+    data += sent;
+    len -= sent;
+  }
+}
+
+static void command_exec(int fd, char *args) {
+  char *argv[4];
+  int argc = 0;
+  for (char *arg = strtok(args, "\t"); arg && argc < 4;
+       arg = strtok(NULL, "\t"))
+    argv[argc++] = arg;
+
+  char *out_text = NULL, *err_text = NULL;
+  size_t out_len = 0, err_len = 0;
+  FILE *out = open_memstream(&out_text, &out_len);
+  FILE *err = open_memstream(&err_text, &err_len);
+  int status = 1;
+  if (out && err) {
+    if (!AXIsProcessTrusted())
+      fprintf(err, "Accessibility permission required\n");
+    else if (argc)
+      status = ax_command(argc, argv, out, err);
+  }
+  if (out)
+    fclose(out);
+  if (err)
+    fclose(err);
+
+  char header[32];
+  snprintf(header, sizeof(header), "%d %zu\n", status, out_len);
+  send_all(fd, header, strlen(header));
+  send_all(fd, out_text ? out_text : "", out_len);
+  send_all(fd, err_text ? err_text : "", err_len);
+  free(out_text);
+  free(err_text);
+}
+
+static void command_accept(int server, struct UI *ui) {
+  int fd = accept(server, NULL, NULL);
+  if (fd < 0)
+    return;
+  set_socket_timeouts(fd, 100);
+
+  char request[EXTRA_ALIAS_SIZE + 16];
+  size_t len = 0;
+  ssize_t got;
+  while (len + 1 < sizeof(request) &&
+         (got = recv(fd, request + len, sizeof(request) - 1 - len, 0)) > 0) {
+    len += got;
+    if (request[len - 1] == '\n')
+      break;
+  }
+  if (len > 0) {
+    request[len] = '\0';
+    request[strcspn(request, "\r\n")] = '\0';
+    struct command command = command_parse(request);
+    char reply[REHIDE_STATS_SIZE];
+    if (command.verb == COMMAND_EXEC) {
+      command_exec(fd, command.args);
+      close(fd);
+      return;
+    } else if (command.verb == COMMAND_STATS) {
+      rehide_format_stats(ui->rehides, reply, sizeof(reply));
+    } else if (command.verb != COMMAND_INVALID) {
+      command_apply(ui, &command);
+      snprintf(reply, sizeof(reply), "menu=%d dock=%d\n", ui->menu_hidden,
+               ui->dock_hidden);
+    } else {
+      snprintf(reply, sizeof(reply), "error\n");
+    }
+    send(fd, reply, strlen(reply), 0);
+  }
+  close(fd);
+}
+
+/* Sends one request to the daemon; -1 when no daemon took it */
+static int command_connect(const char *request) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", DAEMON_SOCKET);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  /* A dock change waits for the Dock to relaunch */
+  set_socket_timeouts(fd, DOCK_TIMEOUT_MS + 1000);
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      send(fd, request, strlen(request), 0) != (ssize_t)strlen(request)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* One request with a one-line reply; false when no daemon answered */
+static bool command_send(const char *request, char *reply, size_t size) {
+  int fd = command_connect(request);
+  size_t got = 0;
+  if (fd >= 0) {
+    ssize_t len;
+    while (got + 1 < size &&
+           (len = recv(fd, reply + got, size - 1 - got, 0)) > 0)
+      got += len;
+    close(fd);
+  }
+  reply[got] = '\0';
+  return got > 0;
+}
+
+/* Runs -l/-s in the daemon; returns its exit status, or -1 when no daemon
+   answered and the caller has to run it in-process. Once the header is in,
+   the daemon has run the command, so a reply cut short is reported rather
+   than run a second time. */
+static int command_forward(int argc, char **argv) {
+  char request[EXTRA_ALIAS_SIZE + 16];
+  int used = snprintf(request, sizeof(request), "exec");
+  for (int i = 0; i < argc && used < (int)sizeof(request); i++)
+    used += snprintf(request + used, sizeof(request) - used, "\t%s", argv[i]);
+  if (used + 1 >= (int)sizeof(request))
+    return -1;
+  strcat(request, "\n");
+
+  int fd = command_connect(request);
+  if (fd < 0)
+    return -1;
+  size_t length;
+  char *reply = command_recv_all(fd, &length);
+  close(fd);
+
+  struct command_output output;
+  if (!reply || !command_parse_output(reply, length, &output)) {
+    free(reply);
+    return -1;
+  }
+  fwrite(output.out, 1, output.out_len, stdout);
+  fwrite(output.err, 1, output.err_len, stderr);
+  free(reply);
+  if (!output.complete) {
+    fprintf(stderr, "Reply from the daemon was cut short\n");
+    return 1;
+  }
+  return output.status;
+}
+
+/* ------------------------------------------------------------------ */
+/* Re-hide                                                              */
+/* ------------------------------------------------------------------ */
+
+/* The WindowServer drops the menu bar override on display reconfiguration,
+   space changes, app activation and wake. The daemon re-applies it on those
+   events only; a slow timer catches anything they miss. Display changes come
+   from CoreGraphics, the rest from NSWorkspace's notification center, which
+   is reached through the Objective-C runtime to keep this file plain C. */
+
+#define REHIDE_SAFETY_MS 30000
+
+static struct UI *rehide_ui;
+
+static void rehide(RehideCause cause) {
+  if (rehide_ui &&
+      rehide_note(rehide_ui->rehides, rehide_ui->menu_hidden, cause))
+    apply_menu(true);
+}
+
+static void rehide_display(CGDirectDisplayID display,
+                           CGDisplayChangeSummaryFlags flags, void *context) {
+  (void)display;
+  (void)context;
+  if (!(flags & kCGDisplayBeginConfigurationFlag)) {
+    extras_invalidate();
+    rehide(REHIDE_DISPLAY);
+  }
+}
+
+static void rehide_space(id self, SEL cmd, id note) {
+  (void)self;
+  (void)cmd;
+  (void)note;
+  rehide(REHIDE_SPACE);
+}
+
+static void rehide_front_app(id self, SEL cmd, id note) {
+  (void)self;
+  (void)cmd;
+  /* note.userInfo[NSWorkspaceApplicationKey].processIdentifier, kept for
+     the -l/-s requests the daemon serves */
+  id info = ((id(*)(id, SEL))objc_msgSend)(note, sel_registerName("userInfo"));
+  id app = ((id(*)(id, SEL, id))objc_msgSend)(
+      info, sel_registerName("objectForKey:"),
+      (id)CFSTR("NSWorkspaceApplicationKey"));
+  if (app)
+    front_pid = ((pid_t(*)(id, SEL))objc_msgSend)(
+        app, sel_registerName("processIdentifier"));
+  rehide(REHIDE_FRONT_APP);
+}
+
+static void rehide_wake(id self, SEL cmd, id note) {
+  (void)self;
+  (void)cmd;
+  (void)note;
+  rehide(REHIDE_WAKE);
+}
+
+/* Launching and quitting apps add and remove extras and shift the others */
+static void extras_apps_changed(id self, SEL cmd, id note) {
+  (void)self;
+  (void)cmd;
+  (void)note;
+  extras_invalidate();
+}
+
+static void workspace_observe(struct UI *ui) {
+  rehide_ui = ui;
+  CGDisplayRegisterReconfigurationCallback(rehide_display, NULL);
+
+  struct {
+    const char *selector;
+    IMP handler;
+    CFStringRef notification;
+  } subscriptions[] = {
+      {"spaceChanged:", (IMP)rehide_space,
+       CFSTR("NSWorkspaceActiveSpaceDidChangeNotification")},
+      {"appActivated:", (IMP)rehide_front_app,
+       CFSTR("NSWorkspaceDidActivateApplicationNotification")},
+      {"didWake:", (IMP)rehide_wake, CFSTR("NSWorkspaceDidWakeNotification")},
+      {"appLaunched:", (IMP)extras_apps_changed,
+       CFSTR("NSWorkspaceDidLaunchApplicationNotification")},
+      {"appTerminated:", (IMP)extras_apps_changed,
+       CFSTR("NSWorkspaceDidTerminateApplicationNotification")},
+  };
+  int count = sizeof(subscriptions) / sizeof(subscriptions[0]);
+
+  Class workspace_class = objc_getClass("NSWorkspace");
+  Class observer_class =
+      objc_allocateClassPair(objc_getClass("NSObject"), "MenusObserver", 0);
+  if (!workspace_class || !observer_class)
+    return;
+  for (int i = 0; i < count; i++)
+    class_addMethod(observer_class, sel_registerName(subscriptions[i].selector),
+                    subscriptions[i].handler, "v@:@");
+  objc_registerClassPair(observer_class);
+
+  id observer = ((id(*)(Class, SEL))objc_msgSend)(observer_class,
+                                                   sel_registerName("new"));
+  id workspace = ((id(*)(Class, SEL))objc_msgSend)(
+      workspace_class, sel_registerName("sharedWorkspace"));
+  id center = ((id(*)(id, SEL))objc_msgSend)(
+      workspace, sel_registerName("notificationCenter"));
+  for (int i = 0; i < count; i++)
+    ((void (*)(id, SEL, id, SEL, id, id))objc_msgSend)(
+        center, sel_registerName("addObserver:selector:name:object:"),
+        observer, sel_registerName(subscriptions[i].selector),
+        (id)subscriptions[i].notification, NULL);
+}
+
+/* ------------------------------------------------------------------ */
+/* Daemon                                                               */
+/* ------------------------------------------------------------------ */
+
+static void daemonize(void) {
+  if (fork() > 0)
+    exit(0);
+  setsid();
+  if (fork() > 0)
+    exit(0);
+  chdir("/");
+
+  int fd = open("/dev/null", O_RDWR);
+  if (fd >= 0) {
+    dup2(fd, 0);
+    dup2(fd, 1);
+    dup2(fd, 2);
+    if (fd > 2)
+      close(fd);
+  }
+}
+
+/* The kqueue (signals, safety timer, state files, command socket) is served
+   from the main run loop, which also delivers the re-hide notifications. */
+
+struct Daemon {
+  int kq;
+  int server;
+  struct Watch menu;
+  struct Watch dock;
+  struct UI ui;
+};
+
+static void daemon_handle(struct Daemon *daemon, const struct kevent *ev) {
+  if (ev->filter == EVFILT_SIGNAL) {
+    CFRunLoopStop(CFRunLoopGetMain());
+    return;
+  }
+
+  if (ev->filter == EVFILT_TIMER) {
+    rehide(REHIDE_TIMER);
+    return;
+  }
+
+  if (ev->filter == EVFILT_READ && ev->ident == (uintptr_t)daemon->server) {
+    command_accept(daemon->server, &daemon->ui);
+    return;
+  }
+
+  struct Watch *w = NULL;
+  if (ev->ident == (uintptr_t)daemon->menu.fd)
+    w = &daemon->menu;
+  else if (ev->ident == (uintptr_t)daemon->dock.fd)
+    w = &daemon->dock;
+  if (!w)
+    return;
+
+  if (ev->fflags & (NOTE_DELETE | NOTE_RENAME))
+    watch_register(daemon->kq, w);
+
+  lock();
+  UIState m = read_state(STATE_FILE_MENU);
+  UIState d = read_state(STATE_FILE_DOCK);
+
+  if (m != ST_UNKNOWN)
+    set_menu(&daemon->ui, m == ST_HIDDEN);
+  if (d != ST_UNKNOWN)
+    set_dock(&daemon->ui, d == ST_HIDDEN);
+  unlock();
+}
+
+static void daemon_kqueue_ready(CFFileDescriptorRef ref, CFOptionFlags flags,
+                                void *info) {
+  (void)flags;
+  struct Daemon *daemon = info;
+  struct timespec poll = {0, 0};
+  struct kevent ev;
+  while (kevent(daemon->kq, NULL, 0, &ev, 1, &poll) > 0)
+    daemon_handle(daemon, &ev);
+  CFFileDescriptorEnableCallBacks(ref, kCFFileDescriptorReadCallBack);
+}
+
+static void run_daemon(void) {
+  /* Fork before touching CoreFoundation: the run loop is not fork-safe */
+  daemonize();
+  singleton_lock();
+  skylight_init();
+
+  struct Daemon daemon = {
+      .kq = kqueue(),
+      .menu = {.fd = -1, .path = STATE_FILE_MENU},
+      .dock = {.fd = -1, .path = STATE_FILE_DOCK},
+      .ui = {.menu_hidden = true, .dock_hidden = true},
+  };
+  int kq = daemon.kq;
+
+  struct kevent sigs[2];
+  EV_SET(&sigs[0], SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+  EV_SET(&sigs[1], SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+  kevent(kq, sigs, 2, NULL, 0, NULL);
+  signal(SIGTERM, SIG_IGN);
+  signal(SIGINT, SIG_IGN);
+
+  struct kevent timer;
+  EV_SET(&timer, 1, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, REHIDE_SAFETY_MS,
+         NULL);
+  kevent(kq, &timer, 1, NULL, 0, NULL);
+
+  watch_register(kq, &daemon.menu);
+  watch_register(kq, &daemon.dock);
+
+  daemon.server = command_listen();
+  if (daemon.server >= 0) {
+    struct kevent ev;
+    EV_SET(&ev, daemon.server, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    kevent(kq, &ev, 1, NULL, 0, NULL);
+  }
+
+  write_state(STATE_FILE_MENU, true);
+  write_state(STATE_FILE_DOCK, true);
+  apply_menu(true);
+  apply_dock(true);
+
+  workspace_observe(&daemon.ui);
+
+  CFFileDescriptorContext context = {.info = &daemon};
+  CFFileDescriptorRef kq_ref = CFFileDescriptorCreate(
+      kCFAllocatorDefault, kq, false, daemon_kqueue_ready, &context);
+  CFRunLoopSourceRef source =
+      CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, kq_ref, 0);
+  CFRunLoopAddSource(CFRunLoopGetMain(), source, kCFRunLoopDefaultMode);
+  CFFileDescriptorEnableCallBacks(kq_ref, kCFFileDescriptorReadCallBack);
+  CFRunLoopRun();
+
+  CFRunLoopRemoveSource(CFRunLoopGetMain(), source, kCFRunLoopDefaultMode);
+  CFRelease(source);
+  CFFileDescriptorInvalidate(kq_ref);
+  CFRelease(kq_ref);
+
+  if (daemon.server >= 0) {
+    close(daemon.server);
+    unlink(DAEMON_SOCKET);
+  }
+  apply_menu(false);
+  apply_dock(false);
+}
+
+/* ------------------------------------------------------------------ */
+/* CLI toggle                                                           */
+/* ------------------------------------------------------------------ */
+
+/* Through the daemon when it runs; otherwise only the state file changes
+   and the next daemon picks it up. */
+static void toggle(const char *target) {
+  char request[32], reply[32];
+  snprintf(request, sizeof(request), "toggle %s\n", target);
+  if (command_send(request, reply, sizeof(reply)))
+    return;
+
+  const char *paths[] = {STATE_FILE_MENU, STATE_FILE_DOCK};
+  bool both = !strcmp(target, "both");
+  for (int i = 0; i < 2; i++) {
+    if (!both && strcmp(target, i ? "dock" : "menu"))
+      continue;
+    lock();
+    UIState s = read_state(paths[i]);
+    write_state(paths[i], s == ST_HIDDEN ? false : true);
+    unlock();
+  }
 }
 
 /* ------------------------------------------------------------------ */
@@ -577,6 +1066,8 @@ int main(int argc, char **argv) {
            "  -tm       toggle menu bar\n"
            "  -td       toggle dock\n"
            "  -t        toggle both\n"
+           "  -q        print the daemon's menu/dock state\n"
+           "  -q stats  print how often each cause re-hid the menu bar\n"
            "  -l        list front app's menu bar items\n"
            "  -s <id>   click menu bar item by index (front app)\n"
            "  -s <str>  click status bar extra by 'Owner,Name' alias\n");
@@ -586,33 +1077,33 @@ int main(int argc, char **argv) {
   if (!strcmp(argv[1], "-d")) {
     run_daemon();
   } else if (!strcmp(argv[1], "-tm")) {
-    toggle(STATE_FILE_MENU);
+    toggle("menu");
   } else if (!strcmp(argv[1], "-td")) {
-    toggle(STATE_FILE_DOCK);
+    toggle("dock");
   } else if (!strcmp(argv[1], "-t")) {
-    toggle(STATE_FILE_MENU);
-    toggle(STATE_FILE_DOCK);
-  } else if (!strcmp(argv[1], "-l")) {
-    skylight_init();
-    ax_init();
-    AXUIElementRef app = ax_get_front_app();
-    if (!app)
+    toggle("both");
+  } else if (!strcmp(argv[1], "-q")) {
+    char reply[REHIDE_STATS_SIZE];
+    bool stats = argc == 3 && !strcmp(argv[2], "stats");
+    if (argc > 2 && !stats) {
+      fprintf(stderr, "Unknown option: %s\n", argv[2]);
+      return 1;
+    }
+    if (!command_send(stats ? "stats\n" : "query\n", reply, sizeof(reply))) {
+      fprintf(stderr, "Daemon not running\n");
       return 1;
-    ax_print_menu_options(app);
-    CFRelease(app);
-  } else if (!strcmp(argv[1], "-s") && argc == 3) {
+    }
+    printf("%s", reply);
+  } else if (!strcmp(argv[1], "-l") || (!strcmp(argv[1], "-s") && argc == 3)) {
+    /* The daemon has everything warm; MENUS_NO_DAEMON forces the cold path,
+       e.g. to compare the two */
+    int status =
+        getenv("MENUS_NO_DAEMON") ? -1 : command_forward(argc - 1, argv + 1);
+    if (status >= 0)
+      return status;
     skylight_init();
     ax_init();
-    int id = 0;
-    if (sscanf(argv[2], "%d", &id) == 1) {
-      AXUIElementRef app = ax_get_front_app();
-      if (!app)
-        return 1;
-      ax_select_menu_option(app, id);
-      CFRelease(app);
-    } else {
-      ax_select_menu_extra(argv[2]);
-    }
+    return ax_command(argc - 1, argv + 1, stdout, stderr);
   } else {
     fprintf(stderr, "Unknown option: %s\n", argv[1]);
     return 1;
@@ -0,0 +1,54 @@
+#pragma once
+
+/* Counting the daemon's re-hides of the menu bar by cause, and the "stats"
+   reply that reports them. Free of macOS APIs like dock.h: menus.c calls
+   rehide_note from its event handlers and only re-applies the override when
+   it returns true.
+
+     display=3 space=41 front_app=212 wake=2 timer=17 */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum {
+  REHIDE_DISPLAY,
+  REHIDE_SPACE,
+  REHIDE_FRONT_APP,
+  REHIDE_WAKE,
+  REHIDE_TIMER,
+  REHIDE_CAUSES
+} RehideCause;
+
+static const char *const rehide_names[REHIDE_CAUSES] = {
+    "display", "space", "front_app", "wake", "timer"};
+
+/* Fits the reply with every counter at ULONG_MAX */
+#define REHIDE_STATS_SIZE 160
+
+/* Only a hidden menu bar needs hiding again, and only that is counted */
+static inline bool rehide_note(unsigned long *rehides, bool menu_hidden,
+                               RehideCause cause) {
+  if (!menu_hidden)
+    return false;
+  rehides[cause]++;
+  return true;
+}
+
+/* A buffer shorter than REHIDE_STATS_SIZE gets a truncated, terminated
+   reply */
+static inline void rehide_format_stats(const unsigned long *rehides,
+                                       char *reply, size_t size) {
+  size_t used = 0;
+  reply[0] = '\0';
+  for (int i = 0; i <= REHIDE_CAUSES && used < size; i++) {
+    int length =
+        i == REHIDE_CAUSES
+            ? snprintf(reply + used, size - used, "\n")
+            : snprintf(reply + used, size - used, "%s%s=%lu", i ? " " : "",
+                       rehide_names[i], rehides[i]);
+    if (length < 0)
+      return;
+    used += (size_t)length;
+  }
+}
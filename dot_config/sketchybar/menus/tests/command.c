@@ -0,0 +1,184 @@
+/* command_parse against the requests the CLI sends and ones it never does:
+   each verb with its targets and values, exec keeping its arguments in
+   place, and prefixes, trailing words and overlong words all rejected.
+   Then exec replies over a socket pair: megabytes of -l output arrive
+   whole, and a reply cut short or without a header is told apart. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "../../trash/tests/check.h"
+#include "../command.h"
+
+/* Parses a copy, so the literal stays intact for the failure message */
+static struct command parse(const char *request) {
+  static char copy[128];
+  snprintf(copy, sizeof(copy), "%s", request);
+  return command_parse(copy);
+}
+
+static bool targets(struct command command, bool menu, bool dock) {
+  return command.menu == menu && command.dock == dock;
+}
+
+static void check_sent(void) {
+  CHECK(parse("query").verb == COMMAND_QUERY);
+  CHECK(parse("stats").verb == COMMAND_STATS);
+
+  struct command command = parse("toggle menu");
+  CHECK(command.verb == COMMAND_TOGGLE && targets(command, true, false));
+  command = parse("toggle dock");
+  CHECK(command.verb == COMMAND_TOGGLE && targets(command, false, true));
+  command = parse("toggle both");
+  CHECK(command.verb == COMMAND_TOGGLE && targets(command, true, true));
+
+  command = parse("set menu 1");
+  CHECK(command.verb == COMMAND_SET && targets(command, true, false));
+  CHECK(command.hide);
+  command = parse("set dock 0");
+  CHECK(command.verb == COMMAND_SET && targets(command, false, true));
+  CHECK(!command.hide);
+  command = parse("set both 1");
+  CHECK(command.verb == COMMAND_SET && targets(command, true, true));
+}
+
+static void check_exec(void) {
+  char request[] = "exec\t-s\tControl Center,WiFi";
+  struct command command = command_parse(request);
+  CHECK(command.verb == COMMAND_EXEC);
+  CHECK(command.args == request + 5);
+  CHECK(strcmp(command.args, "-s\tControl Center,WiFi") == 0);
+
+  CHECK(parse("exec\t-l").verb == COMMAND_EXEC);
+  CHECK(parse("exec -l").verb == COMMAND_INVALID);
+}
+
+/* Spacing around words does not matter; anything left over does. */
+static void check_spacing(void) {
+  CHECK(parse("  query  ").verb == COMMAND_QUERY);
+  CHECK(parse("toggle   menu ").verb == COMMAND_TOGGLE);
+  CHECK(parse("set dock  1").verb == COMMAND_SET);
+}
+
+static void check_rejected(void) {
+  const char *requests[] = {
+      "",
+      "   ",
+      "statsx",
+      "stats menu",
+      "querying",
+      "query menu",
+      "toggle",
+      "toggle bar",
+      "toggle menu dock",
+      "togglemenu",
+      "toggle menu 1",
+      "set menu",
+      "set menu 2",
+      "set menu -1",
+      "set menu x",
+      "set menu 1x",
+      "set menu 1 1",
+      "set bar 1",
+      "hide menu",
+      "toggle menuuuuuuuuuuuuuuuuuu",
+      "toggleeeeeeeeeeeeeeeeeeeee menu",
+      "exec",
+  };
+  for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+    if (parse(requests[i]).verb != COMMAND_INVALID) {
+      fprintf(stderr, "accepted '%s'\n", requests[i]);
+      CHECK(parse(requests[i]).verb == COMMAND_INVALID);
+    }
+  }
+}
+
+/* What command_exec sends, written by a child the way the daemon would */
+static char *exchange(const char *header, const char *out, size_t out_len,
+                      const char *err, size_t err_len, size_t *length) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return NULL;
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    const char *parts[] = {header, out, err};
+    size_t lengths[] = {strlen(header), out_len, err_len};
+    for (int i = 0; i < 3; i++)
+      for (size_t sent = 0; sent < lengths[i];) {
+        ssize_t wrote = send(fds[1], parts[i] + sent, lengths[i] - sent, 0);
+        if (wrote <= 0)
+          _exit(1);
+        sent += wrote;
+      }
+    _exit(0);
+  }
+  close(fds[1]);
+  char *reply = command_recv_all(fds[0], length);
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+  return reply;
+}
+
+/* Far past the 64 KiB the reply used to be cut at, with a NUL in stdout */
+static void check_large_reply(void) {
+  size_t out_len = 3 << 20;
+  char *out = malloc(out_len);
+  for (size_t i = 0; i < out_len; i++)
+    out[i] = "0123456789\n"[i % 11];
+  out[1000] = '\0';
+  char header[32];
+  snprintf(header, sizeof(header), "0 %zu\n", out_len);
+
+  size_t length;
+  char *reply = exchange(header, out, out_len, "warning\n", 8, &length);
+  struct command_output output;
+  CHECK(reply && command_parse_output(reply, length, &output));
+  if (reply) {
+    CHECK(output.complete && output.status == 0);
+    CHECK(output.out_len == out_len && memcmp(output.out, out, out_len) == 0);
+    CHECK(output.err_len == 8 && memcmp(output.err, "warning\n", 8) == 0);
+  }
+  free(reply);
+  free(out);
+}
+
+static void check_short_replies(void) {
+  size_t length;
+  char *reply = exchange("1 100\n", "only part", 9, "", 0, &length);
+  struct command_output output;
+  CHECK(reply && command_parse_output(reply, length, &output));
+  if (reply) {
+    CHECK(!output.complete && output.status == 1);
+    CHECK(output.out_len == 9 && output.err_len == 0);
+  }
+  free(reply);
+
+  reply = exchange("2 0\n", "", 0, "Accessibility permission required\n", 34,
+                   &length);
+  CHECK(reply && command_parse_output(reply, length, &output));
+  if (reply) {
+    CHECK(output.complete && output.status == 2 && output.out_len == 0);
+    CHECK(output.err_len == 34);
+  }
+  free(reply);
+
+  reply = exchange("error\n", "", 0, "", 0, &length);
+  CHECK(reply && !command_parse_output(reply, length, &output));
+  free(reply);
+
+  reply = exchange("", "", 0, "", 0, &length);
+  CHECK(!reply && length == 0);
+}
+
+int main(void) {
+  check_sent();
+  check_exec();
+  check_spacing();
+  check_rejected();
+  check_large_reply();
+  check_short_replies();
+  return check_exit("command");
+}
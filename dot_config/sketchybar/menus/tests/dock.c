@@ -0,0 +1,161 @@
+/* dock_apply driven by a stub ops table on a simulated clock: the order of
+   operations, what each one is given, and that both waits share one
+   deadline. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../../trash/tests/check.h"
+#include "../dock.h"
+
+struct dock_sim {
+  uint64_t now;
+  pid_t dock;          /* the running Dock, 0 when there is none */
+  bool preferences_ok;
+  bool terminate_ok;
+  int terminate_ms;    /* how long terminating takes */
+  int exit_ms;         /* after terminating; -1 never */
+  int launch_ms;       /* after the exit, until launchd's Dock shows up */
+  bool lingers;        /* the old pid stays listed after it exited */
+  uint64_t exited_at;
+  int longest_sleep;
+  char log[512];
+};
+
+static void sim_log(struct dock_sim *sim, const char *format, int value) {
+  size_t caret = strlen(sim->log);
+  snprintf(sim->log + caret, sizeof(sim->log) - caret, format, value);
+}
+
+static bool sim_write_preferences(void *context, bool hide) {
+  struct dock_sim *sim = context;
+  sim_log(sim, "prefs%d ", hide);
+  return sim->preferences_ok;
+}
+
+static pid_t sim_find_dock(void *context, pid_t except) {
+  struct dock_sim *sim = context;
+  if (!sim->dock && sim->exited_at && sim->launch_ms >= 0 &&
+      sim->now >= sim->exited_at + (uint64_t)sim->launch_ms)
+    sim->dock = 200;
+  sim_log(sim, "find%d ", except);
+  return sim->dock != except ? sim->dock : 0;
+}
+
+static bool sim_terminate(void *context, pid_t pid) {
+  struct dock_sim *sim = context;
+  sim_log(sim, "kill%d ", pid);
+  sim->now += sim->terminate_ms;
+  return sim->terminate_ok;
+}
+
+static bool sim_wait_exit(void *context, pid_t pid, int timeout_ms) {
+  struct dock_sim *sim = context;
+  (void)pid;
+  sim_log(sim, "wait%d ", timeout_ms);
+  if (sim->exit_ms < 0 || sim->exit_ms > timeout_ms) {
+    sim->now += timeout_ms;
+    return false;
+  }
+  sim->now += sim->exit_ms;
+  if (!sim->lingers)
+    sim->dock = 0;
+  sim->exited_at = sim->now;
+  return true;
+}
+
+static void sim_sleep_ms(void *context, int ms) {
+  struct dock_sim *sim = context;
+  sim->now += ms;
+  if (ms > sim->longest_sleep)
+    sim->longest_sleep = ms;
+}
+
+static uint64_t sim_now_ms(void *context) {
+  return ((struct dock_sim *)context)->now;
+}
+
+static DockResult run(struct dock_sim *sim) {
+  struct dock_ops ops = {sim,           sim_write_preferences,
+                         sim_find_dock, sim_terminate,
+                         sim_wait_exit, sim_sleep_ms,
+                         sim_now_ms};
+  return dock_apply(&ops, true, DOCK_TIMEOUT_MS);
+}
+
+static struct dock_sim running_dock(void) {
+  struct dock_sim sim = {0};
+  sim.dock = 100;
+  sim.preferences_ok = true;
+  sim.terminate_ok = true;
+  sim.exit_ms = 50;
+  sim.launch_ms = 25;
+  return sim;
+}
+
+static void check_relaunch(void) {
+  struct dock_sim sim = running_dock();
+  CHECK(run(&sim) == DOCK_RELAUNCHED);
+  CHECK(strcmp(sim.log, "prefs1 find0 kill100 wait3000 find100 find100 "
+                        "find100 find100 ") == 0);
+  CHECK(sim.now == 50 + 30);
+  CHECK(sim.longest_sleep == DOCK_LAUNCH_POLL_MS);
+}
+
+/* Preferences still go out; the next Dock launch picks them up. */
+static void check_not_running(void) {
+  struct dock_sim sim = running_dock();
+  sim.dock = 0;
+  CHECK(run(&sim) == DOCK_NOT_RUNNING);
+  CHECK(strcmp(sim.log, "prefs1 find0 ") == 0);
+}
+
+static void check_failures(void) {
+  struct dock_sim sim = running_dock();
+  sim.preferences_ok = false;
+  CHECK(run(&sim) == DOCK_PREFERENCES_FAILED);
+  CHECK(strcmp(sim.log, "prefs1 ") == 0);
+
+  sim = running_dock();
+  sim.terminate_ok = false;
+  CHECK(run(&sim) == DOCK_TERMINATE_FAILED);
+  CHECK(strcmp(sim.log, "prefs1 find0 kill100 ") == 0);
+}
+
+/* Time spent terminating comes out of the wait for the exit. */
+static void check_exit_timeout(void) {
+  struct dock_sim sim = running_dock();
+  sim.terminate_ms = 400;
+  sim.exit_ms = -1;
+  CHECK(run(&sim) == DOCK_EXIT_TIMEOUT);
+  CHECK(strcmp(sim.log, "prefs1 find0 kill100 wait2600 ") == 0);
+  CHECK(sim.now == DOCK_TIMEOUT_MS);
+}
+
+/* The launch wait gets what the exit left over, to the millisecond. */
+static void check_launch_timeout(void) {
+  struct dock_sim sim = running_dock();
+  sim.exit_ms = 2995;
+  sim.launch_ms = -1;
+  CHECK(run(&sim) == DOCK_LAUNCH_TIMEOUT);
+  CHECK(sim.now == DOCK_TIMEOUT_MS);
+  CHECK(sim.longest_sleep == 5);
+}
+
+/* The old Dock lingering in the process table is not a relaunch. */
+static void check_old_pid_ignored(void) {
+  struct dock_sim sim = running_dock();
+  sim.lingers = true;
+  CHECK(run(&sim) == DOCK_LAUNCH_TIMEOUT);
+  CHECK(strstr(sim.log, "find100 ") != NULL);
+}
+
+int main(void) {
+  check_relaunch();
+  check_not_running();
+  check_failures();
+  check_exit_timeout();
+  check_launch_timeout();
+  check_old_pid_ignored();
+  return check_exit("dock");
+}
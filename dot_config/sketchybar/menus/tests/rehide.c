@@ -0,0 +1,75 @@
+/* The re-hide counters and the "stats" reply built from them: a session of
+   events replayed against a menu bar that is shown and hidden in between,
+   the reply at the largest counts, and a buffer too short for it. */
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../../trash/tests/check.h"
+#include "../rehide.h"
+
+/* What the daemon sees over a while: events fire whether or not the menu
+   bar is hidden, and only the hidden ones re-apply the override. */
+static void check_session(void) {
+  unsigned long rehides[REHIDE_CAUSES] = {0};
+  int applied = 0;
+  struct {
+    bool hidden;
+    RehideCause cause;
+  } events[] = {
+      {false, REHIDE_SPACE},     {false, REHIDE_FRONT_APP},
+      {true, REHIDE_FRONT_APP},  {true, REHIDE_FRONT_APP},
+      {true, REHIDE_SPACE},      {true, REHIDE_DISPLAY},
+      {true, REHIDE_TIMER},      {false, REHIDE_WAKE},
+      {false, REHIDE_TIMER},     {true, REHIDE_WAKE},
+      {true, REHIDE_FRONT_APP},
+  };
+  for (size_t i = 0; i < sizeof(events) / sizeof(events[0]); i++)
+    applied += rehide_note(rehides, events[i].hidden, events[i].cause);
+  CHECK(applied == 7);
+
+  char reply[REHIDE_STATS_SIZE];
+  rehide_format_stats(rehides, reply, sizeof(reply));
+  CHECK(strcmp(reply, "display=1 space=1 front_app=3 wake=1 timer=1\n") == 0);
+
+  unsigned long none[REHIDE_CAUSES] = {0};
+  rehide_format_stats(none, reply, sizeof(reply));
+  CHECK(strcmp(reply, "display=0 space=0 front_app=0 wake=0 timer=0\n") == 0);
+}
+
+static void check_largest(void) {
+  unsigned long rehides[REHIDE_CAUSES];
+  for (int i = 0; i < REHIDE_CAUSES; i++)
+    rehides[i] = ULONG_MAX;
+  char reply[REHIDE_STATS_SIZE];
+  rehide_format_stats(rehides, reply, sizeof(reply));
+  size_t length = strlen(reply);
+  CHECK(length > 0 && reply[length - 1] == '\n');
+  char timer[32];
+  snprintf(timer, sizeof(timer), " timer=%lu\n", ULONG_MAX);
+  CHECK(length >= strlen(timer) &&
+        strcmp(reply + length - strlen(timer), timer) == 0);
+}
+
+/* Cut short and terminated, without writing past the buffer. */
+static void check_truncated(void) {
+  unsigned long rehides[REHIDE_CAUSES] = {1, 22, 333, 4444, 55555};
+  char full[REHIDE_STATS_SIZE];
+  rehide_format_stats(rehides, full, sizeof(full));
+  for (size_t size = 1; size <= strlen(full) + 1; size++) {
+    char buffer[REHIDE_STATS_SIZE + 8];
+    memset(buffer, '#', sizeof(buffer));
+    rehide_format_stats(rehides, buffer, size);
+    CHECK(strlen(buffer) == size - 1);
+    CHECK(strncmp(buffer, full, size - 1) == 0);
+    CHECK(buffer[size] == '#');
+  }
+}
+
+int main(void) {
+  check_session();
+  check_largest();
+  check_truncated();
+  return check_exit("rehide");
+}
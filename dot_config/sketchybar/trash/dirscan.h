@@ -0,0 +1,195 @@
+#pragma once
+
+// Fast enumeration of a directory's names for trash_monitor. Instead of one
+// readdir call per entry, names are fetched in large batches:
+// getattrlistbulk on macOS, getdents64 on Linux, readdir everywhere else or
+// when the bulk call is not supported by the file system.
+//
+//   size_t count = dirscan(fd, NULL, NULL); // just count
+//   dirscan(fd, visit, context);            // visit(context, name, length)
+//
+// ".", ".." and ".DS_Store" are never reported. The directory fd stays open
+// and owned by the caller; its position is consumed. When the bulk call fails
+// part way the whole directory is read again with readdir, so visit may see a
+// name twice and must tolerate that.
+
+#ifdef __APPLE__
+#include <sys/attr.h>
+#elif defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DIRSCAN_BUFFER_SIZE (256 * 1024)
+
+typedef void (*dirscan_fn)(void *context, const char *name, size_t length);
+
+static inline bool dirscan_is_counted(const char *name, size_t length) {
+  switch (length) {
+  case 1:
+    return name[0] != '.';
+  case 2:
+    return name[0] != '.' || name[1] != '.';
+  case 9:
+    return memcmp(name, ".DS_Store", 9) != 0;
+  default:
+    return true;
+  }
+}
+
+static inline size_t dirscan_readdir(int fd, dirscan_fn visit,
+                                     void *context) {
+  int copy = dup(fd);
+  DIR *dir = copy >= 0 ? fdopendir(copy) : NULL;
+  if (!dir) {
+    if (copy >= 0)
+      close(copy);
+    return 0;
+  }
+
+  size_t count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t length = strlen(entry->d_name);
+    if (!dirscan_is_counted(entry->d_name, length))
+      continue;
+    count++;
+    if (visit)
+      visit(context, entry->d_name, length);
+  }
+  closedir(dir);
+  return count;
+}
+
+#ifdef __APPLE__
+
+// Each record is: length, returned attribute set, name reference. Only the
+// name is requested; getattrlistbulk never returns "." or "..".
+static inline bool dirscan_bulk(int fd, dirscan_fn visit, void *context,
+                                size_t *count) {
+  struct attrlist attributes = {0};
+  attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
+  attributes.commonattr = ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_NAME;
+
+  char *buffer = (char *)malloc(DIRSCAN_BUFFER_SIZE);
+  if (!buffer)
+    return false;
+
+  *count = 0;
+  for (;;) {
+    int entries =
+        getattrlistbulk(fd, &attributes, buffer, DIRSCAN_BUFFER_SIZE, 0);
+    if (entries < 0 && errno == EINTR)
+      continue;
+    if (entries < 0) {
+      // Unsupported, or failed part way: a partial count is worse than
+      // starting over, so let the caller fall back to readdir.
+      free(buffer);
+      return false;
+    }
+    if (entries == 0)
+      break;
+
+    char *record = buffer;
+    for (int i = 0; i < entries; i++) {
+      uint32_t length;
+      memcpy(&length, record, sizeof(length));
+      char *field = record + sizeof(uint32_t);
+      attribute_set_t returned;
+      memcpy(&returned, field, sizeof(returned));
+      field += sizeof(attribute_set_t);
+
+      if (returned.commonattr & ATTR_CMN_NAME) {
+        attrreference_t reference;
+        memcpy(&reference, field, sizeof(reference));
+        const char *name = field + reference.attr_dataoffset;
+        size_t name_length =
+            reference.attr_length ? reference.attr_length - 1 : 0;
+        if (name_length && dirscan_is_counted(name, name_length)) {
+          (*count)++;
+          if (visit)
+            visit(context, name, name_length);
+        }
+      }
+      record += length;
+    }
+  }
+
+  free(buffer);
+  return true;
+}
+
+#elif defined(__linux__)
+
+struct dirscan_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static inline bool dirscan_bulk(int fd, dirscan_fn visit, void *context,
+                                size_t *count) {
+  char *buffer = (char *)malloc(DIRSCAN_BUFFER_SIZE);
+  if (!buffer)
+    return false;
+
+  *count = 0;
+  for (;;) {
+    long length = syscall(SYS_getdents64, fd, buffer, DIRSCAN_BUFFER_SIZE);
+    if (length < 0 && errno == EINTR)
+      continue;
+    if (length < 0) {
+      free(buffer);
+      return false;
+    }
+    if (length == 0)
+      break;
+
+    for (long offset = 0; offset < length;) {
+      struct dirscan_dirent64 *entry =
+          (struct dirscan_dirent64 *)(buffer + offset);
+      offset += entry->d_reclen;
+
+      const char *name = entry->d_name;
+      size_t name_length = strlen(name);
+      if (dirscan_is_counted(name, name_length)) {
+        (*count)++;
+        if (visit)
+          visit(context, name, name_length);
+      }
+    }
+  }
+
+  free(buffer);
+  return true;
+}
+
+#else
+
+static inline bool dirscan_bulk(int fd, dirscan_fn visit, void *context,
+                                size_t *count) {
+  (void)fd;
+  (void)visit;
+  (void)context;
+  (void)count;
+  return false;
+}
+
+#endif
+
+static inline size_t dirscan(int fd, dirscan_fn visit, void *context) {
+  size_t count;
+  if (dirscan_bulk(fd, visit, context, &count))
+    return count;
+  lseek(fd, 0, SEEK_SET);
+  return dirscan_readdir(fd, visit, context);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+// Leading-edge rate limit with a trailing flush for trash_monitor's updates:
+// the first change after a quiet period is published immediately, later ones
+// at most once per interval, and the last state of a burst is always
+// published at the end. The caller supplies the clock reading and the timer,
+// so the same schedule runs against a virtual clock in the checks.
+//
+//   rate_limit_request(&limit, now);   // on every change
+//   rate_limit_flush(&limit, now);     // from the timer limit->schedule set
+//
+// publish and schedule are called synchronously from these two functions.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void (*rate_limit_publish_fn)(void *context);
+typedef void (*rate_limit_schedule_fn)(void *context, uint64_t wait_ns);
+
+struct rate_limit {
+  uint64_t interval_ns;
+  uint64_t last_ns;   // when the last update went out, 0 before the first
+  bool flush_pending; // a trailing update is scheduled
+  rate_limit_publish_fn publish;
+  rate_limit_schedule_fn schedule; // arm a one-shot timer for the flush
+  void *context;
+};
+
+// Returns 0 when an update may go out at `now` (and records it), otherwise
+// how long to wait before the trailing update.
+static inline uint64_t rate_limit_check(struct rate_limit *limit,
+                                        uint64_t now) {
+  if (!limit->last_ns || now - limit->last_ns >= limit->interval_ns) {
+    limit->last_ns = now;
+    return 0;
+  }
+  return limit->last_ns + limit->interval_ns - now;
+}
+
+// A change happened at `now`: publish it or leave it to the trailing flush.
+static inline void rate_limit_request(struct rate_limit *limit, uint64_t now) {
+  if (limit->flush_pending)
+    return;
+  uint64_t wait = rate_limit_check(limit, now);
+  if (!wait) {
+    limit->publish(limit->context);
+    return;
+  }
+  limit->flush_pending = true;
+  limit->schedule(limit->context, wait);
+}
+
+// The trailing flush's timer fired at `now`.
+static inline void rate_limit_flush(struct rate_limit *limit, uint64_t now) {
+  limit->flush_pending = false;
+  limit->last_ns = now;
+  limit->publish(limit->context);
+}
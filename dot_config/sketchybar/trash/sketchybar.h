@@ -1,19 +1,44 @@
 #pragma once
 
+#ifdef __APPLE__
 #include <bootstrap.h>
 #include <mach/mach.h>
 #include <mach/message.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#define SKETCHYBAR_SEND_TIMEOUT_MS 100
+#define SKETCHYBAR_REPLY_TIMEOUT_MS 1000
+
+// The bar's Mach service name. With the socket transport the bar is reached
+// at $SKETCHYBAR_SOCKET, or SKETCHYBAR_DEFAULT_SOCKET where there is no Mach;
+// $SKETCHYBAR_RING names a shared-memory ring instead.
+#define SKETCHYBAR_SERVICE "git.felix.sketchybar"
+#define SKETCHYBAR_DEFAULT_SOCKET "/tmp/sketchybar.socket"
+
 typedef char *env;
 
 #define MACH_HANDLER(name) void name(env env)
 typedef MACH_HANDLER(mach_handler);
 
+#ifdef __APPLE__
 struct mach_message {
   mach_msg_header_t header;
   mach_msg_size_t msgh_descriptor_count;
@@ -24,35 +49,331 @@ struct mach_buffer {
   struct mach_message message;
   mach_msg_trailer_t trailer;
 };
+#endif
 
-struct mach_server {
-  bool is_running;
-  mach_port_name_t task;
-  mach_port_t port;
-  mach_port_t bs_port;
+// Counters of the event server. queue_depth counts events received but not
+// yet handled; handler times are wall-clock nanoseconds per handler call.
+struct mach_server_stats {
+  uint64_t received;
+  uint64_t handled;
+  uint64_t queue_depth;
+  uint64_t queue_depth_max;
+  uint64_t handler_ns_total;
+  uint64_t handler_ns_max;
+};
 
-  pthread_t thread;
-  mach_handler *handler;
+/* ------------------------------------------------------------------ */
+/* Wire protocol                                                        */
+/* ------------------------------------------------------------------ */
+
+// Commands travel as NUL-separated tokens closed by an extra NUL, events as
+// an env blob of key\0value\0 pairs closed the same way. Both formats are
+// independent of the transport that carries them.
+
+// Open-addressing index over an event's env blob (key\0value\0...\0\0). It is
+// built in one pass when the server receives an event, so handlers resolve
+// keys without rescanning the blob. Slots are offsets into the blob and the
+// table is reused across events; it only reallocates when it has to grow.
+struct env_slot {
+  uint32_t hash;
+  uint32_t key;
+  uint32_t value;
 };
 
-static struct mach_server g_mach_server;
-static mach_port_t g_mach_port = 0;
-static char *g_response = NULL;
+struct env_index {
+  env blob;
+  struct env_slot *slots;
+  uint32_t capacity;
+  uint32_t count;
+};
+
+static struct env_index g_env_index;
+static __thread struct env_index *t_env_index;
+
+static inline uint32_t env_hash(const char *key, uint32_t *length) {
+  uint32_t hash = 2166136261u;
+  uint32_t i = 0;
+  for (; key[i]; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
+  }
+  *length = i;
+  return hash;
+}
+
+static inline void env_index_insert(struct env_index *index, uint32_t hash,
+                                    uint32_t key, uint32_t value) {
+  uint32_t mask = index->capacity - 1;
+  uint32_t i = hash & mask;
+  while (index->slots[i].value) {
+    // Later duplicates must not shadow the first occurrence, matching the
+    // linear scan.
+    if (index->slots[i].hash == hash &&
+        strcmp(&index->blob[index->slots[i].key], &index->blob[key]) == 0)
+      return;
+    i = (i + 1) & mask;
+  }
+  index->slots[i] = (struct env_slot){hash, key, value};
+  index->count++;
+}
+
+static inline bool env_index_grow(struct env_index *index) {
+  uint32_t capacity = index->capacity ? index->capacity * 2 : 64;
+  struct env_slot *slots =
+      (struct env_slot *)calloc(capacity, sizeof(struct env_slot));
+  if (!slots)
+    return false;
+
+  struct env_slot *old = index->slots;
+  uint32_t old_capacity = index->capacity;
+  index->slots = slots;
+  index->capacity = capacity;
+  index->count = 0;
+  for (uint32_t i = 0; i < old_capacity; i++) {
+    if (old[i].value)
+      env_index_insert(index, old[i].hash, old[i].key, old[i].value);
+  }
+  free(old);
+  return true;
+}
+
+static inline bool env_index_build(struct env_index *index, env blob,
+                                   uint32_t size) {
+  index->blob = blob;
+  index->count = 0;
+  if (index->slots)
+    memset(index->slots, 0, index->capacity * sizeof(struct env_slot));
+
+  uint32_t caret = 0;
+  while (caret < size && blob[caret]) {
+    uint32_t key_length;
+    uint32_t hash = env_hash(&blob[caret], &key_length);
+    uint32_t value = caret + key_length + 1;
+    if (value >= size)
+      break;
+    uint32_t value_length = strnlen(&blob[value], size - value);
+    if (value + value_length >= size)
+      break;
+
+    if ((index->count + 1) * 2 > index->capacity && !env_index_grow(index)) {
+      index->blob = NULL;
+      return false;
+    }
+
+    env_index_insert(index, hash, caret, value);
+    caret = value + value_length + 1;
+  }
+  return true;
+}
+
+static inline char *env_index_get(struct env_index *index, char *key) {
+  if (!index->capacity)
+    return NULL;
+
+  uint32_t length;
+  uint32_t hash = env_hash(key, &length);
+  uint32_t mask = index->capacity - 1;
+  for (uint32_t i = hash & mask; index->slots[i].value; i = (i + 1) & mask) {
+    if (index->slots[i].hash == hash &&
+        memcmp(&index->blob[index->slots[i].key], key, length + 1) == 0)
+      return &index->blob[index->slots[i].value];
+  }
+  return NULL;
+}
 
 static inline char *env_get_value_for_key(env env, char *key) {
+  if (env && t_env_index && env == t_env_index->blob) {
+    char *value = env_index_get(t_env_index, key);
+    return value ? value : (char *)"";
+  }
+
   uint32_t caret = 0;
   for (;;) {
     if (!env[caret])
       break;
+    uint32_t key_length = strlen(&env[caret]);
+    char *value = &env[caret + key_length + 1];
     if (strcmp(&env[caret], key) == 0)
-      return &env[caret + strlen(&env[caret]) + 1];
+      return value;
 
-    caret +=
-        strlen(&env[caret]) + strlen(&env[caret + strlen(&env[caret]) + 1]) + 2;
+    caret += key_length + strlen(value) + 2;
   }
   return (char *)"";
 }
 
+// Splits a command line on unquoted spaces into the NUL-separated tokens the
+// bar expects. out must hold strlen(message) + 1 bytes; the returned length
+// covers the tokens and their terminators but not the closing extra NUL.
+static inline uint32_t sketchybar_tokenize(const char *message, char *out) {
+  uint32_t message_length = strlen(message) + 1;
+
+  char quote = '\0';
+  uint32_t caret = 0;
+  for (uint32_t i = 0; i < message_length; ++i) {
+    if (message[i] == '"' || message[i] == '\'') {
+      if (quote == message[i])
+        quote = '\0';
+      else
+        quote = message[i];
+      continue;
+    }
+    out[caret] = message[i];
+    if (message[i] == ' ' && !quote)
+      out[caret] = '\0';
+    caret++;
+  }
+
+  if (caret > 1 && out[caret - 1] == '\0' && out[caret - 2] == '\0') {
+    caret--;
+  }
+
+  return caret;
+}
+
+/* ------------------------------------------------------------------ */
+/* Sessions                                                             */
+/* ------------------------------------------------------------------ */
+
+// A long-lived client connection. The transport keeps its connection (the
+// bar's service port and one reply port, or one socket) for the whole session
+// instead of setting it up per message. A session is owned by one thread at a
+// time; sketchybar() uses one session per thread, so helpers can talk to the
+// bar from several threads at once. Sessions share nothing that needs the
+// caller's help: each has its own reply port, and the ring takes any number
+// of producers.
+struct sketchybar_transport;
+
+struct ring_header;
+struct sketchybar_diff_cache;
+
+// generation changes whenever the transport had to (re)connect, which is how
+// the diff cache notices that the bar may have lost its state.
+struct sketchybar_session {
+  const struct sketchybar_transport *transport;
+#ifdef __APPLE__
+  mach_port_t port;
+  mach_port_t reply_port;
+#endif
+  int fd;
+  struct ring_header *ring;
+  pid_t ring_owner;
+  char address[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  char *response;
+  uint32_t response_capacity;
+  uint32_t generation;
+  struct sketchybar_diff_cache *diff;
+};
+
+// A reply borrowed straight from the transport: the OOL descriptor the bar
+// sent, or the session's receive buffer. data stays valid until
+// sketchybar_reply_release().
+struct sketchybar_reply {
+  char *data;
+  uint32_t size;
+#ifdef __APPLE__
+  struct mach_buffer buffer;
+#endif
+};
+
+// request() returns false when the message could not be delivered and leaves
+// reply->data NULL when the bar did not answer in time.
+struct sketchybar_transport {
+  const char *name;
+  bool (*begin)(struct sketchybar_session *session, const char *address);
+  void (*end)(struct sketchybar_session *session);
+  bool (*push)(struct sketchybar_session *session, char *message,
+               uint32_t len);
+  bool (*request)(struct sketchybar_session *session, char *message,
+                  uint32_t len, struct sketchybar_reply *reply);
+  void (*release)(struct sketchybar_session *session,
+                  struct sketchybar_reply *reply);
+};
+
+static pthread_key_t g_session_key;
+static pthread_once_t g_session_once = PTHREAD_ONCE_INIT;
+
+static inline bool sketchybar_session_reserve(struct sketchybar_session *session,
+                                              uint32_t size) {
+  if (size <= session->response_capacity)
+    return true;
+
+  uint32_t capacity = session->response_capacity ? session->response_capacity
+                                                 : 256;
+  while (capacity < size)
+    capacity *= 2;
+
+  char *response = (char *)realloc(session->response, capacity);
+  if (!response)
+    return false;
+  session->response = response;
+  session->response_capacity = capacity;
+  return true;
+}
+
+/* ------------------------------------------------------------------ */
+/* Event worker pool                                                    */
+/* ------------------------------------------------------------------ */
+
+// Worker-pool mode of the event servers. Each worker is a thread with its own
+// queue and env index, and events are sharded on their NAME and SENDER, so
+// events for the same item and event name are handled in order while
+// unrelated ones run concurrently. It only uses pthreads, so every transport
+// shares it and the checks drive it on Linux.
+struct event_job {
+  struct event_job *next;
+  env blob;
+  uint32_t size;
+  // Frees the job once the handler returned.
+  void (*release)(struct event_job *job);
+};
+
+struct event_pool;
+
+struct event_worker {
+  struct event_pool *pool;
+  pthread_t thread;
+  pthread_cond_t ready;
+  struct event_job *head;
+  struct event_job *tail;
+  struct env_index index;
+};
+
+struct event_pool {
+  mach_handler *handler;
+  struct mach_server_stats *stats;
+  uint32_t worker_count;
+  struct event_worker *workers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t space;
+  uint32_t queued;
+  uint32_t limit;
+  bool is_stopping;
+};
+
+/* ------------------------------------------------------------------ */
+/* Mach transport                                                       */
+/* ------------------------------------------------------------------ */
+
+#ifdef __APPLE__
+struct mach_server {
+  bool is_running;
+  mach_port_name_t task;
+  mach_port_t port;
+  mach_port_t bs_port;
+
+  pthread_t thread;
+  mach_handler *handler;
+
+  uint32_t worker_count;
+  struct event_pool pool;
+  struct mach_server_stats stats;
+};
+
+static struct mach_server g_mach_server;
+static mach_port_t g_mach_port = 0;
+static pthread_mutex_t g_mach_port_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static inline mach_port_t mach_get_bs_port() {
   mach_port_name_t task = mach_task_self();
 
@@ -63,8 +384,7 @@ static inline mach_port_t mach_get_bs_port() {
   }
 
   mach_port_t port;
-  if (bootstrap_look_up(bs_port, "git.felix.sketchybar", &port) !=
-      KERN_SUCCESS) {
+  if (bootstrap_look_up(bs_port, SKETCHYBAR_SERVICE, &port) != KERN_SUCCESS) {
     return 0;
   }
 
@@ -90,31 +410,115 @@ static inline void mach_receive_message(mach_port_t port,
   }
 }
 
-static inline char *mach_send_message(mach_port_t port, char *message,
-                                      uint32_t len) {
-  if (!message || !port) {
-    return NULL;
+// Every session holds its own reference on the cached g_mach_port, so one
+// session reconnecting never invalidates the port name used by another.
+static inline void mach_session_adopt_port(struct sketchybar_session *session) {
+  pthread_mutex_lock(&g_mach_port_lock);
+  if (!g_mach_port)
+    g_mach_port = mach_get_bs_port();
+  if (g_mach_port && mach_port_mod_refs(mach_task_self(), g_mach_port,
+                                        MACH_PORT_RIGHT_SEND,
+                                        1) != KERN_SUCCESS) {
+    g_mach_port = 0;
   }
+  session->port = g_mach_port;
+  pthread_mutex_unlock(&g_mach_port_lock);
+}
 
-  mach_port_t response_port;
+static inline bool mach_session_open_reply_port(
+    struct sketchybar_session *session) {
   mach_port_name_t task = mach_task_self();
-  if (mach_port_allocate(task, MACH_PORT_RIGHT_RECEIVE, &response_port) !=
-      KERN_SUCCESS) {
-    return NULL;
+
+  if (mach_port_allocate(task, MACH_PORT_RIGHT_RECEIVE,
+                         &session->reply_port) != KERN_SUCCESS) {
+    session->reply_port = MACH_PORT_NULL;
+    return false;
   }
 
-  if (mach_port_insert_right(task, response_port, response_port,
+  if (mach_port_insert_right(task, session->reply_port, session->reply_port,
                              MACH_MSG_TYPE_MAKE_SEND) != KERN_SUCCESS) {
-    return NULL;
+    mach_port_mod_refs(task, session->reply_port, MACH_PORT_RIGHT_RECEIVE, -1);
+    session->reply_port = MACH_PORT_NULL;
+    return false;
+  }
+  return true;
+}
+
+// Destroying the receive right also discards whatever is still queued on the
+// port and everything sent to it later.
+static inline void mach_session_close_reply_port(
+    struct sketchybar_session *session) {
+  mach_port_name_t task = mach_task_self();
+  if (session->reply_port) {
+    mach_port_mod_refs(task, session->reply_port, MACH_PORT_RIGHT_RECEIVE, -1);
+    mach_port_deallocate(task, session->reply_port);
   }
+  session->reply_port = MACH_PORT_NULL;
+}
+
+static inline bool mach_session_begin(struct sketchybar_session *session,
+                                      const char *address) {
+  (void)address;
+  if (!mach_session_open_reply_port(session))
+    return false;
+
+  mach_session_adopt_port(session);
+  return true;
+}
+
+static inline void mach_session_end(struct sketchybar_session *session) {
+  if (session->port)
+    mach_port_deallocate(mach_task_self(), session->port);
+  mach_session_close_reply_port(session);
+}
+
+// Drops the cached service port after the bar went away and looks it up again.
+// bootstrap_look_up fails immediately when the bar is not registered, so a
+// restarting bar never blocks the caller.
+static inline bool mach_session_reconnect(struct sketchybar_session *session) {
+  mach_port_name_t task = mach_task_self();
+  if (session->port) {
+    pthread_mutex_lock(&g_mach_port_lock);
+    if (g_mach_port == session->port) {
+      mach_port_deallocate(task, g_mach_port);
+      g_mach_port = 0;
+    }
+    pthread_mutex_unlock(&g_mach_port_lock);
+    mach_port_deallocate(task, session->port);
+    session->port = MACH_PORT_NULL;
+  }
+
+  mach_session_adopt_port(session);
+  session->generation++;
+  return session->port != MACH_PORT_NULL;
+}
+
+// The bar's reply does not echo anything of the request, so a reply port only
+// ever has one request outstanding: a request that timed out retires the
+// port, and its late reply dies with it instead of being mistaken for the
+// reply to the next request. Draining the queue before sending could not
+// tell, since the late reply may still be in flight at that point.
+static inline bool mach_session_retire_reply_port(
+    struct sketchybar_session *session) {
+  mach_session_close_reply_port(session);
+  return mach_session_open_reply_port(session);
+}
 
+static inline mach_msg_return_t
+mach_session_post(struct sketchybar_session *session, char *message,
+                  uint32_t len, bool reply) {
   struct mach_message msg = {0};
-  msg.header.msgh_remote_port = port;
-  msg.header.msgh_local_port = response_port;
-  msg.header.msgh_id = response_port;
-  msg.header.msgh_bits =
-      MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND, MACH_MSG_TYPE_MAKE_SEND, 0,
-                         MACH_MSGH_BITS_COMPLEX);
+  msg.header.msgh_remote_port = session->port;
+  if (reply) {
+    msg.header.msgh_local_port = session->reply_port;
+    msg.header.msgh_id = session->reply_port;
+    msg.header.msgh_bits =
+        MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND, MACH_MSG_TYPE_MAKE_SEND, 0,
+                           MACH_MSGH_BITS_COMPLEX);
+  } else {
+    msg.header.msgh_bits = MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND, 0, 0,
+                                              MACH_MSGH_BITS_COMPLEX);
+  }
 
   msg.header.msgh_size = sizeof(struct mach_message);
   msg.msgh_descriptor_count = 1;
@@ -124,124 +528,2054 @@ static inline char *mach_send_message(mach_port_t port, char *message,
   msg.descriptor.deallocate = false;
   msg.descriptor.type = MACH_MSG_OOL_DESCRIPTOR;
 
-  mach_msg(&msg.header, MACH_SEND_MSG, sizeof(struct mach_message), 0,
-           MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+  return mach_msg(&msg.header, MACH_SEND_MSG | MACH_SEND_TIMEOUT,
+                  sizeof(struct mach_message), 0, MACH_PORT_NULL,
+                  SKETCHYBAR_SEND_TIMEOUT_MS, MACH_PORT_NULL);
+}
 
-  struct mach_buffer buffer = {0};
-  mach_receive_message(response_port, &buffer, true);
+static inline mach_msg_return_t
+mach_session_deliver(struct sketchybar_session *session, char *message,
+                     uint32_t len, bool reply) {
+  if (!session->port && !mach_session_reconnect(session))
+    return MACH_SEND_INVALID_DEST;
 
-  if (buffer.message.descriptor.address) {
-    g_response = (char *)realloc(g_response,
-                                 strlen(buffer.message.descriptor.address) + 1);
-    memcpy(g_response, buffer.message.descriptor.address,
-           strlen(buffer.message.descriptor.address) + 1);
-  } else {
-    g_response = (char *)realloc(g_response, 1);
-    *g_response = '\0';
+  mach_msg_return_t result = mach_session_post(session, message, len, reply);
+  if (result == MACH_SEND_INVALID_DEST) {
+    if (!mach_session_reconnect(session))
+      return result;
+    result = mach_session_post(session, message, len, reply);
   }
+  return result;
+}
 
-  mach_msg_destroy(&buffer.message.header);
-  mach_port_mod_refs(task, response_port, MACH_PORT_RIGHT_RECEIVE, -1);
-  mach_port_deallocate(task, response_port);
-
-  return g_response;
+// Fire-and-forget: the message carries no reply port, so the bar does not
+// answer and the caller never waits for it.
+static inline bool mach_session_push(struct sketchybar_session *session,
+                                     char *message, uint32_t len) {
+  return mach_session_deliver(session, message, len, false) ==
+         MACH_MSG_SUCCESS;
 }
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-static inline bool mach_server_begin(struct mach_server *mach_server,
-                                     mach_handler handler,
-                                     char *bootstrap_name) {
-  mach_server->task = mach_task_self();
+static inline bool mach_session_request(struct sketchybar_session *session,
+                                        char *message, uint32_t len,
+                                        struct sketchybar_reply *reply) {
+  if (!session->reply_port && !mach_session_open_reply_port(session))
+    return false;
 
-  if (mach_port_allocate(mach_server->task, MACH_PORT_RIGHT_RECEIVE,
-                         &mach_server->port) != KERN_SUCCESS) {
+  if (mach_session_deliver(session, message, len, true) != MACH_MSG_SUCCESS)
     return false;
+
+  if (mach_msg(&reply->buffer.message.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT,
+               0, sizeof(struct mach_buffer), session->reply_port,
+               SKETCHYBAR_REPLY_TIMEOUT_MS, MACH_PORT_NULL) != MACH_MSG_SUCCESS) {
+    reply->buffer = (struct mach_buffer){0};
+    mach_session_retire_reply_port(session);
+    return true;
   }
 
-  struct mach_port_limits limits = {};
-  limits.mpl_qlimit = MACH_PORT_QLIMIT_LARGE;
+  reply->data = (char *)reply->buffer.message.descriptor.address;
+  reply->size = reply->data ? strnlen(reply->data,
+                                      reply->buffer.message.descriptor.size)
+                            : 0;
+  return true;
+}
 
-  if (mach_port_set_attributes(mach_server->task, mach_server->port,
-                               MACH_PORT_LIMITS_INFO, (mach_port_info_t)&limits,
-                               MACH_PORT_LIMITS_INFO_COUNT) != KERN_SUCCESS) {
-    return false;
-  }
+static inline void mach_session_release(struct sketchybar_session *session,
+                                        struct sketchybar_reply *reply) {
+  (void)session;
+  if (reply->buffer.message.header.msgh_size)
+    mach_msg_destroy(&reply->buffer.message.header);
+}
 
-  if (mach_port_insert_right(mach_server->task, mach_server->port,
-                             mach_server->port,
-                             MACH_MSG_TYPE_MAKE_SEND) != KERN_SUCCESS) {
-    return false;
-  }
+static const struct sketchybar_transport g_mach_transport = {
+    "mach",
+    mach_session_begin,
+    mach_session_end,
+    mach_session_push,
+    mach_session_request,
+    mach_session_release,
+};
+#endif
 
-  if (task_get_special_port(mach_server->task, TASK_BOOTSTRAP_PORT,
-                            &mach_server->bs_port) != KERN_SUCCESS) {
-    return false;
-  }
+/* ------------------------------------------------------------------ */
+/* Unix socket transport                                                */
+/* ------------------------------------------------------------------ */
 
-  if (bootstrap_register(mach_server->bs_port, bootstrap_name,
-                         mach_server->port) != KERN_SUCCESS) {
-    return false;
-  }
+// Every message on the socket is a frame header followed by the same payload
+// a Mach OOL descriptor would carry. The server answers each frame without
+// SOCKET_FRAME_NO_REPLY with a reply frame. Frames longer than
+// SOCKET_FRAME_MAX are a protocol error and close the connection.
+#define SOCKET_FRAME_NO_REPLY (1 << 0)
+#define SOCKET_FRAME_MAX (1u << 20)
 
-  mach_server->handler = handler;
-  mach_server->is_running = true;
-  struct mach_buffer buffer;
-  while (mach_server->is_running) {
-    mach_receive_message(mach_server->port, &buffer, true);
-    if (getppid() == 1)
-      exit(0);
-    if (!buffer.message.descriptor.address)
-      continue;
-    if (*(char *)buffer.message.descriptor.address == 'k' &&
-        buffer.message.descriptor.size == 2) {
-      exit(0);
+#ifdef MSG_NOSIGNAL
+#define SOCKET_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SOCKET_SEND_FLAGS 0
+#endif
+
+struct socket_frame {
+  uint32_t length;
+  uint32_t flags;
+};
+
+static inline void socket_set_timeout(int fd, int option, uint32_t ms) {
+  struct timeval timeout = {ms / 1000, (ms % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+static inline bool socket_write_frame(int fd, uint32_t flags, char *payload,
+                                      uint32_t len) {
+  struct socket_frame frame = {len, flags};
+  struct iovec iov[2] = {{&frame, sizeof(frame)}, {payload, len}};
+  struct msghdr msg = {0};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  while (msg.msg_iovlen) {
+    ssize_t written = sendmsg(fd, &msg, SOCKET_SEND_FLAGS);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
     }
-    mach_server->handler((env)buffer.message.descriptor.address);
-    mach_msg_destroy(&buffer.message.header);
-  }
 
+    while (msg.msg_iovlen && (size_t)written >= msg.msg_iov->iov_len) {
+      written -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + written;
+      msg.msg_iov->iov_len -= written;
+    }
+  }
   return true;
 }
-#pragma clang diagnostic pop
 
-static inline char *sketchybar(char *message) {
-  uint32_t message_length = strlen(message) + 1;
-  char formatted_message[message_length + 1];
+// The sockets live in /tmp, so both ends make sure the other one runs as the
+// same user before trusting anything it sends.
+static inline bool socket_peer_is_user(int fd) {
+#ifdef __APPLE__
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) < 0)
+    return false;
+  return uid == geteuid();
+#elif defined(SO_PEERCRED)
+  // struct ucred without requiring _GNU_SOURCE from every includer.
+  struct {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+  } credentials;
+  socklen_t length = sizeof(credentials);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0 ||
+      length != sizeof(credentials))
+    return false;
+  return credentials.uid == geteuid();
+#else
+  (void)fd;
+  return true;
+#endif
+}
 
-  char quote = '\0';
-  uint32_t caret = 0;
-  for (uint32_t i = 0; i < message_length; ++i) {
-    if (message[i] == '"' || message[i] == '\'') {
-      if (quote == message[i])
-        quote = '\0';
-      else
-        quote = message[i];
+static inline bool socket_read_all(int fd, void *buffer, uint32_t len) {
+  char *caret = (char *)buffer;
+  while (len) {
+    ssize_t received = recv(fd, caret, len, 0);
+    if (received < 0 && errno == EINTR)
       continue;
-    }
-    formatted_message[caret] = message[i];
-    if (message[i] == ' ' && !quote)
-      formatted_message[caret] = '\0';
-    caret++;
+    if (received <= 0)
+      return false;
+    caret += received;
+    len -= received;
   }
+  return true;
+}
 
-  if (caret > 0 && formatted_message[caret] == '\0' &&
-      formatted_message[caret - 1] == '\0') {
-    caret--;
+static inline int socket_connect(const char *path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  socket_set_timeout(fd, SO_SNDTIMEO, SKETCHYBAR_SEND_TIMEOUT_MS);
+  socket_set_timeout(fd, SO_RCVTIMEO, SKETCHYBAR_REPLY_TIMEOUT_MS);
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      !socket_peer_is_user(fd)) {
+    close(fd);
+    return -1;
   }
+  return fd;
+}
 
-  formatted_message[caret] = '\0';
-  if (!g_mach_port)
-    g_mach_port = mach_get_bs_port();
-  char *response = mach_send_message(g_mach_port, formatted_message, caret + 1);
+static inline void socket_session_close(struct sketchybar_session *session) {
+  if (session->fd >= 0)
+    close(session->fd);
+  session->fd = -1;
+}
 
-  if (response)
-    return response;
-  else
-    return (char *)"";
+static inline bool socket_session_open(struct sketchybar_session *session) {
+  session->fd = socket_connect(session->address);
+  if (session->fd < 0)
+    return false;
+  session->generation++;
+  return true;
 }
 
-static inline void event_server_begin(mach_handler event_handler,
-                                      char *bootstrap_name) {
-  mach_server_begin(&g_mach_server, event_handler, bootstrap_name);
+static inline bool socket_session_begin(struct sketchybar_session *session,
+                                        const char *address) {
+  snprintf(session->address, sizeof(session->address), "%s", address);
+  // A missing server is not an error; the first send connects lazily.
+  socket_session_open(session);
+  return true;
+}
+
+static inline void socket_session_end(struct sketchybar_session *session) {
+  socket_session_close(session);
+}
+
+// Connecting to a Unix socket fails immediately when nobody listens, so a
+// restarting bar never blocks the caller. A broken connection is re-opened
+// once per message.
+static inline bool socket_session_deliver(struct sketchybar_session *session,
+                                          uint32_t flags, char *message,
+                                          uint32_t len) {
+  if (session->fd < 0 && !socket_session_open(session))
+    return false;
+
+  if (socket_write_frame(session->fd, flags, message, len))
+    return true;
+
+  socket_session_close(session);
+  return socket_session_open(session) &&
+         socket_write_frame(session->fd, flags, message, len);
+}
+
+static inline bool socket_session_push(struct sketchybar_session *session,
+                                       char *message, uint32_t len) {
+  return socket_session_deliver(session, SOCKET_FRAME_NO_REPLY, message, len);
+}
+
+static inline bool socket_session_request(struct sketchybar_session *session,
+                                          char *message, uint32_t len,
+                                          struct sketchybar_reply *reply) {
+  if (!socket_session_deliver(session, 0, message, len))
+    return false;
+
+  // After a timeout the stream position is unknown, so the connection is
+  // dropped rather than risking a stale reply being read for the next one.
+  struct socket_frame frame;
+  if (!socket_read_all(session->fd, &frame, sizeof(frame)) ||
+      frame.length > SOCKET_FRAME_MAX ||
+      !sketchybar_session_reserve(session, frame.length + 1) ||
+      !socket_read_all(session->fd, session->response, frame.length)) {
+    socket_session_close(session);
+    return true;
+  }
+
+  session->response[frame.length] = '\0';
+  reply->data = session->response;
+  reply->size = strnlen(session->response, frame.length);
+  return true;
+}
+
+static inline void socket_session_release(struct sketchybar_session *session,
+                                          struct sketchybar_reply *reply) {
+  (void)session;
+  (void)reply;
+}
+
+static const struct sketchybar_transport g_socket_transport = {
+    "socket",
+    socket_session_begin,
+    socket_session_end,
+    socket_session_push,
+    socket_session_request,
+    socket_session_release,
+};
+
+/* ------------------------------------------------------------------ */
+/* Shared-memory ring transport                                         */
+/* ------------------------------------------------------------------ */
+
+// A multi-producer/single-consumer ring in a POSIX shared memory segment for
+// high-rate updates. Records are the usual tokenized payloads, written in
+// place with no kernel copy. Every session that has $SKETCHYBAR_RING set is a
+// producer (one per thread with sketchybar(), plus any async clients, in any
+// number of processes), so a producer claims its space by moving head with a
+// CAS and only then fills it in; the consumer stops at the first record whose
+// committed flag is not set yet. Consumed space is zeroed before tail moves
+// past it, so a stale flag can never be read as a new commit.
+//
+// A producer that dies between its CAS and its commit would stall the ring
+// for good, so right after claiming, a producer publishes its record's length
+// and pid, tagged with the record's position. Once the consumer has waited
+// RING_CLAIM_TIMEOUT_MS on a published claim whose producer is gone, or
+// RING_ABANDON_MS on any claim, it drops the record. A claim that never got
+// its header is dropped up to the next published one.
+//
+// The consumer raises consumer_idle before it sleeps on the doorbell FIFO next
+// to the segment, and a producer rings it only then, so a busy consumer costs
+// no syscalls at all. The ring is one-way: requests are delivered like pushes
+// and never get a reply.
+#define RING_MAGIC 0x53425248u
+#define RING_CAPACITY (1u << 20)
+#define RING_WRAP UINT32_MAX
+#define RING_CLAIM_TIMEOUT_MS 100
+#define RING_ABANDON_MS 1000
+
+// Records are 16-byte aligned, so a lap always has room for a wrap marker.
+struct ring_record {
+  uint32_t length; // RING_WRAP: the rest of the lap is unused
+  uint32_t committed;
+  uint32_t position; // ring_tag of where the claim starts, stored last
+  int32_t owner;
+  char data[];
+};
+
+struct ring_header {
+  uint32_t magic;
+  uint32_t capacity;
+  uint64_t head;
+  uint64_t tail;
+  uint32_t consumer_idle;
+  uint32_t dropped;
+  char data[];
+};
+
+static inline uint32_t ring_record_size(uint32_t len) {
+  return (sizeof(struct ring_record) + len + 15) & ~15u;
+}
+
+// Positions are 16-byte aligned, so the tag is never zero like unused space.
+static inline uint32_t ring_tag(uint64_t position) {
+  return (uint32_t)position | 1;
+}
+
+static inline struct ring_record *ring_record_at(struct ring_header *ring,
+                                                 uint32_t offset) {
+  return (struct ring_record *)&ring->data[offset];
+}
+
+static inline void ring_bell_path(char *path, size_t size, const char *name) {
+  snprintf(path, size, "/tmp%s.bell", name);
+}
+
+// Space claimed for one record at position.
+struct ring_claim {
+  struct ring_record *record;
+  uint64_t position;
+};
+
+// Claims space for a record of len bytes; fails instead of blocking when the
+// consumer is behind.
+static inline bool ring_claim(struct ring_header *ring, uint32_t len,
+                              struct ring_claim *claim) {
+  uint32_t size = ring_record_size(len);
+  if (size > ring->capacity / 2) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint32_t offset, contiguous, needed;
+  do {
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    offset = head & (ring->capacity - 1);
+    contiguous = ring->capacity - offset;
+    needed = size <= contiguous ? size : contiguous + size;
+    if (head + needed - tail > ring->capacity) {
+      __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+  } while (!__atomic_compare_exchange_n(&ring->head, &head, head + needed, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  claim->position = head;
+  if (size > contiguous) {
+    struct ring_record *wrap = ring_record_at(ring, offset);
+    wrap->length = RING_WRAP;
+    __atomic_store_n(&wrap->position, ring_tag(head), __ATOMIC_RELEASE);
+    __atomic_store_n(&wrap->committed, 1, __ATOMIC_RELEASE);
+    claim->position += contiguous;
+    offset = 0;
+  }
+  claim->record = ring_record_at(ring, offset);
+  return true;
+}
+
+// Tells the consumer how much was claimed and by whom, in case the producer
+// never gets to commit.
+static inline void ring_publish(struct ring_claim *claim, uint32_t len,
+                                pid_t owner) {
+  claim->record->length = len;
+  claim->record->owner = owner;
+  __atomic_store_n(&claim->record->position, ring_tag(claim->position),
+                   __ATOMIC_RELEASE);
+}
+
+static inline void ring_commit(struct ring_claim *claim, char *message,
+                               uint32_t len) {
+  memcpy(claim->record->data, message, len);
+  // Sequentially consistent against the consumer's consumer_idle store, so
+  // either it sees this record or the producer sees it idle.
+  __atomic_store_n(&claim->record->committed, 1, __ATOMIC_SEQ_CST);
+}
+
+// Appends one record; fails instead of blocking when the consumer is behind.
+static inline bool ring_write(struct ring_header *ring, char *message,
+                              uint32_t len, pid_t owner) {
+  struct ring_claim claim;
+  if (!ring_claim(ring, len, &claim))
+    return false;
+  ring_publish(&claim, len, owner);
+  ring_commit(&claim, message, len);
+  return true;
+}
+
+static inline void ring_session_unmap(struct sketchybar_session *session) {
+  if (session->ring)
+    munmap(session->ring, sizeof(struct ring_header) + session->ring->capacity);
+  if (session->fd >= 0)
+    close(session->fd);
+  session->ring = NULL;
+  session->fd = -1;
+}
+
+static inline bool ring_session_map(struct sketchybar_session *session) {
+  int shm = shm_open(session->address, O_RDWR, 0);
+  if (shm < 0)
+    return false;
+
+  struct stat st;
+  void *ring = MAP_FAILED;
+  if (fstat(shm, &st) == 0 && st.st_size > (off_t)sizeof(struct ring_header))
+    ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+  close(shm);
+  if (ring == MAP_FAILED)
+    return false;
+
+  session->ring = (struct ring_header *)ring;
+  session->ring_owner = getpid();
+  if (session->ring->magic != RING_MAGIC ||
+      sizeof(struct ring_header) + session->ring->capacity >
+          (uint64_t)st.st_size) {
+    munmap(ring, st.st_size);
+    session->ring = NULL;
+    return false;
+  }
+
+  char bell[sizeof(session->address) + 16];
+  ring_bell_path(bell, sizeof(bell), session->address);
+  session->fd = open(bell, O_WRONLY | O_NONBLOCK);
+  session->generation++;
+  return true;
+}
+
+static inline bool ring_session_begin(struct sketchybar_session *session,
+                                      const char *address) {
+  snprintf(session->address, sizeof(session->address), "%s", address);
+  // A missing consumer is not an error; the first push maps lazily.
+  ring_session_map(session);
+  return true;
+}
+
+static inline void ring_session_end(struct sketchybar_session *session) {
+  ring_session_unmap(session);
+}
+
+static inline bool ring_session_push(struct sketchybar_session *session,
+                                     char *message, uint32_t len) {
+  if (!session->ring && !ring_session_map(session))
+    return false;
+
+  if (!ring_write(session->ring, message, len, session->ring_owner))
+    return false;
+
+  if (__atomic_exchange_n(&session->ring->consumer_idle, 0,
+                          __ATOMIC_SEQ_CST)) {
+    char bell = 1;
+    // Without a reader the consumer is gone; remap on the next push.
+    if (session->fd < 0 || (write(session->fd, &bell, 1) < 0 &&
+                            errno != EAGAIN)) {
+      ring_session_unmap(session);
+    }
+  }
+  return true;
+}
+
+static inline bool ring_session_request(struct sketchybar_session *session,
+                                        char *message, uint32_t len,
+                                        struct sketchybar_reply *reply) {
+  (void)reply;
+  return ring_session_push(session, message, len);
+}
+
+static inline void ring_session_release(struct sketchybar_session *session,
+                                        struct sketchybar_reply *reply) {
+  (void)session;
+  (void)reply;
+}
+
+static const struct sketchybar_transport g_ring_transport = {
+    "ring",
+    ring_session_begin,
+    ring_session_end,
+    ring_session_push,
+    ring_session_request,
+    ring_session_release,
+};
+
+/* ------------------------------------------------------------------ */
+/* Diff cache                                                           */
+/* ------------------------------------------------------------------ */
+
+// Client-side suppression of redundant property updates. Attached to a
+// session (session->diff), it remembers a hash of the last value sent for
+// every (item, property) of a --set and drops assignments that would not
+// change anything; a --set left without properties is dropped entirely.
+// Within one message only the last assignment to a property survives. Regex
+// targets pass through untouched, and --add/--remove/--rename of an item or
+// a reconnect to the bar invalidate what the cache knows.
+//   static struct sketchybar_diff_cache diff;
+//   sketchybar_thread_session()->diff = &diff;
+// Counters: hits (assignments dropped as unchanged), misses (assignments
+// sent) and coalesced (assignments superseded later in the same message).
+struct sketchybar_diff_entry {
+  uint64_t key;
+  uint64_t item;
+  uint64_t value;
+};
+
+struct sketchybar_diff_token {
+  uint32_t offset;
+  uint32_t length;
+  uint64_t key;
+};
+
+struct sketchybar_diff_cache {
+  struct sketchybar_diff_entry *entries;
+  uint32_t capacity;
+  uint32_t count;
+  uint32_t generation;
+
+  // Scratch space reused by every filtered message.
+  struct sketchybar_diff_token *tokens;
+  uint32_t token_capacity;
+  uint32_t *last;
+  uint32_t last_capacity;
+  char *buffer;
+  uint32_t buffer_capacity;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t coalesced;
+};
+
+static inline uint64_t sketchybar_diff_hash(uint64_t hash, const char *data,
+                                            uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static inline void sketchybar_diff_clear(struct sketchybar_diff_cache *cache) {
+  if (cache->entries)
+    memset(cache->entries, 0,
+           cache->capacity * sizeof(struct sketchybar_diff_entry));
+  cache->count = 0;
+}
+
+static inline void sketchybar_diff_free(struct sketchybar_diff_cache *cache) {
+  free(cache->entries);
+  free(cache->tokens);
+  free(cache->last);
+  free(cache->buffer);
+  *cache = (struct sketchybar_diff_cache){0};
+}
+
+static inline bool sketchybar_diff_grow(void **buffer, uint32_t *capacity,
+                                        uint32_t needed, size_t size) {
+  if (needed <= *capacity)
+    return true;
+  uint32_t grown = *capacity ? *capacity : 64;
+  while (grown < needed)
+    grown *= 2;
+  void *memory = realloc(*buffer, grown * size);
+  if (!memory)
+    return false;
+  *buffer = memory;
+  *capacity = grown;
+  return true;
+}
+
+// Entries use key 0 as the empty marker; keys are forced odd to avoid it.
+static inline struct sketchybar_diff_entry *
+sketchybar_diff_slot(struct sketchybar_diff_cache *cache, uint64_t key) {
+  uint32_t mask = cache->capacity - 1;
+  uint32_t i = (uint32_t)key & mask;
+  while (cache->entries[i].key && cache->entries[i].key != key)
+    i = (i + 1) & mask;
+  return &cache->entries[i];
+}
+
+static inline bool sketchybar_diff_reserve(struct sketchybar_diff_cache *cache) {
+  if ((cache->count + 1) * 2 <= cache->capacity)
+    return true;
+
+  uint32_t capacity = cache->capacity ? cache->capacity * 2 : 256;
+  struct sketchybar_diff_entry *entries = (struct sketchybar_diff_entry *)calloc(
+      capacity, sizeof(struct sketchybar_diff_entry));
+  if (!entries)
+    return false;
+
+  struct sketchybar_diff_entry *old = cache->entries;
+  uint32_t old_capacity = cache->capacity;
+  cache->entries = entries;
+  cache->capacity = capacity;
+  for (uint32_t i = 0; i < old_capacity; i++) {
+    if (old[i].key)
+      *sketchybar_diff_slot(cache, old[i].key) = old[i];
+  }
+  free(old);
+  return true;
+}
+
+// Linear probing has no tombstones, so forgetting an item rebuilds the table.
+static inline void sketchybar_diff_forget(struct sketchybar_diff_cache *cache,
+                                          uint64_t item) {
+  uint32_t capacity = cache->capacity;
+  struct sketchybar_diff_entry *old = cache->entries;
+  struct sketchybar_diff_entry *entries = (struct sketchybar_diff_entry *)calloc(
+      capacity, sizeof(struct sketchybar_diff_entry));
+  if (!entries) {
+    sketchybar_diff_clear(cache);
+    return;
+  }
+
+  cache->entries = entries;
+  cache->count = 0;
+  for (uint32_t i = 0; i < capacity; i++) {
+    if (old[i].key && old[i].item != item) {
+      *sketchybar_diff_slot(cache, old[i].key) = old[i];
+      cache->count++;
+    }
+  }
+  free(old);
+}
+
+// Returns true when the assignment changes the cached value (and records it).
+static inline bool sketchybar_diff_update(struct sketchybar_diff_cache *cache,
+                                          uint64_t key, uint64_t item,
+                                          uint64_t value) {
+  if (!sketchybar_diff_reserve(cache))
+    return true;
+
+  struct sketchybar_diff_entry *entry = sketchybar_diff_slot(cache, key);
+  if (entry->key && entry->value == value)
+    return false;
+  if (!entry->key)
+    cache->count++;
+  *entry = (struct sketchybar_diff_entry){key, item, value};
+  return true;
+}
+
+static inline bool sketchybar_diff_is_command(const char *token) {
+  return token[0] == '-' && token[1] == '-';
+}
+
+// Rewrites message (tokens closed by an extra NUL, len including it) without
+// redundant assignments. Returns the message to send, which may be the
+// original, and stores its length in len; *len is 0 when nothing is left.
+static inline char *sketchybar_diff_filter(struct sketchybar_diff_cache *cache,
+                                           uint32_t generation, char *message,
+                                           uint32_t *len) {
+  if (cache->generation != generation) {
+    sketchybar_diff_clear(cache);
+    cache->generation = generation;
+  }
+
+  // Pass 1: split into tokens and key every --set property by item and name.
+  uint32_t token_count = 0;
+  uint32_t property_count = 0;
+  uint32_t invalidations = 0;
+  uint64_t item = 0;
+  bool in_set = false;
+  for (uint32_t caret = 0; caret + 1 < *len && message[caret];) {
+    uint32_t length = strnlen(&message[caret], *len - caret);
+    if (!sketchybar_diff_grow((void **)&cache->tokens, &cache->token_capacity,
+                              token_count + 1,
+                              sizeof(struct sketchybar_diff_token)))
+      return message;
+
+    struct sketchybar_diff_token *token = &cache->tokens[token_count];
+    *token = (struct sketchybar_diff_token){caret, length, 0};
+    const char *text = &message[caret];
+    char *equals = (char *)memchr(text, '=', length);
+
+    if (sketchybar_diff_is_command(text)) {
+      in_set = strcmp(text, "--set") == 0;
+      item = 0;
+      if (!strcmp(text, "--add") || !strcmp(text, "--remove") ||
+          !strcmp(text, "--rename"))
+        invalidations++;
+    } else if (in_set && !item) {
+      // Regex targets touch items the cache cannot name.
+      if (text[0] == '/') {
+        sketchybar_diff_clear(cache);
+        return message;
+      }
+      item = sketchybar_diff_hash(1469598103934665603ull, text, length + 1);
+    } else if (in_set && equals) {
+      token->key = sketchybar_diff_hash(item, text, equals - text) | 1;
+      property_count++;
+    }
+
+    token_count++;
+    caret += length + 1;
+  }
+
+  if (!property_count && !invalidations)
+    return message;
+
+  // Pass 2: remember the last occurrence of every key in this message.
+  uint32_t slots = 16;
+  while (slots < property_count * 2)
+    slots *= 2;
+  if (!sketchybar_diff_grow((void **)&cache->last, &cache->last_capacity,
+                            slots, sizeof(uint32_t)) ||
+      !sketchybar_diff_grow((void **)&cache->buffer, &cache->buffer_capacity,
+                            *len, 1))
+    return message;
+  memset(cache->last, 0xff, slots * sizeof(uint32_t));
+  for (uint32_t i = 0; i < token_count; i++) {
+    uint64_t key = cache->tokens[i].key;
+    if (!key)
+      continue;
+    uint32_t j = (uint32_t)key & (slots - 1);
+    while (cache->last[j] != UINT32_MAX && cache->tokens[cache->last[j]].key != key)
+      j = (j + 1) & (slots - 1);
+    cache->last[j] = i;
+  }
+
+  // Pass 3: emit everything except superseded and unchanged assignments.
+  uint32_t out = 0;
+  uint32_t group = UINT32_MAX;
+  uint32_t group_out = 0;
+  bool group_kept = false;
+  item = 0;
+  for (uint32_t i = 0; i < token_count; i++) {
+    struct sketchybar_diff_token *token = &cache->tokens[i];
+    const char *text = &message[token->offset];
+
+    if (sketchybar_diff_is_command(text)) {
+      if (group != UINT32_MAX && !group_kept)
+        out = group_out;
+      group = UINT32_MAX;
+      if (strcmp(text, "--set") == 0) {
+        group = i;
+        group_out = out;
+        group_kept = false;
+      } else if ((strcmp(text, "--add") == 0 && i + 2 < token_count) ||
+                 ((strcmp(text, "--remove") == 0 ||
+                   strcmp(text, "--rename") == 0) &&
+                  i + 1 < token_count)) {
+        uint32_t name = strcmp(text, "--add") == 0 ? i + 2 : i + 1;
+        sketchybar_diff_forget(
+            cache, sketchybar_diff_hash(1469598103934665603ull,
+                                        &message[cache->tokens[name].offset],
+                                        cache->tokens[name].length + 1));
+      }
+    } else if (group != UINT32_MAX && i == group + 1) {
+      item = sketchybar_diff_hash(1469598103934665603ull, text,
+                                  token->length + 1);
+    } else if (token->key) {
+      uint32_t j = (uint32_t)token->key & (slots - 1);
+      while (cache->tokens[cache->last[j]].key != token->key)
+        j = (j + 1) & (slots - 1);
+      if (cache->last[j] != i) {
+        cache->coalesced++;
+        continue;
+      }
+
+      const char *value = (const char *)memchr(text, '=', token->length) + 1;
+      uint64_t hash = sketchybar_diff_hash(
+          1469598103934665603ull, value, token->length - (value - text));
+      if (!sketchybar_diff_update(cache, token->key, item, hash)) {
+        cache->hits++;
+        continue;
+      }
+      cache->misses++;
+      group_kept = true;
+    } else if (group != UINT32_MAX) {
+      // Anything else inside a --set (e.g. a bare flag) is always sent.
+      group_kept = true;
+    }
+
+    memcpy(&cache->buffer[out], text, token->length + 1);
+    out += token->length + 1;
+  }
+  if (group != UINT32_MAX && !group_kept)
+    out = group_out;
+
+  if (!out) {
+    *len = 0;
+    return cache->buffer;
+  }
+  cache->buffer[out++] = '\0';
+  *len = out;
+  return cache->buffer;
+}
+
+/* ------------------------------------------------------------------ */
+/* Client API                                                           */
+/* ------------------------------------------------------------------ */
+
+static inline bool
+sketchybar_session_begin_with(struct sketchybar_session *session,
+                              const struct sketchybar_transport *transport,
+                              const char *address) {
+  *session = (struct sketchybar_session){0};
+  session->fd = -1;
+  session->transport = transport;
+  if (transport->begin(session, address))
+    return true;
+
+  session->transport = NULL;
+  return false;
+}
+
+// Picks the transport from the environment: $SKETCHYBAR_RING selects the
+// shared-memory ring and $SKETCHYBAR_SOCKET the socket transport, otherwise
+// the bar's Mach service is used where it exists.
+static inline bool sketchybar_session_begin(struct sketchybar_session *session) {
+  const char *ring = getenv("SKETCHYBAR_RING");
+  if (ring && *ring)
+    return sketchybar_session_begin_with(session, &g_ring_transport, ring);
+
+  const char *path = getenv("SKETCHYBAR_SOCKET");
+  if (path && *path)
+    return sketchybar_session_begin_with(session, &g_socket_transport, path);
+#ifdef __APPLE__
+  return sketchybar_session_begin_with(session, &g_mach_transport,
+                                       SKETCHYBAR_SERVICE);
+#else
+  return sketchybar_session_begin_with(session, &g_socket_transport,
+                                       SKETCHYBAR_DEFAULT_SOCKET);
+#endif
+}
+
+static inline void sketchybar_session_end(struct sketchybar_session *session) {
+  if (session->transport)
+    session->transport->end(session);
+  free(session->response);
+  *session = (struct sketchybar_session){0};
+  session->fd = -1;
+}
+
+// Fire-and-forget: the bar is told not to answer and the caller never waits.
+static inline bool sketchybar_session_push(struct sketchybar_session *session,
+                                           char *message, uint32_t len) {
+  if (!message || !session->transport)
+    return false;
+
+  if (session->diff) {
+    message = sketchybar_diff_filter(session->diff, session->generation,
+                                     message, &len);
+    if (!len)
+      return true;
+  }
+
+  if (session->transport->push(session, message, len))
+    return true;
+  // What the cache recorded never reached the bar.
+  if (session->diff)
+    sketchybar_diff_clear(session->diff);
+  return false;
+}
+
+// Sends a message and hands out the bar's reply without copying it. Returns
+// false when the message could not be delivered; reply->data is NULL when the
+// bar did not answer in time. The reply must be given back with
+// sketchybar_reply_release().
+static inline bool
+sketchybar_session_send_borrowed(struct sketchybar_session *session,
+                                 char *message, uint32_t len,
+                                 struct sketchybar_reply *reply) {
+  *reply = (struct sketchybar_reply){0};
+  if (!message || !session->transport)
+    return false;
+
+  if (session->diff) {
+    message = sketchybar_diff_filter(session->diff, session->generation,
+                                     message, &len);
+    if (!len)
+      return true;
+  }
+
+  if (session->transport->request(session, message, len, reply))
+    return true;
+  if (session->diff)
+    sketchybar_diff_clear(session->diff);
+  return false;
+}
+
+static inline void sketchybar_reply_release(struct sketchybar_session *session,
+                                            struct sketchybar_reply *reply) {
+  if (session->transport)
+    session->transport->release(session, reply);
+  *reply = (struct sketchybar_reply){0};
+}
+
+static inline char *sketchybar_session_send(struct sketchybar_session *session,
+                                            char *message, uint32_t len) {
+  struct sketchybar_reply reply;
+  if (!sketchybar_session_send_borrowed(session, message, len, &reply))
+    return NULL;
+
+  // The socket transport already received into the response buffer.
+  if (reply.data && reply.data == session->response) {
+    sketchybar_reply_release(session, &reply);
+    return session->response;
+  }
+
+  if (!sketchybar_session_reserve(session, reply.size + 1)) {
+    sketchybar_reply_release(session, &reply);
+    return NULL;
+  }
+
+  if (reply.size)
+    memcpy(session->response, reply.data, reply.size);
+  session->response[reply.size] = '\0';
+  sketchybar_reply_release(session, &reply);
+  return session->response;
+}
+
+static inline void sketchybar_thread_session_free(void *session) {
+  sketchybar_session_end((struct sketchybar_session *)session);
+  free(session);
+}
+
+static inline void sketchybar_thread_session_init(void) {
+  pthread_key_create(&g_session_key, sketchybar_thread_session_free);
+}
+
+// The calling thread's own session, created on first use and torn down when
+// the thread exits. With $SKETCHYBAR_RING every such session is another
+// producer on the same ring.
+static inline struct sketchybar_session *sketchybar_thread_session(void) {
+  pthread_once(&g_session_once, sketchybar_thread_session_init);
+  struct sketchybar_session *session =
+      (struct sketchybar_session *)pthread_getspecific(g_session_key);
+  if (session)
+    return session;
+
+  session =
+      (struct sketchybar_session *)malloc(sizeof(struct sketchybar_session));
+  if (!session)
+    return NULL;
+  if (!sketchybar_session_begin(session)) {
+    free(session);
+    return NULL;
+  }
+  pthread_setspecific(g_session_key, session);
+  return session;
+}
+
+/* ------------------------------------------------------------------ */
+/* Event servers                                                        */
+/* ------------------------------------------------------------------ */
+
+static inline uint64_t mach_server_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void mach_server_record_max(uint64_t *max, uint64_t value) {
+  uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(max, &current, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static inline void mach_server_record_received(struct mach_server_stats *stats) {
+  __atomic_fetch_add(&stats->received, 1, __ATOMIC_RELAXED);
+  mach_server_record_max(
+      &stats->queue_depth_max,
+      __atomic_add_fetch(&stats->queue_depth, 1, __ATOMIC_RELAXED));
+}
+
+// Runs handler on one event with its env indexed and records the time spent.
+static inline void mach_server_dispatch(struct mach_server_stats *stats,
+                                        mach_handler *handler,
+                                        struct env_index *index, env blob,
+                                        uint32_t size) {
+  env_index_build(index, blob, size);
+  t_env_index = index;
+
+  uint64_t start = mach_server_now_ns();
+  handler(blob);
+  uint64_t elapsed = mach_server_now_ns() - start;
+
+  t_env_index = NULL;
+  index->blob = NULL;
+
+  __atomic_fetch_add(&stats->handled, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&stats->queue_depth, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->handler_ns_total, elapsed, __ATOMIC_RELAXED);
+  mach_server_record_max(&stats->handler_ns_max, elapsed);
+}
+
+static inline void mach_server_copy_stats(struct mach_server_stats *source,
+                                          struct mach_server_stats *stats) {
+  stats->received = __atomic_load_n(&source->received, __ATOMIC_RELAXED);
+  stats->handled = __atomic_load_n(&source->handled, __ATOMIC_RELAXED);
+  stats->queue_depth = __atomic_load_n(&source->queue_depth, __ATOMIC_RELAXED);
+  stats->queue_depth_max =
+      __atomic_load_n(&source->queue_depth_max, __ATOMIC_RELAXED);
+  stats->handler_ns_total =
+      __atomic_load_n(&source->handler_ns_total, __ATOMIC_RELAXED);
+  stats->handler_ns_max =
+      __atomic_load_n(&source->handler_ns_max, __ATOMIC_RELAXED);
+}
+
+// Events queued on the workers or running there. At the limit
+// event_pool_submit waits for a worker before the receive loop takes the next
+// message, so the transport's own queue fills up and senders block just as
+// they do when handlers run inline.
+#define EVENT_POOL_MAX_QUEUED 256
+
+static inline void *event_worker_run(void *context) {
+  struct event_worker *worker = (struct event_worker *)context;
+  struct event_pool *pool = worker->pool;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!worker->head && !pool->is_stopping)
+      pthread_cond_wait(&worker->ready, &pool->lock);
+    struct event_job *job = worker->head;
+    if (!job)
+      break;
+    worker->head = job->next;
+    if (!worker->head)
+      worker->tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    mach_server_dispatch(pool->stats, pool->handler, &worker->index, job->blob,
+                         job->size);
+    job->release(job);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued--;
+    pthread_cond_signal(&pool->space);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static inline bool event_pool_begin(struct event_pool *pool,
+                                    mach_handler *handler,
+                                    struct mach_server_stats *stats,
+                                    uint32_t worker_count, uint32_t limit) {
+  pool->workers =
+      (struct event_worker *)calloc(worker_count, sizeof(struct event_worker));
+  if (!pool->workers)
+    return false;
+
+  pool->handler = handler;
+  pool->stats = stats;
+  pool->limit = limit ? limit : 1;
+  pool->worker_count = 0;
+  pool->queued = 0;
+  pool->is_stopping = false;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->space, NULL);
+  for (uint32_t i = 0; i < worker_count; i++) {
+    struct event_worker *worker = &pool->workers[i];
+    worker->pool = pool;
+    pthread_cond_init(&worker->ready, NULL);
+    if (pthread_create(&worker->thread, NULL, event_worker_run, worker) != 0)
+      break;
+    pool->worker_count++;
+  }
+  return pool->worker_count > 0;
+}
+
+// Lets the workers drain what is queued, then joins them.
+static inline void event_pool_end(struct event_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->is_stopping = true;
+  for (uint32_t i = 0; i < pool->worker_count; i++)
+    pthread_cond_signal(&pool->workers[i].ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (uint32_t i = 0; i < pool->worker_count; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+    pthread_cond_destroy(&pool->workers[i].ready);
+    free(pool->workers[i].index.slots);
+  }
+  pthread_cond_destroy(&pool->space);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->workers);
+  pool->workers = NULL;
+  pool->worker_count = 0;
+}
+
+static inline uint32_t event_pool_shard(struct event_pool *pool, env blob) {
+  uint32_t length;
+  uint32_t hash =
+      env_hash(env_get_value_for_key(blob, (char *)"NAME"), &length);
+  hash ^= env_hash(env_get_value_for_key(blob, (char *)"SENDER"), &length) *
+          16777619u;
+  return hash % pool->worker_count;
+}
+
+// Queues job on the worker its key maps to, waiting while the pool is full.
+static inline void event_pool_submit(struct event_pool *pool,
+                                     struct event_job *job) {
+  struct event_worker *worker =
+      &pool->workers[event_pool_shard(pool, job->blob)];
+  job->next = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->queued >= pool->limit)
+    pthread_cond_wait(&pool->space, &pool->lock);
+  pool->queued++;
+  if (worker->tail)
+    worker->tail->next = job;
+  else
+    worker->head = job;
+  worker->tail = job;
+  pthread_cond_signal(&worker->ready);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// A copy of the blob for transports that reuse their receive buffer.
+static inline void event_job_free(struct event_job *job) { free(job); }
+
+static inline struct event_job *event_job_copy(env blob, uint32_t size) {
+  struct event_job *job =
+      (struct event_job *)malloc(sizeof(struct event_job) + size + 1);
+  if (!job)
+    return NULL;
+  job->blob = (env)(job + 1);
+  memcpy(job->blob, blob, size);
+  job->blob[size] = '\0';
+  job->size = size;
+  job->release = event_job_free;
+  return job;
+}
+
+#ifdef __APPLE__
+// A received Mach message handed to the pool; the OOL region is the blob.
+struct mach_event {
+  struct event_job job;
+  struct mach_buffer buffer;
+};
+
+static inline void mach_server_handle(struct mach_server *mach_server,
+                                      struct env_index *index,
+                                      struct mach_buffer *buffer) {
+  mach_server_dispatch(&mach_server->stats, mach_server->handler, index,
+                       (env)buffer->message.descriptor.address,
+                       buffer->message.descriptor.size);
+  mach_msg_destroy(&buffer->message.header);
+}
+
+static inline void mach_event_release(struct event_job *job) {
+  struct mach_event *event = (struct mach_event *)job;
+  mach_msg_destroy(&event->buffer.message.header);
+  free(event);
+}
+
+static inline void mach_server_get_stats(struct mach_server *mach_server,
+                                         struct mach_server_stats *stats) {
+  mach_server_copy_stats(&mach_server->stats, stats);
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+static inline bool mach_server_begin(struct mach_server *mach_server,
+                                     mach_handler handler,
+                                     char *bootstrap_name) {
+  mach_server->task = mach_task_self();
+
+  if (mach_port_allocate(mach_server->task, MACH_PORT_RIGHT_RECEIVE,
+                         &mach_server->port) != KERN_SUCCESS) {
+    return false;
+  }
+
+  struct mach_port_limits limits = {};
+  limits.mpl_qlimit = MACH_PORT_QLIMIT_LARGE;
+
+  if (mach_port_set_attributes(mach_server->task, mach_server->port,
+                               MACH_PORT_LIMITS_INFO, (mach_port_info_t)&limits,
+                               MACH_PORT_LIMITS_INFO_COUNT) != KERN_SUCCESS) {
+    return false;
+  }
+
+  if (mach_port_insert_right(mach_server->task, mach_server->port,
+                             mach_server->port,
+                             MACH_MSG_TYPE_MAKE_SEND) != KERN_SUCCESS) {
+    return false;
+  }
+
+  if (task_get_special_port(mach_server->task, TASK_BOOTSTRAP_PORT,
+                            &mach_server->bs_port) != KERN_SUCCESS) {
+    return false;
+  }
+
+  if (bootstrap_register(mach_server->bs_port, bootstrap_name,
+                         mach_server->port) != KERN_SUCCESS) {
+    return false;
+  }
+
+  if (mach_server->worker_count &&
+      !event_pool_begin(&mach_server->pool, handler, &mach_server->stats,
+                        mach_server->worker_count, EVENT_POOL_MAX_QUEUED))
+    return false;
+
+  mach_server->handler = handler;
+  mach_server->is_running = true;
+  struct mach_buffer buffer;
+  while (mach_server->is_running) {
+    mach_receive_message(mach_server->port, &buffer, true);
+    if (getppid() == 1)
+      exit(0);
+    if (!buffer.message.descriptor.address)
+      continue;
+    if (*(char *)buffer.message.descriptor.address == 'k' &&
+        buffer.message.descriptor.size == 2) {
+      exit(0);
+    }
+
+    mach_server_record_received(&mach_server->stats);
+
+    if (!mach_server->worker_count) {
+      mach_server_handle(mach_server, &g_env_index, &buffer);
+      continue;
+    }
+
+    struct mach_event *event =
+        (struct mach_event *)malloc(sizeof(struct mach_event));
+    if (!event) {
+      mach_server_handle(mach_server, &g_env_index, &buffer);
+      continue;
+    }
+    event->buffer = buffer;
+    event->job.blob = (env)buffer.message.descriptor.address;
+    event->job.size = buffer.message.descriptor.size;
+    event->job.release = mach_event_release;
+    event_pool_submit(&mach_server->pool, &event->job);
+  }
+
+  return true;
+}
+#pragma clang diagnostic pop
+#endif
+
+// The same event server on a Unix socket: frames carry the env blob, handlers
+// run inline on the serving thread or on the worker pool when worker_count is
+// set, and every frame that asks for a reply gets an empty one.
+#define SOCKET_SERVER_MAX_CLIENTS 32
+
+struct socket_server {
+  bool is_running;
+  int fd;
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  mach_handler *handler;
+
+  struct pollfd fds[SOCKET_SERVER_MAX_CLIENTS + 1];
+  uint32_t fd_count;
+  char *buffer;
+  uint32_t capacity;
+  uint32_t worker_count;
+  struct event_pool pool;
+  struct mach_server_stats stats;
+};
+
+static struct socket_server g_socket_server;
+
+// The socket a helper registered as bootstrap_name listens on.
+static inline void socket_server_path(char *path, size_t size,
+                                      const char *bootstrap_name) {
+  snprintf(path, size, "/tmp/%s.socket", bootstrap_name);
+}
+
+static inline void socket_server_drop(struct socket_server *server,
+                                      uint32_t i) {
+  close(server->fds[i].fd);
+  server->fds[i] = server->fds[--server->fd_count];
+}
+
+static inline bool socket_server_receive(struct socket_server *server, int fd) {
+  struct socket_frame frame;
+  if (!socket_read_all(fd, &frame, sizeof(frame)) ||
+      frame.length > SOCKET_FRAME_MAX)
+    return false;
+
+  if (frame.length + 1 > server->capacity) {
+    uint32_t capacity = server->capacity ? server->capacity : 1024;
+    while (capacity < frame.length + 1)
+      capacity *= 2;
+    char *buffer = (char *)realloc(server->buffer, capacity);
+    if (!buffer)
+      return false;
+    server->buffer = buffer;
+    server->capacity = capacity;
+  }
+
+  if (!socket_read_all(fd, server->buffer, frame.length))
+    return false;
+  server->buffer[frame.length] = '\0';
+
+  if (server->buffer[0] == 'k' && frame.length == 2)
+    exit(0);
+
+  if (frame.length) {
+    mach_server_record_received(&server->stats);
+    struct event_job *job =
+        server->pool.worker_count
+            ? event_job_copy(server->buffer, frame.length)
+            : NULL;
+    if (job)
+      event_pool_submit(&server->pool, job);
+    else
+      mach_server_dispatch(&server->stats, server->handler, &g_env_index,
+                           server->buffer, frame.length);
+  }
+
+  if (!(frame.flags & SOCKET_FRAME_NO_REPLY))
+    return socket_write_frame(fd, 0, (char *)"", 1);
+  return true;
+}
+
+static inline bool socket_server_begin(struct socket_server *server,
+                                       mach_handler handler,
+                                       const char *path) {
+  snprintf(server->path, sizeof(server->path), "%s", path);
+  server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server->fd < 0)
+    return false;
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", server->path);
+  unlink(server->path);
+  if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(server->fd, SOCKET_SERVER_MAX_CLIENTS) < 0) {
+    close(server->fd);
+    return false;
+  }
+
+  if (server->worker_count &&
+      !event_pool_begin(&server->pool, handler, &server->stats,
+                        server->worker_count, EVENT_POOL_MAX_QUEUED)) {
+    close(server->fd);
+    return false;
+  }
+
+  server->handler = handler;
+  server->fds[0] = (struct pollfd){server->fd, POLLIN, 0};
+  server->fd_count = 1;
+  server->is_running = true;
+  while (server->is_running) {
+    int ready = poll(server->fds, server->fd_count, 1000);
+    if (getppid() == 1)
+      exit(0);
+    if (ready <= 0)
+      continue;
+
+    for (uint32_t i = server->fd_count; i-- > 1;) {
+      if (!server->fds[i].revents)
+        continue;
+      if (!(server->fds[i].revents & POLLIN) ||
+          !socket_server_receive(server, server->fds[i].fd))
+        socket_server_drop(server, i);
+    }
+
+    if (server->fds[0].revents & POLLIN) {
+      int client = accept(server->fd, NULL, NULL);
+      if (client >= 0 && server->fd_count <= SOCKET_SERVER_MAX_CLIENTS &&
+          socket_peer_is_user(client))
+        server->fds[server->fd_count++] = (struct pollfd){client, POLLIN, 0};
+      else if (client >= 0)
+        close(client);
+    }
+  }
+
+  for (uint32_t i = server->fd_count; i-- > 1;)
+    socket_server_drop(server, i);
+  if (server->pool.worker_count)
+    event_pool_end(&server->pool);
+  close(server->fd);
+  unlink(server->path);
+  return true;
+}
+
+// Consumer side of the shared-memory ring. It creates the segment and the
+// doorbell FIFO, drains records into the handler and only sleeps on the
+// doorbell once the ring is empty.
+struct ring_server {
+  bool is_running;
+  char name[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  char bell[sizeof(((struct sockaddr_un *)0)->sun_path) + 16];
+  struct ring_header *ring;
+  int fd;
+  mach_handler *handler;
+
+  char *buffer;
+  uint32_t capacity;
+  struct mach_server_stats stats;
+};
+
+static struct ring_server g_ring_server;
+
+static inline void ring_server_path(char *name, size_t size,
+                                    const char *bootstrap_name) {
+  snprintf(name, size, "/%s.ring", bootstrap_name);
+}
+
+static inline bool ring_server_ready(struct ring_server *server) {
+  struct ring_header *ring = server->ring;
+  uint32_t offset = ring->tail & (ring->capacity - 1);
+  return __atomic_load_n(&ring_record_at(ring, offset)->committed,
+                         __ATOMIC_SEQ_CST);
+}
+
+// Drops the ring's contents up to position, as if they were consumed.
+static inline void ring_server_skip(struct ring_server *server,
+                                    uint64_t position) {
+  struct ring_header *ring = server->ring;
+  for (uint64_t at = ring->tail; at < position;) {
+    uint32_t offset = at & (ring->capacity - 1);
+    uint64_t length = ring->capacity - offset;
+    if (length > position - at)
+      length = position - at;
+    memset(&ring->data[offset], 0, length);
+    at += length;
+  }
+  __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->tail, position, __ATOMIC_RELEASE);
+}
+
+// Called while the record at tail has been claimed but not committed for
+// stalled_ms; returns true when it gave up on the record and moved tail.
+static inline bool ring_server_recover(struct ring_server *server,
+                                       uint64_t stalled_ms) {
+  struct ring_header *ring = server->ring;
+  uint64_t tail = ring->tail;
+  uint32_t offset = tail & (ring->capacity - 1);
+  struct ring_record *record = ring_record_at(ring, offset);
+  if (stalled_ms < RING_CLAIM_TIMEOUT_MS)
+    return false;
+
+  if (__atomic_load_n(&record->position, __ATOMIC_ACQUIRE) == ring_tag(tail) &&
+      ring_record_size(record->length) <= ring->capacity - offset) {
+    bool gone = kill(record->owner, 0) < 0 && errno == ESRCH;
+    if (!gone && stalled_ms < RING_ABANDON_MS)
+      return false;
+    ring_server_skip(server, tail + ring_record_size(record->length));
+    return true;
+  }
+
+  if (stalled_ms < RING_ABANDON_MS)
+    return false;
+  // No header: resync on the next record that carries its own position.
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t next = tail + 16;
+  while (next < head &&
+         __atomic_load_n(
+             &ring_record_at(ring, next & (ring->capacity - 1))->position,
+             __ATOMIC_ACQUIRE) != ring_tag(next))
+    next += 16;
+  ring_server_skip(server, next < head ? next : head);
+  return true;
+}
+
+// Returns false when no committed record is waiting. The record is copied out
+// before the slot is released so the handler may take its time.
+static inline bool ring_server_read(struct ring_server *server) {
+  struct ring_header *ring = server->ring;
+  uint64_t tail = ring->tail;
+  uint32_t offset = tail & (ring->capacity - 1);
+  struct ring_record *record = ring_record_at(ring, offset);
+  if (!__atomic_load_n(&record->committed, __ATOMIC_ACQUIRE))
+    return false;
+
+  uint32_t len = record->length;
+  if (len == RING_WRAP) {
+    // Only the marker was written; the rest of the lap is still zero.
+    *record = (struct ring_record){0};
+    __atomic_store_n(&ring->tail, tail + ring->capacity - offset,
+                     __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Producers never write records this large; the segment was scribbled on.
+  if (ring_record_size(len) > ring->capacity - offset) {
+    server->is_running = false;
+    return false;
+  }
+
+  if (len + 1 > server->capacity) {
+    uint32_t capacity = server->capacity ? server->capacity : 1024;
+    while (capacity < len + 1)
+      capacity *= 2;
+    char *buffer = (char *)realloc(server->buffer, capacity);
+    if (!buffer)
+      return false;
+    server->buffer = buffer;
+    server->capacity = capacity;
+  }
+
+  memcpy(server->buffer, record->data, len);
+  server->buffer[len] = '\0';
+  memset(record, 0, ring_record_size(len));
+  __atomic_store_n(&ring->tail, tail + ring_record_size(len),
+                   __ATOMIC_RELEASE);
+
+  if (server->buffer[0] == 'k' && len == 2)
+    exit(0);
+
+  if (len) {
+    mach_server_record_received(&server->stats);
+    mach_server_dispatch(&server->stats, server->handler, &g_env_index,
+                         server->buffer, len);
+  }
+  return true;
+}
+
+static inline bool ring_server_begin(struct ring_server *server,
+                                     mach_handler handler, const char *name) {
+  snprintf(server->name, sizeof(server->name), "%s", name);
+  ring_bell_path(server->bell, sizeof(server->bell), server->name);
+
+  size_t size = sizeof(struct ring_header) + RING_CAPACITY;
+  shm_unlink(server->name);
+  int shm = shm_open(server->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (shm < 0)
+    return false;
+  void *ring = MAP_FAILED;
+  if (ftruncate(shm, size) == 0)
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+  close(shm);
+  if (ring == MAP_FAILED)
+    return false;
+
+  server->ring = (struct ring_header *)ring;
+  server->ring->capacity = RING_CAPACITY;
+  __atomic_store_n(&server->ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+  unlink(server->bell);
+  // Opened read-write so the FIFO never reports EOF between producers.
+  if (mkfifo(server->bell, 0600) < 0 ||
+      (server->fd = open(server->bell, O_RDWR | O_NONBLOCK)) < 0) {
+    munmap(ring, size);
+    shm_unlink(server->name);
+    return false;
+  }
+
+  server->handler = handler;
+  server->is_running = true;
+  uint64_t stalled_tail = 0;
+  uint64_t stalled_since = mach_server_now_ns();
+  while (server->is_running) {
+    while (ring_server_read(server)) {
+    }
+
+    if (!server->is_running)
+      break;
+
+    __atomic_store_n(&server->ring->consumer_idle, 1, __ATOMIC_SEQ_CST);
+    if (ring_server_ready(server)) {
+      __atomic_store_n(&server->ring->consumer_idle, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    // A claimed but uncommitted record is usually moments away from its
+    // commit, so poll briefly and only give up on it after a while.
+    bool claimed = __atomic_load_n(&server->ring->head, __ATOMIC_ACQUIRE) !=
+                   server->ring->tail;
+    uint64_t now = mach_server_now_ns();
+    if (!claimed || server->ring->tail != stalled_tail) {
+      stalled_tail = server->ring->tail;
+      stalled_since = now;
+    } else if (ring_server_recover(server,
+                                   (now - stalled_since) / 1000000)) {
+      __atomic_store_n(&server->ring->consumer_idle, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    struct pollfd bell = {server->fd, POLLIN, 0};
+    poll(&bell, 1, claimed ? 1 : 1000);
+    if (getppid() == 1)
+      exit(0);
+
+    char drain[64];
+    while (read(server->fd, drain, sizeof(drain)) > 0) {
+    }
+    __atomic_store_n(&server->ring->consumer_idle, 0, __ATOMIC_RELAXED);
+  }
+
+  close(server->fd);
+  unlink(server->bell);
+  munmap(server->ring, size);
+  shm_unlink(server->name);
+  return true;
+}
+
+/* ------------------------------------------------------------------ */
+/* Commands                                                             */
+/* ------------------------------------------------------------------ */
+
+static inline char *sketchybar(char *message) {
+  char formatted_message[strlen(message) + 2];
+  uint32_t caret = sketchybar_tokenize(message, formatted_message);
+
+  formatted_message[caret] = '\0';
+  struct sketchybar_session *session = sketchybar_thread_session();
+  if (!session)
+    return (char *)"";
+  char *response =
+      sketchybar_session_send(session, formatted_message, caret + 1);
+
+  if (response)
+    return response;
+  else
+    return (char *)"";
+}
+
+// Packs many commands into a single message, the same way the Lua module's
+// begin_config/end_config bundles the whole configuration:
+//   sketchybar_batch_begin(&batch);
+//   sketchybar_batch_append(&batch, "--set a label=1");
+//   sketchybar_batch_append(&batch, "--trigger b_change");
+//   sketchybar_batch_commit(&session, &batch, SKETCHYBAR_BATCH_NO_REPLY);
+// The buffer is kept across begin/commit cycles and only grows.
+#define SKETCHYBAR_BATCH_NO_REPLY (1 << 0)
+
+struct sketchybar_batch {
+  char *buffer;
+  uint32_t length;
+  uint32_t capacity;
+};
+
+static inline void sketchybar_batch_begin(struct sketchybar_batch *batch) {
+  batch->length = 0;
+}
+
+static inline bool sketchybar_batch_reserve(struct sketchybar_batch *batch,
+                                            uint32_t size) {
+  if (batch->length + size <= batch->capacity)
+    return true;
+
+  uint32_t capacity = batch->capacity ? batch->capacity : 1024;
+  while (capacity < batch->length + size)
+    capacity *= 2;
+
+  char *buffer = (char *)realloc(batch->buffer, capacity);
+  if (!buffer)
+    return false;
+  batch->buffer = buffer;
+  batch->capacity = capacity;
+  return true;
+}
+
+// Empty tokens (from an empty command, leading or repeated spaces) are
+// dropped: inside a batch their double NUL would end the message early and
+// silently lose every command after it.
+static inline bool sketchybar_batch_append(struct sketchybar_batch *batch,
+                                           const char *message) {
+  // Room for the tokens plus the closing NUL written by commit.
+  if (!sketchybar_batch_reserve(batch, strlen(message) + 2))
+    return false;
+
+  char *tokens = batch->buffer + batch->length;
+  uint32_t length = sketchybar_tokenize(message, tokens);
+  uint32_t caret = 0;
+  for (uint32_t i = 0; i < length; i++) {
+    if (tokens[i] == '\0' && (caret == 0 || tokens[caret - 1] == '\0'))
+      continue;
+    tokens[caret++] = tokens[i];
+  }
+  if (caret && tokens[caret - 1] != '\0')
+    tokens[caret++] = '\0';
+
+  batch->length += caret;
+  return true;
+}
+
+static inline char *sketchybar_batch_commit(struct sketchybar_session *session,
+                                            struct sketchybar_batch *batch,
+                                            uint32_t flags) {
+  if (!batch->length)
+    return (char *)"";
+
+  batch->buffer[batch->length] = '\0';
+  uint32_t length = batch->length + 1;
+  batch->length = 0;
+
+  if (flags & SKETCHYBAR_BATCH_NO_REPLY) {
+    sketchybar_session_push(session, batch->buffer, length);
+    return (char *)"";
+  }
+
+  char *response = sketchybar_session_send(session, batch->buffer, length);
+  return response ? response : (char *)"";
+}
+
+static inline void sketchybar_batch_free(struct sketchybar_batch *batch) {
+  free(batch->buffer);
+  *batch = (struct sketchybar_batch){0};
+}
+
+// Compiled command templates for providers that send the same command shape
+// over and over. The format is tokenized once into a preformatted buffer with
+// typed %d/%u/%s slots; filling a slot rewrites only that slot in place
+// (moving the tail if its width changed), so sends skip both snprintf and
+// tokenization:
+//   struct sketchybar_template trash;
+//   SKETCHYBAR_TEMPLATE(&trash, "--trigger trash_change TRASH_COUNT=%d", 0);
+//   sketchybar_template_set_int(&trash, 0, count);
+//   sketchybar_template_push(session, &trash);
+// SKETCHYBAR_TEMPLATE only accepts a string literal and type-checks it against
+// the example arguments at compile time through the printf format attribute.
+#define SKETCHYBAR_TEMPLATE_SIZE 512
+#define SKETCHYBAR_TEMPLATE_SLOTS 8
+
+#define SKETCHYBAR_TEMPLATE(template, format, ...)                            \
+  (sketchybar_template_check("" format "", __VA_ARGS__),                     \
+   sketchybar_template_compile(template, format))
+
+struct sketchybar_template_slot {
+  char type;
+  uint32_t offset;
+  uint32_t length;
+};
+
+struct sketchybar_template {
+  char buffer[SKETCHYBAR_TEMPLATE_SIZE];
+  uint32_t length;
+  uint32_t slot_count;
+  struct sketchybar_template_slot slots[SKETCHYBAR_TEMPLATE_SLOTS];
+};
+
+__attribute__((format(printf, 1, 2))) static inline void
+sketchybar_template_check(const char *format, ...) {
+  (void)format;
+}
+
+// Returns false for formats that do not fit or use other conversions.
+static inline bool
+sketchybar_template_compile(struct sketchybar_template *template,
+                            const char *format) {
+  *template = (struct sketchybar_template){0};
+
+  char quote = '\0';
+  uint32_t caret = 0;
+  for (const char *c = format; *c; c++) {
+    if (caret + 2 >= SKETCHYBAR_TEMPLATE_SIZE)
+      return false;
+
+    if (*c == '"' || *c == '\'') {
+      quote = quote == *c ? '\0' : *c;
+      continue;
+    }
+
+    if (*c == '%') {
+      c++;
+      if (*c == '%') {
+        template->buffer[caret++] = '%';
+        continue;
+      }
+      if ((*c != 'd' && *c != 'u' && *c != 's') ||
+          template->slot_count == SKETCHYBAR_TEMPLATE_SLOTS)
+        return false;
+      template->slots[template->slot_count++] =
+          (struct sketchybar_template_slot){*c, caret, 0};
+      continue;
+    }
+
+    template->buffer[caret++] = (*c == ' ' && !quote) ? '\0' : *c;
+  }
+
+  // Drop the empty token a trailing space leaves, unless a slot fills it.
+  template->buffer[caret++] = '\0';
+  bool slot_at_end = template->slot_count &&
+                     template->slots[template->slot_count - 1].offset ==
+                         caret - 1;
+  if (caret > 1 && template->buffer[caret - 2] == '\0' && !slot_at_end)
+    caret--;
+  template->length = caret;
+  template->buffer[caret] = '\0';
+  return true;
+}
+
+static inline bool
+sketchybar_template_set(struct sketchybar_template *template, uint32_t slot,
+                        const char *value, uint32_t length) {
+  if (slot >= template->slot_count)
+    return false;
+
+  struct sketchybar_template_slot *target = &template->slots[slot];
+  int32_t delta = (int32_t)length - (int32_t)target->length;
+  if (template->length + 1 + delta > SKETCHYBAR_TEMPLATE_SIZE)
+    return false;
+
+  if (delta) {
+    uint32_t tail = target->offset + target->length;
+    memmove(&template->buffer[tail + delta], &template->buffer[tail],
+            template->length + 1 - tail);
+    template->length += delta;
+    for (uint32_t i = slot + 1; i < template->slot_count; i++)
+      template->slots[i].offset += delta;
+  }
+
+  memcpy(&template->buffer[target->offset], value, length);
+  target->length = length;
+  return true;
+}
+
+static inline bool
+sketchybar_template_set_int(struct sketchybar_template *template,
+                            uint32_t slot, long long value) {
+  char digits[24];
+  uint32_t caret = sizeof(digits);
+  unsigned long long magnitude =
+      value < 0 ? 0ull - (unsigned long long)value : (unsigned long long)value;
+  do {
+    digits[--caret] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0)
+    digits[--caret] = '-';
+  return sketchybar_template_set(template, slot, &digits[caret],
+                                 sizeof(digits) - caret);
+}
+
+static inline bool
+sketchybar_template_set_string(struct sketchybar_template *template,
+                               uint32_t slot, const char *value) {
+  return sketchybar_template_set(template, slot, value, strlen(value));
+}
+
+static inline char *
+sketchybar_template_send(struct sketchybar_session *session,
+                         struct sketchybar_template *template) {
+  char *response =
+      sketchybar_session_send(session, template->buffer, template->length + 1);
+  return response ? response : (char *)"";
+}
+
+static inline bool
+sketchybar_template_push(struct sketchybar_session *session,
+                         struct sketchybar_template *template) {
+  return sketchybar_session_push(session, template->buffer,
+                                 template->length + 1);
+}
+
+// Asynchronous client: sends are queued for a sender thread that owns its own
+// session, so a slow or restarting bar never blocks the caller. The sender
+// delivers one message at a time, in the order they were queued, so this is a
+// queue rather than a pipeline: a slow reply delays everything behind it. At
+// most queue_limit messages wait or are being sent; when the queue is full the
+// caller waits up to its timeout and the message is rejected after that.
+// Completions run on the sender thread and the response is only valid inside
+// the callback.
+typedef void (*sketchybar_completion)(void *context, char *response);
+
+struct sketchybar_async_request {
+  struct sketchybar_async_request *next;
+  sketchybar_completion completion;
+  void *context;
+  uint32_t length;
+  char message[];
+};
+
+struct sketchybar_async {
+  struct sketchybar_session session;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t space;
+  struct sketchybar_async_request *head;
+  struct sketchybar_async_request *tail;
+  uint32_t queued;
+  uint32_t queue_limit;
+  bool is_stopping;
+  uint64_t rejected;
+};
+
+static inline void *sketchybar_async_run(void *context) {
+  struct sketchybar_async *async = (struct sketchybar_async *)context;
+  pthread_mutex_lock(&async->lock);
+  for (;;) {
+    while (!async->head && !async->is_stopping)
+      pthread_cond_wait(&async->ready, &async->lock);
+    struct sketchybar_async_request *request = async->head;
+    if (!request)
+      break;
+    async->head = request->next;
+    if (!async->head)
+      async->tail = NULL;
+    pthread_mutex_unlock(&async->lock);
+
+    if (request->completion) {
+      char *response = sketchybar_session_send(
+          &async->session, request->message, request->length);
+      request->completion(request->context, response ? response : (char *)"");
+    } else {
+      sketchybar_session_push(&async->session, request->message,
+                              request->length);
+    }
+    free(request);
+
+    pthread_mutex_lock(&async->lock);
+    async->queued--;
+    pthread_cond_signal(&async->space);
+  }
+  pthread_mutex_unlock(&async->lock);
+  return NULL;
+}
+
+static inline bool sketchybar_async_begin(struct sketchybar_async *async,
+                                          uint32_t queue_limit) {
+  *async = (struct sketchybar_async){0};
+  if (!sketchybar_session_begin(&async->session))
+    return false;
+
+  async->queue_limit = queue_limit ? queue_limit : 1;
+  pthread_mutex_init(&async->lock, NULL);
+  pthread_cond_init(&async->ready, NULL);
+  pthread_cond_init(&async->space, NULL);
+  if (pthread_create(&async->thread, NULL, sketchybar_async_run, async) != 0) {
+    sketchybar_session_end(&async->session);
+    return false;
+  }
+  return true;
+}
+
+// Waits until the queue has room or timeout_ms passed; called with the lock.
+static inline bool sketchybar_async_wait(struct sketchybar_async *async,
+                                         uint32_t timeout_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  while (async->queued >= async->queue_limit) {
+    if (!timeout_ms ||
+        pthread_cond_timedwait(&async->space, &async->lock, &deadline) ==
+            ETIMEDOUT)
+      return async->queued < async->queue_limit;
+  }
+  return true;
+}
+
+// Queues a command for the bar. Without a completion the message is sent
+// fire-and-forget. Returns false when the queue did not free up within
+// timeout_ms.
+static inline bool sketchybar_async_send(struct sketchybar_async *async,
+                                         const char *message,
+                                         sketchybar_completion completion,
+                                         void *context, uint32_t timeout_ms) {
+  uint32_t size = strlen(message) + 2;
+  struct sketchybar_async_request *request =
+      (struct sketchybar_async_request *)malloc(
+          sizeof(struct sketchybar_async_request) + size);
+  if (!request)
+    return false;
+
+  request->next = NULL;
+  request->completion = completion;
+  request->context = context;
+  request->length = sketchybar_tokenize(message, request->message);
+  request->message[request->length++] = '\0';
+
+  pthread_mutex_lock(&async->lock);
+  if (!sketchybar_async_wait(async, timeout_ms)) {
+    pthread_mutex_unlock(&async->lock);
+    __atomic_fetch_add(&async->rejected, 1, __ATOMIC_RELAXED);
+    free(request);
+    return false;
+  }
+
+  async->queued++;
+  if (async->tail)
+    async->tail->next = request;
+  else
+    async->head = request;
+  async->tail = request;
+  pthread_cond_signal(&async->ready);
+  pthread_mutex_unlock(&async->lock);
+  return true;
+}
+
+// Waits for every queued message to be handled, then releases the client.
+static inline void sketchybar_async_end(struct sketchybar_async *async) {
+  pthread_mutex_lock(&async->lock);
+  async->is_stopping = true;
+  pthread_cond_signal(&async->ready);
+  pthread_mutex_unlock(&async->lock);
+  pthread_join(async->thread, NULL);
+
+  sketchybar_session_end(&async->session);
+  pthread_cond_destroy(&async->space);
+  pthread_cond_destroy(&async->ready);
+  pthread_mutex_destroy(&async->lock);
+  *async = (struct sketchybar_async){0};
+}
+
+// Serves events on the Mach service bootstrap_name, on its shared-memory ring
+// when $SKETCHYBAR_RING is set, or on its Unix socket when $SKETCHYBAR_SOCKET
+// selects the socket transport or there is no Mach.
+static inline void event_server_begin(mach_handler event_handler,
+                                      char *bootstrap_name) {
+  const char *ring = getenv("SKETCHYBAR_RING");
+  if (ring && *ring) {
+    char name[sizeof(g_ring_server.name)];
+    ring_server_path(name, sizeof(name), bootstrap_name);
+    ring_server_begin(&g_ring_server, event_handler, name);
+    return;
+  }
+
+#ifdef __APPLE__
+  const char *socket_path = getenv("SKETCHYBAR_SOCKET");
+  if (!socket_path || !*socket_path) {
+    mach_server_begin(&g_mach_server, event_handler, bootstrap_name);
+    return;
+  }
+#endif
+  char path[sizeof(g_socket_server.path)];
+  socket_server_path(path, sizeof(path), bootstrap_name);
+  socket_server_begin(&g_socket_server, event_handler, path);
+}
+
+// Like event_server_begin, but handlers run concurrently on worker_count
+// workers while events for the same item and event name stay ordered. The
+// ring server still runs its handlers inline.
+static inline void event_server_begin_workers(mach_handler event_handler,
+                                              char *bootstrap_name,
+                                              uint32_t worker_count) {
+#ifdef __APPLE__
+  g_mach_server.worker_count = worker_count;
+#endif
+  g_socket_server.worker_count = worker_count;
+  event_server_begin(event_handler, bootstrap_name);
 }
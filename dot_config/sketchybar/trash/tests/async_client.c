@@ -0,0 +1,101 @@
+// The asynchronous client against the stand-in bar: messages go out in the
+// order they were queued and completions get their replies, and a bar that
+// never answers fills the queue so further sends are rejected within their
+// timeout instead of blocking the caller.
+
+#include "bar.h"
+
+#define MESSAGES 100
+
+static uint32_t g_completions;
+static char g_reply[64];
+
+static void completion(void *context, char *response) {
+  (void)context;
+  snprintf(g_reply, sizeof(g_reply), "%s", response);
+  __atomic_fetch_add(&g_completions, 1, __ATOMIC_RELEASE);
+}
+
+static void check_order(void) {
+  struct sketchybar_async async;
+  CHECK(sketchybar_async_begin(&async, 16));
+  uint32_t before = bar_messages();
+  char message[32];
+  for (int i = 0; i < MESSAGES; i++) {
+    snprintf(message, sizeof(message), "--set cpu label=%d", i);
+    CHECK(sketchybar_async_send(&async, message, NULL, NULL, 1000));
+  }
+  CHECK(sketchybar_async_send(&async, "--query cpu", completion, NULL, 1000));
+  sketchybar_async_end(&async);
+
+  CHECK(g_completions == 1);
+  CHECK(strcmp(g_reply, "{\"label\":\"42%\"}") == 0);
+  CHECK(bar_wait_messages(before + MESSAGES + 1));
+  char expected[32];
+  for (int i = 0; i < MESSAGES; i++) {
+    snprintf(expected, sizeof(expected), "--set cpu label=%d", i);
+    CHECK(strcmp(bar_message(before + i), expected) == 0);
+  }
+  CHECK(strcmp(bar_message(before + MESSAGES), "--query cpu") == 0);
+}
+
+// A listener that never accepts: connects succeed, replies never come.
+static int hung_bar(const char *path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address = {0};
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+  unlink(path);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(fd, 4) < 0)
+    return -1;
+  return fd;
+}
+
+static void check_backpressure(const char *path) {
+  int hung = hung_bar(path);
+  CHECK(hung >= 0);
+  setenv("SKETCHYBAR_SOCKET", path, 1);
+
+  struct sketchybar_async async;
+  CHECK(sketchybar_async_begin(&async, 2));
+  uint32_t before = __atomic_load_n(&g_completions, __ATOMIC_ACQUIRE);
+  // The sender waits on this reply until SKETCHYBAR_REPLY_TIMEOUT_MS.
+  CHECK(sketchybar_async_send(&async, "--query cpu", completion, NULL, 0));
+  CHECK(sketchybar_async_send(&async, "--set cpu label=1", NULL, NULL, 0));
+
+  double start = check_now();
+  CHECK(!sketchybar_async_send(&async, "--set cpu label=2", NULL, NULL, 0));
+  CHECK(!sketchybar_async_send(&async, "--set cpu label=3", NULL, NULL, 20));
+  double elapsed = check_now() - start;
+  CHECK(elapsed >= 0.02 && elapsed < 0.5);
+  CHECK(async.rejected == 2);
+
+  sketchybar_async_end(&async);
+  CHECK(g_completions == before + 1);
+  CHECK(strcmp(g_reply, "") == 0);
+  close(hung);
+  unlink(path);
+}
+
+int main(void) {
+  char path[64];
+  char hung_path[64];
+  snprintf(path, sizeof(path), "/tmp/sketchybar-test-%d.socket",
+           (int)getpid());
+  snprintf(hung_path, sizeof(hung_path), "/tmp/sketchybar-test-%d-hung.socket",
+           (int)getpid());
+  bar_reply("--query cpu", "{\"label\":\"42%\"}");
+  if (!bar_start(path)) {
+    fprintf(stderr, "could not listen on %s\n", path);
+    return 1;
+  }
+  setenv("SKETCHYBAR_SOCKET", path, 1);
+  unsetenv("SKETCHYBAR_RING");
+
+  check_order();
+  check_backpressure(hung_path);
+
+  unlink(path);
+  return check_exit("async_client");
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+// A stand-in bar on a Unix socket. It speaks the frames the socket transport
+// sends, records every message as its tokens joined by spaces and answers
+// requests from a script, with an empty reply when no line matches.
+//   bar_reply("--query bar", "{\"position\":\"top\"}");
+//   bar_start(path);
+//   ... sketchybar_session_send ...
+//   bar_wait_messages(n);    // true once n messages arrived in total
+//   bar_message(i)           // "--set cpu label=42%"
+
+#include "../sketchybar.h"
+#include "check.h"
+
+#define BAR_MAX_REPLIES 16
+#define BAR_MAX_CLIENTS 8
+
+struct bar_reply {
+  const char *prefix;
+  const char *reply;
+};
+
+static char g_bar_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static struct bar_reply g_bar_replies[BAR_MAX_REPLIES];
+static uint32_t g_bar_reply_count;
+// Called on the bar's thread for every message after it was recorded.
+static void (*g_bar_observer)(const char *message);
+
+static pthread_mutex_t g_bar_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **g_bar_messages;
+static uint32_t g_bar_message_count;
+static uint32_t g_bar_message_capacity;
+
+// Messages starting with prefix get reply; the first matching line wins.
+static inline void bar_reply(const char *prefix, const char *reply) {
+  if (g_bar_reply_count < BAR_MAX_REPLIES)
+    g_bar_replies[g_bar_reply_count++] = (struct bar_reply){prefix, reply};
+}
+
+static inline uint32_t bar_messages(void) {
+  pthread_mutex_lock(&g_bar_lock);
+  uint32_t count = g_bar_message_count;
+  pthread_mutex_unlock(&g_bar_lock);
+  return count;
+}
+
+// Recorded strings are never moved or freed, so the pointer stays valid.
+static inline const char *bar_message(uint32_t i) {
+  pthread_mutex_lock(&g_bar_lock);
+  const char *message = i < g_bar_message_count ? g_bar_messages[i] : NULL;
+  pthread_mutex_unlock(&g_bar_lock);
+  return message;
+}
+
+static inline bool bar_wait_messages(uint32_t count) {
+  for (int i = 0; i < 5000; i++) {
+    if (bar_messages() >= count)
+      return true;
+    usleep(1000);
+  }
+  return false;
+}
+
+// payload is NUL terminated at len; an empty token ends the message.
+static inline char *bar_render(const char *payload, uint32_t len) {
+  char *message = (char *)malloc(len + 1);
+  uint32_t end = 0;
+  for (uint32_t i = 0; i < len && payload[i]; i += strlen(payload + i) + 1) {
+    if (end)
+      message[end++] = ' ';
+    size_t length = strlen(payload + i);
+    memcpy(message + end, payload + i, length);
+    end += length;
+  }
+  message[end] = '\0';
+  return message;
+}
+
+static inline const char *bar_record(const char *payload, uint32_t len) {
+  char *message = bar_render(payload, len);
+  pthread_mutex_lock(&g_bar_lock);
+  if (g_bar_message_count == g_bar_message_capacity) {
+    g_bar_message_capacity =
+        g_bar_message_capacity ? g_bar_message_capacity * 2 : 64;
+    g_bar_messages = (char **)realloc(
+        g_bar_messages, g_bar_message_capacity * sizeof(*g_bar_messages));
+  }
+  g_bar_messages[g_bar_message_count++] = message;
+  pthread_mutex_unlock(&g_bar_lock);
+  if (g_bar_observer)
+    g_bar_observer(message);
+  return message;
+}
+
+static inline const char *bar_script(const char *message) {
+  for (uint32_t i = 0; i < g_bar_reply_count; i++) {
+    size_t length = strlen(g_bar_replies[i].prefix);
+    if (strncmp(message, g_bar_replies[i].prefix, length) == 0)
+      return g_bar_replies[i].reply;
+  }
+  return "";
+}
+
+static inline bool bar_receive(int fd, char **buffer, uint32_t *capacity) {
+  struct socket_frame frame;
+  if (!socket_read_all(fd, &frame, sizeof(frame)) ||
+      frame.length > SOCKET_FRAME_MAX)
+    return false;
+  if (frame.length + 1 > *capacity) {
+    *capacity = frame.length + 1;
+    *buffer = (char *)realloc(*buffer, *capacity);
+  }
+  if (!socket_read_all(fd, *buffer, frame.length))
+    return false;
+  (*buffer)[frame.length] = '\0';
+
+  const char *message = bar_record(*buffer, frame.length);
+  if (frame.flags & SOCKET_FRAME_NO_REPLY)
+    return true;
+  const char *reply = bar_script(message);
+  return socket_write_frame(fd, 0, (char *)reply, strlen(reply) + 1);
+}
+
+static void *bar_thread(void *context) {
+  int listener = (int)(intptr_t)context;
+  struct pollfd fds[BAR_MAX_CLIENTS + 1] = {{listener, POLLIN, 0}};
+  uint32_t count = 1;
+  char *buffer = NULL;
+  uint32_t capacity = 0;
+  for (;;) {
+    if (poll(fds, count, -1) <= 0)
+      continue;
+    for (uint32_t i = count; i-- > 1;) {
+      if (fds[i].revents &&
+          (!(fds[i].revents & POLLIN) ||
+           !bar_receive(fds[i].fd, &buffer, &capacity))) {
+        close(fds[i].fd);
+        fds[i] = fds[--count];
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      int client = accept(listener, NULL, NULL);
+      if (client >= 0 && count <= BAR_MAX_CLIENTS)
+        fds[count++] = (struct pollfd){client, POLLIN, 0};
+      else if (client >= 0)
+        close(client);
+    }
+  }
+  return NULL;
+}
+
+// Listens before returning, so the first connect never races the bar.
+static inline bool bar_start(const char *path) {
+  snprintf(g_bar_path, sizeof(g_bar_path), "%s", path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address = {0};
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+  unlink(path);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listener, BAR_MAX_CLIENTS) < 0)
+    return false;
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, bar_thread, (void *)(intptr_t)listener);
+  pthread_detach(thread);
+  return true;
+}
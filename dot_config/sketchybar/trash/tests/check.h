@@ -0,0 +1,57 @@
+#pragma once
+
+// Just enough of a harness for the checks in this directory: CHECK records a
+// failure and keeps going, check_exit reports and sets the exit status.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static int g_check_failures;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__,         \
+              #condition);                                                     \
+      g_check_failures++;                                                      \
+    }                                                                          \
+  } while (0)
+
+static inline int check_exit(const char *name) {
+  if (g_check_failures)
+    fprintf(stderr, "%s: %d checks failed\n", name, g_check_failures);
+  else
+    printf("%s: ok\n", name);
+  return g_check_failures ? 1 : 0;
+}
+
+static inline double check_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Servers started on a thread create their socket file a moment before they
+// listen on it; true once a connection goes through, false after a second.
+static inline bool wait_for_listener(const char *path) {
+  struct sockaddr_un address = {0};
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+  for (int i = 0; i < 1000; i++) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool connected =
+        fd >= 0 &&
+        connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    if (fd >= 0)
+      close(fd);
+    if (connected)
+      return true;
+    usleep(1000);
+  }
+  return false;
+}
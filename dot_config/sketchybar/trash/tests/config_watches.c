@@ -0,0 +1,219 @@
+// --config parsing and the events it produces. Comments, blank lines and CRLF
+// endings are fine; malformed lines, unknown aggregates and a second watch
+// with the same event are reported by line and skipped, and lines past
+// MAX_WATCHES are reported once. Then synthetic batches are replayed against
+// the watched directories and every watch must trigger its own event with
+// its own aggregate.
+
+#include "monitor.h"
+
+static char g_dir[] = "/tmp/trash-test-XXXXXX";
+static char g_config[64];
+static char g_downloads[64];
+static char g_papers[64];
+
+static void write_file(const char *path, const char *text) {
+  FILE *file = fopen(path, "w");
+  if (file) {
+    fputs(text, file);
+    fclose(file);
+  }
+}
+
+static void create(const char *dir, const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  write_file(path, "x");
+}
+
+// Loads the config with logging on; returns what was logged.
+static void load(char *log, size_t size) {
+  FILE *capture = tmpfile();
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  dup2(fileno(capture), STDOUT_FILENO);
+  g_is_foreground = true;
+  g_watch_count = 0;
+  CHECK(load_watches(g_config));
+  g_is_foreground = false;
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  rewind(capture);
+  size_t length = fread(log, 1, size - 1, capture);
+  log[length] = '\0';
+  fclose(capture);
+}
+
+static bool logged(const char *log, int line, const char *text) {
+  char expected[256];
+  snprintf(expected, sizeof(expected), "%s:%d: %s", g_config, line, text);
+  return strstr(log, expected) != NULL;
+}
+
+static void check_parsing(void) {
+  char config[1024];
+  snprintf(config, sizeof(config),
+           "# watches\n"
+           "\n"
+           "downloads_change count * %s\n"
+           "  papers_change newest *.pdf %s\r\n"
+           "broken_change count *\n"
+           "odd_change median * %s\n"
+           "downloads_change bytes * /tmp\n"
+           "home_change bytes .* ~\n"
+           "spaced_change count * %s/with space\n",
+           g_downloads, g_papers, g_downloads, g_dir);
+  write_file(g_config, config);
+
+  char log[4096];
+  load(log, sizeof(log));
+  CHECK(g_watch_count == 4);
+  CHECK(strcmp(g_watches[0].event, "downloads_change") == 0);
+  CHECK(g_watches[0].aggregate == WATCH_COUNT);
+  CHECK(strcmp(g_watches[0].path, g_downloads) == 0);
+  CHECK(strcmp(g_watches[1].event, "papers_change") == 0);
+  CHECK(g_watches[1].aggregate == WATCH_NEWEST);
+  CHECK(strcmp(g_watches[1].filter, "*.pdf") == 0);
+  CHECK(strcmp(g_watches[1].path, g_papers) == 0);
+  CHECK(strcmp(g_watches[2].event, "home_change") == 0);
+  CHECK(g_watches[2].aggregate == WATCH_BYTES);
+  CHECK(strcmp(g_watches[2].path, g_dir) == 0);
+  char spaced[128];
+  snprintf(spaced, sizeof(spaced), "%s/with space", g_dir);
+  CHECK(strcmp(g_watches[3].path, spaced) == 0);
+
+  CHECK(logged(log, 5, "expected <event> <aggregate> <glob> <path>."));
+  CHECK(logged(log, 6, "unknown aggregate 'median'."));
+  CHECK(logged(log, 7, "'downloads_change' is already watched."));
+}
+
+static void check_limit(void) {
+  char config[8192];
+  size_t caret = 0;
+  for (int i = 0; i < MAX_WATCHES + 8; i++)
+    caret += snprintf(config + caret, sizeof(config) - caret,
+                      "watch_%d count * %s\n", i, g_downloads);
+  write_file(g_config, config);
+
+  char log[4096];
+  load(log, sizeof(log));
+  CHECK(g_watch_count == MAX_WATCHES);
+  CHECK(strcmp(g_watches[MAX_WATCHES - 1].event, "watch_31") == 0);
+  CHECK(logged(log, MAX_WATCHES + 1, "only 32 watches are supported."));
+  int reports = 0;
+  for (const char *found = log; (found = strstr(found, "supported")); found++)
+    reports++;
+  CHECK(reports == 1);
+}
+
+// The newest trigger for `event`, or "" when there was none.
+static const char *last_trigger(const char *event) {
+  char prefix[96];
+  snprintf(prefix, sizeof(prefix), "--trigger %s ", event);
+  for (uint32_t i = bar_messages(); i-- > 0;) {
+    const char *message = bar_message(i);
+    if (strncmp(message, prefix, strlen(prefix)) == 0)
+      return message;
+  }
+  return "";
+}
+
+static bool trigger_until(const char *event, const char *expected) {
+  for (double start = check_now(); check_now() - start < 2.0;) {
+    if (strcmp(last_trigger(event), expected) == 0)
+      return true;
+    usleep(1000);
+  }
+  return false;
+}
+
+static char g_paths[4][128];
+
+// On the loop, where sizes measured off it are posted back to.
+static void start_watches(void *context) {
+  (void)context;
+  g_watch_count = 0;
+  load_watches(g_config);
+  refresh_trash_roots();
+  update_sketchybar();
+}
+
+static void replay(void *context) {
+  (void)context;
+  struct watcher_event events[] = {{g_paths[0], WATCHER_CREATED},
+                                   {g_paths[1], WATCHER_CREATED},
+                                   {g_paths[2], WATCHER_CREATED},
+                                   {g_paths[3], WATCHER_CREATED}};
+  trash_events(NULL, events, 4);
+}
+
+static void check_events(void) {
+  char config[512];
+  snprintf(config, sizeof(config),
+           "downloads_change count * %s\n"
+           "papers_change newest *.pdf %s\n"
+           "paper_bytes_change bytes *.pdf %s\n",
+           g_downloads, g_papers, g_papers);
+  write_file(g_config, config);
+  watcher_post(&g_watcher, start_watches, NULL);
+  CHECK(trigger_until("downloads_change",
+                      "--trigger downloads_change COUNT=0"));
+  CHECK(trigger_until("papers_change",
+                      "--trigger papers_change COUNT=0 NEWEST="));
+  CHECK(trigger_until("paper_bytes_change",
+                      "--trigger paper_bytes_change COUNT=0 SIZE=0"));
+
+  create(g_downloads, "setup.dmg");
+  create(g_downloads, "notes.txt");
+  create(g_papers, "draft.txt");
+  create(g_papers, "paper.pdf");
+  snprintf(g_paths[0], sizeof(g_paths[0]), "%s/setup.dmg", g_downloads);
+  snprintf(g_paths[1], sizeof(g_paths[1]), "%s/notes.txt", g_downloads);
+  snprintf(g_paths[2], sizeof(g_paths[2]), "%s/draft.txt", g_papers);
+  snprintf(g_paths[3], sizeof(g_paths[3]), "%s/paper.pdf", g_papers);
+  watcher_post(&g_watcher, replay, NULL);
+
+  CHECK(trigger_until("downloads_change",
+                      "--trigger downloads_change COUNT=2"));
+  CHECK(trigger_until("papers_change",
+                      "--trigger papers_change COUNT=1 NEWEST=paper.pdf"));
+  struct stat st;
+  stat(g_paths[3], &st);
+  char bytes[96];
+  snprintf(bytes, sizeof(bytes),
+           "--trigger paper_bytes_change COUNT=1 SIZE=%lld",
+           (long long)st.st_blocks * 512);
+  CHECK(trigger_until("paper_bytes_change", bytes));
+}
+
+static void *watch_thread(void *context) {
+  (void)context;
+  watcher_run(&g_watcher);
+  return NULL;
+}
+
+int main(void) {
+  if (!mkdtemp(g_dir))
+    return 1;
+  snprintf(g_config, sizeof(g_config), "%s/watches.conf", g_dir);
+  snprintf(g_downloads, sizeof(g_downloads), "%s/Downloads", g_dir);
+  snprintf(g_papers, sizeof(g_papers), "%s/Papers", g_dir);
+  mkdir(g_downloads, 0700);
+  mkdir(g_papers, 0700);
+  bar_begin(g_dir);
+
+  check_parsing();
+  check_limit();
+
+  // Sizes are measured off the loop and posted back to it.
+  if (!watcher_begin(&g_watcher, trash_events, NULL, NULL, WATCH_LATENCY))
+    return 1;
+  pthread_t thread;
+  pthread_create(&thread, NULL, watch_thread, NULL);
+  check_events();
+
+  remove_tree(g_dir);
+  return check_exit("config_watches");
+}
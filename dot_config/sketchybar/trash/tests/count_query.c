@@ -0,0 +1,120 @@
+// '--count' with and without a daemon: a running daemon answers from its
+// snapshot, one that has no snapshot yet and a missing one leave the count to
+// a scan of the trash. The query socket is only open to its owner; run as
+// root, a client running as another user gets no answer even when the socket
+// file's mode would let it connect.
+
+#include "monitor.h"
+
+static char g_dir[] = "/tmp/trash-test-XXXXXX";
+static char g_socket[64];
+
+// What 'trash_monitor --count' prints.
+static void run_count(char *out, size_t size) {
+  FILE *capture = tmpfile();
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  dup2(fileno(capture), STDOUT_FILENO);
+  char *argv[] = {(char *)"trash_monitor", (char *)"--count", NULL};
+  trash_monitor_main(2, argv);
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  rewind(capture);
+  if (!fgets(out, (int)size, capture))
+    out[0] = '\0';
+  fclose(capture);
+}
+
+static void create(const char *trash, const char *name) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", trash, name);
+  int fd = open(path, O_WRONLY | O_CREAT, 0600);
+  if (fd >= 0)
+    close(fd);
+}
+
+static void check_without_daemon(void) {
+  char out[32];
+  run_count(out, sizeof(out));
+  CHECK(strcmp(out, "3") == 0);
+}
+
+static void check_daemon(void) {
+  CHECK(start_query_server());
+  struct stat st;
+  CHECK(stat(g_socket, &st) == 0 && (st.st_mode & 0777) == 0600);
+
+  // Still starting up: no snapshot, so the trash is scanned.
+  char out[32];
+  run_count(out, sizeof(out));
+  CHECK(strcmp(out, "3") == 0);
+
+  __atomic_store_n(&g_snapshot_count, 42, __ATOMIC_RELEASE);
+  __atomic_store_n(&g_snapshot_size, 8192, __ATOMIC_RELEASE);
+  run_count(out, sizeof(out));
+  CHECK(strcmp(out, "42") == 0);
+  CHECK(query_daemon("size", out, sizeof(out)) && strcmp(out, "8192") == 0);
+}
+
+// Whether a client running as nobody gets an answer. It does not check who
+// it talks to, the way query_daemon would.
+static bool stranger_answered(void) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (setgid(65534) != 0 || setuid(65534) != 0)
+      _exit(2);
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", g_socket);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    char reply[32];
+    bool answered =
+        connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+        send(fd, "count", 5, 0) == 5 && recv(fd, reply, sizeof(reply), 0) > 0;
+    _exit(answered ? 1 : 0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 1;
+}
+
+static void check_other_user(void) {
+  if (geteuid() != 0)
+    return;
+  CHECK(!stranger_answered());
+  chmod(g_socket, 0666);
+  CHECK(!stranger_answered());
+}
+
+int main(void) {
+  if (!mkdtemp(g_dir))
+    return 1;
+  // Next to the real one, where another user can reach it.
+  snprintf(g_socket, sizeof(g_socket), "/tmp/trash-test-%d.socket",
+           (int)getpid());
+  QUERY_SOCKET = g_socket;
+  setenv("HOME", g_dir, 1);
+  unsetenv("XDG_DATA_HOME");
+
+  char trash[128];
+  snprintf(trash, sizeof(trash), "%s/.local", g_dir);
+  mkdir(trash, 0700);
+  snprintf(trash, sizeof(trash), "%s/.local/share", g_dir);
+  mkdir(trash, 0700);
+  snprintf(trash, sizeof(trash), "%s/.local/share/Trash", g_dir);
+  mkdir(trash, 0700);
+  snprintf(trash, sizeof(trash), "%s/.local/share/Trash/files", g_dir);
+  mkdir(trash, 0700);
+  create(trash, "a");
+  create(trash, "b");
+  create(trash, "c");
+
+  check_without_daemon();
+  check_daemon();
+  check_other_user();
+
+  unlink(g_socket);
+  remove_tree(g_dir);
+  return check_exit("count_query");
+}
@@ -0,0 +1,144 @@
+// The client-side diff cache: what sketchybar_diff_filter lets through for
+// repeated, changed, coalesced and invalidated --set assignments. With
+// --bench, an update storm where most values repeat: filter cost per message
+// and how many messages never reach the bar.
+
+#include "../sketchybar.h"
+#include "check.h"
+
+// Filters `command` and renders what is left with spaces between tokens, or
+// "" when the whole message was dropped.
+static const char *filter(struct sketchybar_diff_cache *cache,
+                          uint32_t generation, const char *command) {
+  static char message[1024];
+  static char rendered[1024];
+  uint32_t length = sketchybar_tokenize(command, message);
+  message[length++] = '\0';
+
+  char *out = sketchybar_diff_filter(cache, generation, message, &length);
+  uint32_t caret = 0;
+  for (uint32_t i = 0; i + 1 < length; i += strlen(&out[i]) + 1)
+    caret += snprintf(&rendered[caret], sizeof(rendered) - caret, "%s%s",
+                      caret ? " " : "", &out[i]);
+  rendered[caret] = '\0';
+  return rendered;
+}
+
+#define FILTERS_TO(cache, generation, command, expected)                       \
+  CHECK(strcmp(filter(cache, generation, command), expected) == 0)
+
+static void check_repeats(void) {
+  struct sketchybar_diff_cache cache = {0};
+  FILTERS_TO(&cache, 0, "--set cpu label=5% icon=x",
+             "--set cpu label=5% icon=x");
+  FILTERS_TO(&cache, 0, "--set cpu label=5% icon=x", "");
+  CHECK(cache.hits == 2 && cache.misses == 2);
+
+  FILTERS_TO(&cache, 0, "--set cpu label=6% icon=x", "--set cpu label=6%");
+  // Same property, another item.
+  FILTERS_TO(&cache, 0, "--set ram label=6%", "--set ram label=6%");
+  FILTERS_TO(&cache, 0, "--set cpu label=6% --set ram label=7%",
+             "--set ram label=7%");
+  sketchybar_diff_free(&cache);
+}
+
+static void check_coalesced(void) {
+  struct sketchybar_diff_cache cache = {0};
+  FILTERS_TO(&cache, 0, "--set cpu label=1 label=2 label=3",
+             "--set cpu label=3");
+  CHECK(cache.coalesced == 2);
+  // Across --set groups of one message too; the emptied group goes away.
+  FILTERS_TO(&cache, 0, "--set cpu label=1 --set cpu label=4",
+             "--set cpu label=4");
+  sketchybar_diff_free(&cache);
+}
+
+static void check_passthrough(void) {
+  struct sketchybar_diff_cache cache = {0};
+  FILTERS_TO(&cache, 0, "--trigger trash_change TRASH_COUNT=1",
+             "--trigger trash_change TRASH_COUNT=1");
+  FILTERS_TO(&cache, 0, "--trigger trash_change TRASH_COUNT=1",
+             "--trigger trash_change TRASH_COUNT=1");
+  FILTERS_TO(&cache, 0, "--set /space.*/ icon.color=0xff000000",
+             "--set /space.*/ icon.color=0xff000000");
+  FILTERS_TO(&cache, 0, "--set /space.*/ icon.color=0xff000000",
+             "--set /space.*/ icon.color=0xff000000");
+
+  // A bare flag keeps its --set; an unchanged --set next to other commands
+  // drops out on its own.
+  FILTERS_TO(&cache, 0, "--set cpu label=1", "--set cpu label=1");
+  FILTERS_TO(&cache, 0, "--set cpu label=1 drawing", "--set cpu drawing");
+  FILTERS_TO(&cache, 0, "--set cpu label=1 --update", "--update");
+  sketchybar_diff_free(&cache);
+}
+
+// Recreating an item or reconnecting to the bar resets what it knows.
+static void check_invalidation(void) {
+  struct sketchybar_diff_cache cache = {0};
+  FILTERS_TO(&cache, 0, "--set cpu label=1 --set ram label=1",
+             "--set cpu label=1 --set ram label=1");
+  FILTERS_TO(&cache, 0, "--remove cpu", "--remove cpu");
+  FILTERS_TO(&cache, 0, "--set cpu label=1 --set ram label=1",
+             "--set cpu label=1");
+  FILTERS_TO(&cache, 0, "--add item cpu right --set cpu label=1",
+             "--add item cpu right --set cpu label=1");
+  FILTERS_TO(&cache, 1, "--set cpu label=1 --set ram label=1",
+             "--set cpu label=1 --set ram label=1");
+  sketchybar_diff_free(&cache);
+}
+
+// Many items, so the table grows and keeps its entries.
+static void check_growth(void) {
+  struct sketchybar_diff_cache cache = {0};
+  char command[64];
+  for (int i = 0; i < 5000; i++) {
+    snprintf(command, sizeof(command), "--set item%d label=%d", i, i);
+    CHECK(strcmp(filter(&cache, 0, command), command) == 0);
+  }
+  for (int i = 0; i < 5000; i++) {
+    snprintf(command, sizeof(command), "--set item%d label=%d", i, i);
+    FILTERS_TO(&cache, 0, command, "");
+  }
+  sketchybar_diff_free(&cache);
+}
+
+// 50 items whose label leaves its usual value one update in ten.
+static void bench(void) {
+  struct sketchybar_diff_cache cache = {0};
+  char command[128];
+  char message[128];
+  const int rounds = 1000000;
+  int sent = 0;
+  srand(10);
+  double start = check_now();
+  for (int i = 0; i < rounds; i++) {
+    int item = rand() % 50;
+    int value = rand() % 10 ? item : i;
+    snprintf(command, sizeof(command), "--set item%d label=%d icon=x", item,
+             value);
+    uint32_t length = sketchybar_tokenize(command, message);
+    message[length++] = '\0';
+    sketchybar_diff_filter(&cache, 0, message, &length);
+    sent += length != 0;
+  }
+  double elapsed = check_now() - start;
+  printf("%d messages, %d sent (%.1f%%), %.1f ns/message\n", rounds, sent,
+         sent * 100.0 / rounds, elapsed * 1e9 / rounds);
+  printf("hits %llu misses %llu coalesced %llu\n",
+         (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+         (unsigned long long)cache.coalesced);
+  sketchybar_diff_free(&cache);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    bench();
+    return 0;
+  }
+  check_repeats();
+  check_coalesced();
+  check_passthrough();
+  check_invalidation();
+  check_growth();
+  return check_exit("diff_filter");
+}
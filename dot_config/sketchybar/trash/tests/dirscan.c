@@ -0,0 +1,153 @@
+// dirscan against plain readdir: the same names, ".", ".." and ".DS_Store"
+// left out, for empty, small and large directories and names of every
+// length. With --bench, recount times for 10k, 100k and 1M entries (the
+// largest size can be given: --bench 100000).
+
+#include "../dirscan.h"
+#include "check.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+struct names {
+  char **names;
+  size_t count;
+};
+
+static void collect(void *context, const char *name, size_t length) {
+  struct names *names = context;
+  names->names = realloc(names->names, (names->count + 1) * sizeof(char *));
+  names->names[names->count++] = strndup(name, length);
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void free_names(struct names *names) {
+  for (size_t i = 0; i < names->count; i++)
+    free(names->names[i]);
+  free(names->names);
+  *names = (struct names){0};
+}
+
+static void fill(const char *dir, size_t count, size_t from) {
+  char path[1024];
+  for (size_t i = from; i < count; i++) {
+    snprintf(path, sizeof(path), "%s/entry-%zu", dir, i);
+    int fd = open(path, O_WRONLY | O_CREAT, 0600);
+    if (fd >= 0)
+      close(fd);
+  }
+}
+
+// Both scans must report exactly the same names.
+static void check_directory(const char *dir, size_t expected) {
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  CHECK(fd >= 0);
+  struct names bulk = {0}, plain = {0};
+  CHECK(dirscan(fd, collect, &bulk) == expected);
+  CHECK(bulk.count == expected);
+  lseek(fd, 0, SEEK_SET);
+  CHECK(dirscan_readdir(fd, collect, &plain) == expected);
+  lseek(fd, 0, SEEK_SET);
+  CHECK(dirscan(fd, NULL, NULL) == expected);
+  close(fd);
+
+  qsort(bulk.names, bulk.count, sizeof(char *), compare_names);
+  qsort(plain.names, plain.count, sizeof(char *), compare_names);
+  bool same = bulk.count == plain.count;
+  for (size_t i = 0; same && i < bulk.count; i++)
+    same = strcmp(bulk.names[i], plain.names[i]) == 0;
+  CHECK(same);
+  free_names(&bulk);
+  free_names(&plain);
+}
+
+static void check_filter(void) {
+  CHECK(!dirscan_is_counted(".", 1));
+  CHECK(!dirscan_is_counted("..", 2));
+  CHECK(!dirscan_is_counted(".DS_Store", 9));
+  CHECK(dirscan_is_counted(".a", 2));
+  CHECK(dirscan_is_counted("...", 3));
+  CHECK(dirscan_is_counted(".DS_Storf", 9));
+  CHECK(dirscan_is_counted(".DS_Store2", 10));
+}
+
+static void check_scans(const char *dir) {
+  check_directory(dir, 0);
+
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/.DS_Store", dir);
+  close(open(path, O_WRONLY | O_CREAT, 0600));
+  snprintf(path, sizeof(path), "%s/.hidden", dir);
+  close(open(path, O_WRONLY | O_CREAT, 0600));
+  snprintf(path, sizeof(path), "%s/folder", dir);
+  mkdir(path, 0700);
+  check_directory(dir, 2);
+
+  // Every name length, so records of every size and alignment show up.
+  char name[256];
+  for (size_t length = 1; length <= 255; length++) {
+    memset(name, 'n', length);
+    name[length] = '\0';
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    close(open(path, O_WRONLY | O_CREAT, 0600));
+  }
+  check_directory(dir, 2 + 255);
+
+  // More than fits in one bulk buffer.
+  fill(dir, 20000, 0);
+  check_directory(dir, 2 + 255 + 20000);
+}
+
+static double time_scan(const char *dir, bool bulk) {
+  double best = 0;
+  for (int round = 0; round < 5; round++) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    double start = check_now();
+    size_t count =
+        bulk ? dirscan(fd, NULL, NULL) : dirscan_readdir(fd, NULL, NULL);
+    double elapsed = check_now() - start;
+    close(fd);
+    if (!count)
+      return -1;
+    if (!round || elapsed < best)
+      best = elapsed;
+  }
+  return best;
+}
+
+static void bench(const char *dir, size_t largest) {
+  size_t created = 0;
+  for (size_t count = 10000; count <= largest; count *= 10) {
+    fill(dir, count, created);
+    created = count;
+    printf("%8zu entries  dirscan %8.2f ms  readdir %8.2f ms\n", count,
+           time_scan(dir, true) * 1e3, time_scan(dir, false) * 1e3);
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *tmp = getenv("TMPDIR");
+  char dir[256];
+  snprintf(dir, sizeof(dir), "%s/dirscan-test-XXXXXX",
+           tmp && *tmp ? tmp : "/tmp");
+  if (!mkdtemp(dir))
+    return 1;
+
+  bool benchmark = argc > 1 && strcmp(argv[1], "--bench") == 0;
+  if (benchmark) {
+    bench(dir, argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000);
+  } else {
+    check_filter();
+    check_scans(dir);
+  }
+
+  char command[300];
+  snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+  if (system(command) != 0)
+    fprintf(stderr, "could not remove %s\n", dir);
+  return benchmark ? 0 : check_exit("dirscan");
+}
@@ -0,0 +1,223 @@
+// Replays synthetic watcher batches against a trash root in a temp directory:
+// after every batch the entry set must match what is on disk and the bar must
+// have the count, or nothing new when the count did not change. With --bench,
+// the cost of applying a batch of creates and removes against a large set.
+
+#include "monitor.h"
+
+static char g_dir[] = "/tmp/trash-test-XXXXXX";
+static char g_trash[64];
+static struct trash_root *g_root;
+
+static char g_paths[10000][96];
+
+static const char *path_of(int slot, const char *name) {
+  snprintf(g_paths[slot], sizeof(g_paths[slot]), "%s/%s", g_trash, name);
+  return g_paths[slot];
+}
+
+static void create(const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", g_trash, name);
+  int fd = open(path, O_WRONLY | O_CREAT, 0600);
+  if (fd >= 0)
+    close(fd);
+}
+
+static void delete(const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", g_trash, name);
+  unlink(path);
+}
+
+static bool matches_disk(void) {
+  return (int)g_root->entries.count == count_entries(g_trash);
+}
+
+// Replays one batch; `changed` says whether the count should reach the bar.
+static void replay(const struct watcher_event *events, size_t count,
+                   bool changed) {
+  trash_events(NULL, events, count);
+  CHECK(matches_disk());
+  if (changed) {
+    CHECK(bar_wait(1));
+    CHECK(g_bar_count == (int)g_root->entries.count);
+  } else {
+    CHECK(bar_quiet(20));
+  }
+}
+
+static void check_creates(void) {
+  create("a");
+  create("b");
+  create("c");
+  struct watcher_event events[] = {{path_of(0, "a"), WATCHER_CREATED},
+                                   {path_of(1, "b"), WATCHER_CREATED},
+                                   {path_of(2, "c"), WATCHER_CREATED}};
+  replay(events, 3, true);
+  CHECK(g_root->entries.count == 3);
+}
+
+// FSEvents may fold a create and a remove into one event; disk decides.
+static void check_coalesced(void) {
+  create("gone");
+  delete("gone");
+  delete("b");
+  create("b");
+  struct watcher_event events[] = {
+      {path_of(0, "gone"), WATCHER_CREATED | WATCHER_REMOVED},
+      {path_of(1, "b"), WATCHER_CREATED | WATCHER_REMOVED}};
+  replay(events, 2, false);
+  CHECK(entry_set_find(&g_root->entries, "gone") == NULL);
+  CHECK(entry_set_find(&g_root->entries, "b") != NULL);
+}
+
+static void check_rename(void) {
+  char from[128], to[128];
+  snprintf(from, sizeof(from), "%s/a", g_trash);
+  snprintf(to, sizeof(to), "%s/d", g_trash);
+  rename(from, to);
+  struct watcher_event events[] = {{path_of(0, "a"), WATCHER_RENAMED},
+                                   {path_of(1, "d"), WATCHER_RENAMED}};
+  replay(events, 2, false);
+  CHECK(entry_set_find(&g_root->entries, "a") == NULL);
+  CHECK(entry_set_find(&g_root->entries, "d") != NULL);
+}
+
+// Changes inside an entry only invalidate its size; .DS_Store and paths
+// outside the root are not counted.
+static void check_ignored(void) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/folder", g_trash);
+  mkdir(path, 0700);
+  struct watcher_event created[] = {{path_of(0, "folder"), WATCHER_CREATED}};
+  replay(created, 1, true);
+
+  struct trash_entry **folder = entry_set_find(&g_root->entries, "folder");
+  CHECK(folder != NULL);
+  if (folder)
+    (*folder)->size = 100;
+  create(".DS_Store");
+  create("folder/inner");
+  struct watcher_event events[] = {
+      {path_of(0, "folder/inner"), WATCHER_CREATED},
+      {path_of(1, ".DS_Store"), WATCHER_CREATED},
+      {g_dir, WATCHER_MODIFIED},
+  };
+  replay(events, 3, false);
+  if (folder)
+    CHECK((*folder)->size == -1);
+}
+
+// Lost events: whatever changed without an event is picked up by the rescan.
+static void check_rescan(void) {
+  create("x");
+  create("y");
+  delete("c");
+  struct watcher_event events[] = {{"", WATCHER_RESCAN}};
+  replay(events, 1, true);
+  CHECK(entry_set_find(&g_root->entries, "c") == NULL);
+  CHECK(entry_set_find(&g_root->entries, "x") != NULL);
+}
+
+// The root itself goes away and comes back.
+static void check_root_changed(void) {
+  remove_tree(g_trash);
+  struct watcher_event events[] = {{g_trash, WATCHER_ROOT_CHANGED}};
+  replay(events, 1, true);
+  CHECK(g_root->entries.count == 0);
+
+  mkdir(g_trash, 0700);
+  create("back");
+  replay(events, 1, true);
+  CHECK(g_root->entries.count == 1);
+}
+
+static void check_burst(void) {
+  static struct watcher_event events[10000];
+  char name[32];
+  for (int i = 0; i < 10000; i++) {
+    snprintf(name, sizeof(name), "file-%d", i);
+    create(name);
+    events[i] = (struct watcher_event){path_of(i, name), WATCHER_CREATED};
+  }
+  replay(events, 10000, true);
+
+  for (int i = 0; i < 10000; i += 2) {
+    snprintf(name, sizeof(name), "file-%d", i);
+    delete(name);
+    events[i].flags = WATCHER_REMOVED;
+  }
+  replay(events, 10000, true);
+}
+
+// Per batch, applying the events against rescanning the whole root.
+static void bench(void) {
+  static struct watcher_event events[100];
+  char name[32];
+  for (int i = 0; i < 10000; i++) {
+    snprintf(name, sizeof(name), "file-%d", i);
+    create(name);
+  }
+  rescan_root(g_root);
+  uint32_t initial = g_root->entries.count;
+
+  const int rounds = 200;
+  double apply = 0, rescan = 0;
+  for (int round = 0; round < rounds; round++) {
+    for (int i = 0; i < 100; i++) {
+      snprintf(name, sizeof(name), "new-%d-%d", round, i);
+      create(name);
+      events[i] = (struct watcher_event){path_of(i, name), WATCHER_CREATED};
+    }
+    double start = check_now();
+    for (int i = 0; i < 100; i++) {
+      char entry[64];
+      bool nested;
+      if (top_level_name(g_root, events[i].path, entry, sizeof(entry),
+                         &nested))
+        apply_trash_event(g_root, events[i].path, entry, nested,
+                          events[i].flags);
+    }
+    apply += check_now() - start;
+
+    start = check_now();
+    rescan_root(g_root);
+    rescan += check_now() - start;
+  }
+  printf("%u to %u entries, 100 creates per batch\n", initial,
+         g_root->entries.count);
+  printf("apply   %9.1f us/batch\n", apply * 1e6 / rounds);
+  printf("rescan  %9.1f us/batch\n", rescan * 1e6 / rounds);
+}
+
+int main(int argc, char **argv) {
+  if (!mkdtemp(g_dir))
+    return 1;
+  snprintf(g_trash, sizeof(g_trash), "%s/Trash", g_dir);
+  mkdir(g_trash, 0700);
+  bar_begin(g_dir);
+
+  g_root = add_trash_root(g_roots, &g_root_count, g_trash, "Home");
+  g_root->path_len = strlen(g_root->path);
+  // Every update goes out at once; the rate limit has its own checks.
+  g_rate_limit.interval_ns = 0;
+  watcher_begin(&g_watcher, trash_events, NULL, NULL, WATCH_LATENCY);
+  watch_trash_roots();
+
+  bool benchmark = argc > 1 && strcmp(argv[1], "--bench") == 0;
+  if (benchmark) {
+    bench();
+  } else {
+    check_creates();
+    check_coalesced();
+    check_rename();
+    check_ignored();
+    check_rescan();
+    check_root_changed();
+    check_burst();
+  }
+
+  remove_tree(g_dir);
+  return benchmark ? 0 : check_exit("entry_replay");
+}
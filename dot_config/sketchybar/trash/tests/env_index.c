@@ -0,0 +1,111 @@
+// The env index against the linear scan it replaces. With --bench, lookup
+// cost per key for events of 10 to 500 keys.
+
+#include "../sketchybar.h"
+#include "check.h"
+
+static uint32_t make_blob(char *blob, uint32_t size, int keys) {
+  uint32_t caret = 0;
+  for (int i = 0; i < keys; i++) {
+    caret += snprintf(blob + caret, size - caret, "KEY_%d", i) + 1;
+    caret += snprintf(blob + caret, size - caret, "value %d", i) + 1;
+  }
+  blob[caret++] = '\0';
+  return caret;
+}
+
+static void check_lookups(int keys) {
+  static char blob[64 * 1024];
+  uint32_t size = make_blob(blob, sizeof(blob), keys);
+  struct env_index index = {0};
+  CHECK(env_index_build(&index, blob, size));
+  CHECK(index.count == (uint32_t)keys);
+
+  for (int i = 0; i < keys; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "KEY_%d", i);
+    t_env_index = NULL;
+    char *linear = env_get_value_for_key(blob, key);
+    t_env_index = &index;
+    char *indexed = env_get_value_for_key(blob, key);
+    CHECK(indexed == linear);
+  }
+
+  t_env_index = &index;
+  CHECK(env_index_get(&index, (char *)"KEY_") == NULL);
+  CHECK(strcmp(env_get_value_for_key(blob, (char *)"MISSING"), "") == 0);
+  t_env_index = NULL;
+  free(index.slots);
+}
+
+static void check_duplicates(void) {
+  char blob[] = "NAME\0first\0SENDER\0s\0NAME\0second\0";
+  struct env_index index = {0};
+  CHECK(env_index_build(&index, blob, sizeof(blob)));
+  CHECK(index.count == 2);
+  CHECK(strcmp(env_index_get(&index, (char *)"NAME"), "first") == 0);
+  free(index.slots);
+}
+
+// A blob cut off in the middle of a pair must not be read past its size.
+static void check_truncated(void) {
+  char blob[] = "NAME\0value\0INFO\0unterminated";
+  struct env_index index = {0};
+  CHECK(env_index_build(&index, blob, sizeof(blob) - 1));
+  CHECK(strcmp(env_index_get(&index, (char *)"NAME"), "value") == 0);
+  CHECK(env_index_get(&index, (char *)"INFO") == NULL);
+  free(index.slots);
+}
+
+static void bench(void) {
+  static char blob[64 * 1024];
+  const int sizes[] = {10, 50, 100, 500};
+  printf("%6s %12s %12s\n", "keys", "linear ns", "indexed ns");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    int keys = sizes[s];
+    uint32_t size = make_blob(blob, sizeof(blob), keys);
+    const int rounds = 2000000 / keys;
+    char key[32];
+    volatile char sink = 0;
+
+    t_env_index = NULL;
+    double start = check_now();
+    for (int r = 0; r < rounds; r++) {
+      snprintf(key, sizeof(key), "KEY_%d", r % keys);
+      sink ^= *env_get_value_for_key(blob, key);
+    }
+    double linear = check_now() - start;
+
+    // Every event builds its index once, so that is part of the cost.
+    struct env_index index = {0};
+    start = check_now();
+    for (int r = 0; r < rounds; r++) {
+      if (r % keys == 0) {
+        env_index_build(&index, blob, size);
+        t_env_index = &index;
+      }
+      snprintf(key, sizeof(key), "KEY_%d", r % keys);
+      sink ^= *env_get_value_for_key(blob, key);
+    }
+    double indexed = check_now() - start;
+    t_env_index = NULL;
+    free(index.slots);
+
+    printf("%6d %12.1f %12.1f\n", keys, linear * 1e9 / rounds,
+           indexed * 1e9 / rounds);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    bench();
+    return 0;
+  }
+
+  check_lookups(1);
+  check_lookups(10);
+  check_lookups(500);
+  check_duplicates();
+  check_truncated();
+  return check_exit("env_index");
+}
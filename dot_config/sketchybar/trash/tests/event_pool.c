@@ -0,0 +1,193 @@
+// The event servers' worker pool: a flood from several senders over the
+// socket server keeps every key in order and runs handlers concurrently, and
+// the pool never queues more than its limit. With --bench, events/s with a
+// 20 us handler run inline vs. on four workers.
+
+#include "../sketchybar.h"
+#include "check.h"
+
+#define SENDERS 4
+#define KEYS_PER_SENDER 4
+#define EVENTS_PER_SENDER 5000
+#define HANDLER_US 20
+
+static int g_last[SENDERS * KEYS_PER_SENDER];
+static uint64_t g_disorder;
+static uint32_t g_running;
+static uint32_t g_running_max;
+
+static MACH_HANDLER(flood_handler) {
+  uint32_t running = __atomic_add_fetch(&g_running, 1, __ATOMIC_RELAXED);
+  uint32_t max = __atomic_load_n(&g_running_max, __ATOMIC_RELAXED);
+  while (running > max &&
+         !__atomic_compare_exchange_n(&g_running_max, &max, running, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+
+  const char *name = env_get_value_for_key(env, (char *)"NAME");
+  int key = strncmp(name, "item", 4) == 0 ? atoi(name + 4) : 0;
+  int sequence = atoi(env_get_value_for_key(env, (char *)"SEQUENCE"));
+  // Same key, same worker: nobody else touches g_last[key] concurrently.
+  if (sequence != g_last[key] + 1)
+    __atomic_fetch_add(&g_disorder, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&g_last[key], sequence, __ATOMIC_RELAXED);
+
+  usleep(HANDLER_US);
+  __atomic_fetch_sub(&g_running, 1, __ATOMIC_RELAXED);
+}
+
+struct server_start {
+  struct socket_server *server;
+  const char *path;
+};
+
+static void *server_thread(void *context) {
+  struct server_start *start = (struct server_start *)context;
+  socket_server_begin(start->server, flood_handler, start->path);
+  return NULL;
+}
+
+static void start_server(struct socket_server *server, const char *path,
+                         uint32_t worker_count) {
+  static struct server_start starts[2];
+  static int count = 0;
+  server->worker_count = worker_count;
+  starts[count] = (struct server_start){server, path};
+  pthread_t thread;
+  pthread_create(&thread, NULL, server_thread, &starts[count++]);
+  pthread_detach(thread);
+  wait_for_listener(path);
+}
+
+struct sender {
+  const char *path;
+  int index;
+};
+
+static void *send_flood(void *context) {
+  struct sender *sender = (struct sender *)context;
+  int fd = socket_connect(sender->path);
+  if (fd < 0)
+    return NULL;
+  char message[96];
+  for (int i = 0; i < EVENTS_PER_SENDER; i++) {
+    int key = sender->index * KEYS_PER_SENDER + i % KEYS_PER_SENDER;
+    int len = snprintf(message, sizeof(message),
+                       "NAME%citem%d%cSENDER%cflood%cSEQUENCE%c%d%c", 0, key,
+                       0, 0, 0, 0, i / KEYS_PER_SENDER + 1, 0);
+    socket_write_frame(fd, SOCKET_FRAME_NO_REPLY, message, len + 1);
+  }
+  close(fd);
+  return NULL;
+}
+
+static double flood(struct socket_server *server, const char *path) {
+  memset(g_last, 0, sizeof(g_last));
+  uint64_t before = __atomic_load_n(&server->stats.handled, __ATOMIC_RELAXED);
+  uint64_t total = SENDERS * EVENTS_PER_SENDER;
+
+  double start = check_now();
+  pthread_t threads[SENDERS];
+  struct sender senders[SENDERS];
+  for (int i = 0; i < SENDERS; i++) {
+    senders[i] = (struct sender){path, i};
+    pthread_create(&threads[i], NULL, send_flood, &senders[i]);
+  }
+  for (int i = 0; i < SENDERS; i++)
+    pthread_join(threads[i], NULL);
+  while (__atomic_load_n(&server->stats.handled, __ATOMIC_RELAXED) <
+             before + total &&
+         check_now() - start < 30.0)
+    usleep(1000);
+  return check_now() - start;
+}
+
+static void check_flood(struct socket_server *server, const char *path) {
+  flood(server, path);
+  struct mach_server_stats stats;
+  mach_server_copy_stats(&server->stats, &stats);
+  CHECK(stats.received == SENDERS * EVENTS_PER_SENDER);
+  CHECK(stats.handled == stats.received);
+  CHECK(stats.queue_depth == 0);
+  CHECK(__atomic_load_n(&g_disorder, __ATOMIC_RELAXED) == 0);
+  for (int key = 0; key < SENDERS * KEYS_PER_SENDER; key++)
+    CHECK(__atomic_load_n(&g_last[key], __ATOMIC_RELAXED) ==
+          EVENTS_PER_SENDER / KEYS_PER_SENDER);
+  CHECK(g_running_max > 1);
+  // The receive thread holds at most one event while it waits for space.
+  CHECK(stats.queue_depth_max <= EVENT_POOL_MAX_QUEUED + 1);
+}
+
+static bool g_gate_open;
+static uint32_t g_gated;
+
+static MACH_HANDLER(gated_handler) {
+  (void)env;
+  while (!__atomic_load_n(&g_gate_open, __ATOMIC_ACQUIRE))
+    usleep(100);
+  __atomic_fetch_add(&g_gated, 1, __ATOMIC_RELAXED);
+}
+
+static struct event_pool g_pool;
+static uint32_t g_submitted;
+
+static void *submit_jobs(void *context) {
+  (void)context;
+  char blob[] = "NAME\0item\0\0";
+  for (int i = 0; i < 20; i++) {
+    event_pool_submit(&g_pool, event_job_copy(blob, sizeof(blob)));
+    __atomic_fetch_add(&g_submitted, 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+// With every worker stuck in its handler the submitter stops at the limit and
+// resumes as soon as the handlers return.
+static void check_limit(void) {
+  struct mach_server_stats stats = {0};
+  CHECK(event_pool_begin(&g_pool, gated_handler, &stats, 2, 8));
+  pthread_t thread;
+  pthread_create(&thread, NULL, submit_jobs, NULL);
+  usleep(50000);
+  CHECK(__atomic_load_n(&g_submitted, __ATOMIC_ACQUIRE) == 8);
+  pthread_mutex_lock(&g_pool.lock);
+  CHECK(g_pool.queued == 8);
+  pthread_mutex_unlock(&g_pool.lock);
+
+  __atomic_store_n(&g_gate_open, true, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  event_pool_end(&g_pool);
+  CHECK(g_submitted == 20);
+  CHECK(g_gated == 20);
+  CHECK(stats.handled == 20);
+}
+
+int main(int argc, char **argv) {
+  char inline_path[64];
+  char workers_path[64];
+  snprintf(inline_path, sizeof(inline_path),
+           "/tmp/sketchybar-test-%d-inline.socket", (int)getpid());
+  snprintf(workers_path, sizeof(workers_path),
+           "/tmp/sketchybar-test-%d-workers.socket", (int)getpid());
+  static struct socket_server inline_server;
+  static struct socket_server workers_server;
+  start_server(&workers_server, workers_path, 4);
+
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    start_server(&inline_server, inline_path, 0);
+    double events = SENDERS * EVENTS_PER_SENDER;
+    printf("inline:    %8.0f events/s\n",
+           events / flood(&inline_server, inline_path));
+    printf("4 workers: %8.0f events/s\n",
+           events / flood(&workers_server, workers_path));
+    printf("peak queue depth with workers: %llu\n",
+           (unsigned long long)workers_server.stats.queue_depth_max);
+  } else {
+    check_flood(&workers_server, workers_path);
+    check_limit();
+  }
+
+  unlink(inline_path);
+  unlink(workers_path);
+  return argc > 1 ? 0 : check_exit("event_pool");
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+// trash_monitor.c with its main renamed, so checks can drive its internals,
+// plus the stand-in bar from bar.h, which records every trash_change it gets.
+//   bar_begin(dir);          // $SKETCHYBAR_SOCKET=<dir>/bar.socket, HOME=dir
+//   ... update ...
+//   bar_wait(1);             // true once one more trigger arrived
+//   g_bar_count              // TRASH_COUNT of the latest one
+//   g_bar_size               // its TRASH_SIZE, -1 without one
+
+#define main trash_monitor_main
+#include "../trash_monitor.c"
+#undef main
+
+#include "bar.h"
+
+static uint64_t g_bar_triggers;
+static int g_bar_count = -1;
+static long long g_bar_size = -1;
+static uint64_t g_bar_seen; // triggers consumed by bar_wait
+
+static void bar_observe(const char *message) {
+  if (strncmp(message, "--trigger trash_change ", 23) != 0)
+    return;
+  const char *count = strstr(message, " TRASH_COUNT=");
+  const char *size = strstr(message, " TRASH_SIZE=");
+  if (count)
+    __atomic_store_n(&g_bar_count, atoi(count + 13), __ATOMIC_RELAXED);
+  __atomic_store_n(&g_bar_size, size ? atoll(size + 12) : -1,
+                   __ATOMIC_RELAXED);
+  __atomic_fetch_add(&g_bar_triggers, 1, __ATOMIC_RELEASE);
+}
+
+// The monitor's state file lands in dir as well.
+static inline void bar_begin(const char *dir) {
+  char cache[256];
+  snprintf(cache, sizeof(cache), "%s/.cache", dir);
+  mkdir(cache, 0700);
+  setenv("HOME", dir, 1);
+  unsetenv("XDG_CACHE_HOME");
+  unsetenv("SKETCHYBAR_RING");
+
+  char path[sizeof(g_bar_path)];
+  snprintf(path, sizeof(path), "%s/bar.socket", dir);
+  setenv("SKETCHYBAR_SOCKET", path, 1);
+  g_bar_observer = bar_observe;
+  bar_start(path);
+}
+
+// Spins rather than sleeps, so it can time a delivery as well.
+static inline bool bar_wait(uint64_t triggers) {
+  g_bar_seen += triggers;
+  for (double start = check_now(); check_now() - start < 5.0;) {
+    if (__atomic_load_n(&g_bar_triggers, __ATOMIC_ACQUIRE) >= g_bar_seen)
+      return true;
+    sched_yield();
+  }
+  g_bar_seen = __atomic_load_n(&g_bar_triggers, __ATOMIC_ACQUIRE);
+  return false;
+}
+
+// True when nothing arrived within `ms`.
+static inline bool bar_quiet(int ms) {
+  usleep(ms * 1000);
+  return __atomic_load_n(&g_bar_triggers, __ATOMIC_ACQUIRE) == g_bar_seen;
+}
+
+static inline void remove_tree(const char *path) {
+  char command[512];
+  snprintf(command, sizeof(command), "rm -rf '%s'", path);
+  if (system(command) != 0)
+    fprintf(stderr, "could not remove %s\n", path);
+}
@@ -0,0 +1,154 @@
+// The monitor's update schedule from rate_limit.h against synthetic event
+// timelines, with a virtual clock and timer: an event either publishes at
+// once or schedules the trailing flush, and events while a flush is pending
+// ride along with it.
+
+#include "../rate_limit.h"
+#include "check.h"
+
+#include <stdlib.h>
+
+#define MS 1000000ull
+#define MAX_UPDATES 1024
+
+struct schedule {
+  struct rate_limit limit;
+  uint64_t now;
+  uint64_t flush_at;
+  uint64_t updates[MAX_UPDATES];
+  int count;
+};
+
+static void publish(void *context) {
+  struct schedule *schedule = (struct schedule *)context;
+  if (schedule->count < MAX_UPDATES)
+    schedule->updates[schedule->count++] = schedule->now;
+}
+
+static void arm(void *context, uint64_t wait_ns) {
+  struct schedule *schedule = (struct schedule *)context;
+  schedule->flush_at = schedule->now + wait_ns;
+}
+
+// Fires a due trailing flush, like the watcher's timer would.
+static void advance(struct schedule *schedule, uint64_t now) {
+  if (schedule->limit.flush_pending && schedule->flush_at <= now) {
+    schedule->now = schedule->flush_at;
+    rate_limit_flush(&schedule->limit, schedule->now);
+  }
+}
+
+static void event(struct schedule *schedule, uint64_t now) {
+  advance(schedule, now);
+  schedule->now = now;
+  rate_limit_request(&schedule->limit, now);
+}
+
+static void run(struct schedule *schedule, uint64_t interval,
+                const uint64_t *events, int count) {
+  *schedule = (struct schedule){0};
+  schedule->limit =
+      (struct rate_limit){interval, 0, false, publish, arm, schedule};
+  for (int i = 0; i < count; i++)
+    event(schedule, events[i]);
+  advance(schedule, UINT64_MAX);
+}
+
+static bool updates_are(const struct schedule *schedule,
+                        const uint64_t *expected, int count) {
+  if (schedule->count != count)
+    return false;
+  for (int i = 0; i < count; i++) {
+    if (schedule->updates[i] != expected[i])
+      return false;
+  }
+  return true;
+}
+
+// The clock starts well past zero; last_ns == 0 means "never published".
+static const uint64_t T = 1000 * MS;
+
+static void check_single(void) {
+  struct schedule schedule;
+  uint64_t events[] = {T};
+  run(&schedule, 250 * MS, events, 1);
+  uint64_t expected[] = {T};
+  CHECK(updates_are(&schedule, expected, 1));
+}
+
+static void check_spaced(void) {
+  struct schedule schedule;
+  uint64_t events[] = {T, T + 250 * MS, T + 900 * MS};
+  run(&schedule, 250 * MS, events, 3);
+  CHECK(updates_are(&schedule, events, 3));
+}
+
+// One event every 10 ms for a second: the leading edge, then one update per
+// interval, then the trailing flush for the last event.
+static void check_burst(void) {
+  struct schedule schedule;
+  uint64_t events[101];
+  for (int i = 0; i <= 100; i++)
+    events[i] = T + i * 10 * MS;
+  run(&schedule, 250 * MS, events, 101);
+  uint64_t expected[] = {T,           T + 250 * MS,  T + 500 * MS,
+                         T + 750 * MS, T + 1000 * MS, T + 1250 * MS};
+  CHECK(updates_are(&schedule, expected, 6));
+}
+
+// Two quick events: the second waits for the interval to end.
+static void check_trailing(void) {
+  struct schedule schedule;
+  uint64_t events[] = {T, T + 30 * MS, T + 60 * MS};
+  run(&schedule, 100 * MS, events, 3);
+  uint64_t expected[] = {T, T + 100 * MS};
+  CHECK(updates_are(&schedule, expected, 2));
+}
+
+static void check_unlimited(void) {
+  struct schedule schedule;
+  uint64_t events[] = {T, T + 1, T + 2, T + 2};
+  run(&schedule, 0, events, 4);
+  CHECK(updates_are(&schedule, events, 4));
+}
+
+// Random timelines: updates never come closer than the interval, the first
+// event publishes at once, and every event is covered by an update no later
+// than one interval after it.
+static void check_random(void) {
+  srand(17);
+  for (int round = 0; round < 1000; round++) {
+    uint64_t interval = (1 + rand() % 500) * MS;
+    uint64_t events[200];
+    uint64_t now = T;
+    for (int i = 0; i < 200; i++) {
+      now += (uint64_t)(rand() % 3 ? rand() % 50 : rand() % 2000) * MS;
+      events[i] = now;
+    }
+
+    struct schedule schedule;
+    run(&schedule, interval, events, 200);
+    bool spaced = schedule.updates[0] == events[0];
+    for (int i = 1; i < schedule.count; i++)
+      spaced &= schedule.updates[i] - schedule.updates[i - 1] >= interval;
+    bool covered = true;
+    for (int i = 0, u = 0; i < 200; i++) {
+      while (u < schedule.count && schedule.updates[u] < events[i])
+        u++;
+      covered &=
+          u < schedule.count && schedule.updates[u] - events[i] <= interval;
+    }
+    CHECK(spaced);
+    CHECK(covered);
+  }
+}
+
+int main(void) {
+  check_single();
+  check_spaced();
+  check_burst();
+  check_trailing();
+  check_unlimited();
+  check_random();
+  return check_exit("rate_limit");
+}
@@ -0,0 +1,209 @@
+// The shared-memory ring with several producers: every record arrives intact
+// and each producer's records arrive in order, and a producer killed between
+// claiming a record and committing it does not stall the ones after it. With --bench, messages/s and
+// CPU per message through the ring and through the socket transport.
+
+#include "../sketchybar.h"
+#include "check.h"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define PRODUCERS 8
+#define RECORDS 50000
+
+static struct ring_server g_ring;
+static struct socket_server g_socket;
+static char g_ring_name[64];
+static char g_socket_path[64];
+
+static uint64_t g_received;
+static uint64_t g_last[PRODUCERS];
+static uint64_t g_corrupt;
+
+// Records are "P\0<producer>\0N\0<sequence>\0", padded by the producers to
+// vary their size so the ring wraps at every possible offset.
+static MACH_HANDLER(ring_handler) {
+  unsigned producer;
+  unsigned long long sequence;
+  if (sscanf(env_get_value_for_key(env, (char *)"P"), "%u", &producer) != 1 ||
+      sscanf(env_get_value_for_key(env, (char *)"N"), "%llu", &sequence) !=
+          1 ||
+      producer >= PRODUCERS || sequence != g_last[producer] + 1) {
+    g_corrupt++;
+  } else {
+    g_last[producer] = sequence;
+  }
+  __atomic_fetch_add(&g_received, 1, __ATOMIC_RELEASE);
+}
+
+static MACH_HANDLER(count_handler) {
+  (void)env;
+  __atomic_fetch_add(&g_received, 1, __ATOMIC_RELEASE);
+}
+
+static void *ring_thread(void *context) {
+  ring_server_begin(&g_ring, (mach_handler *)context, g_ring_name);
+  return NULL;
+}
+
+static void *socket_thread(void *context) {
+  socket_server_begin(&g_socket, (mach_handler *)context, g_socket_path);
+  return NULL;
+}
+
+static void start(void *(*thread)(void *), mach_handler *handler,
+                  const char *path) {
+  pthread_t id;
+  pthread_create(&id, NULL, thread, (void *)handler);
+  pthread_detach(id);
+  for (int i = 0; i < 100 && access(path, F_OK) != 0; i++)
+    usleep(1000);
+}
+
+static bool wait_received(uint64_t count) {
+  for (int i = 0; i < 5000; i++) {
+    if (__atomic_load_n(&g_received, __ATOMIC_ACQUIRE) >= count)
+      return true;
+    usleep(1000);
+  }
+  return false;
+}
+
+static void *produce(void *context) {
+  unsigned producer = (unsigned)(uintptr_t)context;
+  struct sketchybar_session session;
+  sketchybar_session_begin(&session);
+  char message[256];
+  for (unsigned long long n = 1; n <= RECORDS; n++) {
+    int length = snprintf(message, sizeof(message), "P%c%u%cN%c%llu%cPAD%c%.*s",
+                          0, producer, 0, 0, n, 0, 0, (int)(n % 97),
+                          "................................................."
+                          "................................................");
+    message[length + 1] = '\0';
+    // A full ring drops instead of blocking; the check wants everything.
+    while (!sketchybar_session_push(&session, message, length + 2))
+      sched_yield();
+  }
+  sketchybar_session_end(&session);
+  return NULL;
+}
+
+static void check_producers(void) {
+  pthread_t threads[PRODUCERS];
+  for (unsigned i = 0; i < PRODUCERS; i++)
+    pthread_create(&threads[i], NULL, produce, (void *)(uintptr_t)i);
+  for (unsigned i = 0; i < PRODUCERS; i++)
+    pthread_join(threads[i], NULL);
+
+  CHECK(wait_received((uint64_t)PRODUCERS * RECORDS));
+  CHECK(g_received == (uint64_t)PRODUCERS * RECORDS);
+  CHECK(g_corrupt == 0);
+  for (unsigned i = 0; i < PRODUCERS; i++)
+    CHECK(g_last[i] == RECORDS);
+}
+
+static void check_oversized(void) {
+  struct sketchybar_session session;
+  sketchybar_session_begin(&session);
+  uint32_t length = RING_CAPACITY / 2;
+  char *message = (char *)calloc(1, length);
+  uint32_t dropped = g_ring.ring->dropped;
+  CHECK(!sketchybar_session_push(&session, message, length));
+  CHECK(g_ring.ring->dropped == dropped + 1);
+  free(message);
+  sketchybar_session_end(&session);
+}
+
+// The child claims a record (and publishes its header when asked to) and
+// exits without committing it. The consumer drops the claim, right after
+// RING_CLAIM_TIMEOUT_MS when the header names a dead pid, after
+// RING_ABANDON_MS otherwise, and the next record arrives.
+static void check_abandoned(bool published) {
+  struct sketchybar_session session;
+  sketchybar_session_begin(&session);
+  uint64_t before = __atomic_load_n(&g_received, __ATOMIC_ACQUIRE);
+  uint32_t dropped = __atomic_load_n(&g_ring.ring->dropped, __ATOMIC_RELAXED);
+
+  pid_t child = fork();
+  if (child == 0) {
+    struct ring_claim claim;
+    if (ring_claim(g_ring.ring, 64, &claim) && published)
+      ring_publish(&claim, 64, getpid());
+    _exit(0);
+  }
+  waitpid(child, NULL, 0);
+
+  char message[64];
+  int length = snprintf(message, sizeof(message), "P%c0%cN%c%llu%c", 0, 0, 0,
+                        (unsigned long long)g_last[0] + 1, 0);
+  double start = check_now();
+  CHECK(sketchybar_session_push(&session, message, length + 1));
+  CHECK(wait_received(before + 1));
+  double elapsed = check_now() - start;
+  CHECK(g_ring.ring->dropped == dropped + 1);
+  CHECK(g_corrupt == 0);
+  if (published)
+    CHECK(elapsed < RING_ABANDON_MS / 1000.0);
+  sketchybar_session_end(&session);
+}
+
+static double cpu_seconds(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Producer and consumer share the process, so CPU covers both ends.
+static void bench_transport(const char *name) {
+  char message[] = "--set\0cpu\0label=42%\0\0";
+  const int count = 500000;
+  struct sketchybar_session session;
+  sketchybar_session_begin(&session);
+
+  uint64_t before = __atomic_load_n(&g_received, __ATOMIC_ACQUIRE);
+  double start = check_now();
+  double cpu = cpu_seconds();
+  for (int i = 0; i < count; i++) {
+    while (!sketchybar_session_push(&session, message, sizeof(message)))
+      sched_yield();
+  }
+  wait_received(before + count);
+  double elapsed = check_now() - start;
+  cpu = cpu_seconds() - cpu;
+  printf("%-7s %10.0f messages/s %8.0f ns CPU/message\n", name,
+         count / elapsed, cpu * 1e9 / count);
+  sketchybar_session_end(&session);
+}
+
+int main(int argc, char **argv) {
+  bool benchmark = argc > 1 && strcmp(argv[1], "--bench") == 0;
+  char bell[128];
+  snprintf(g_ring_name, sizeof(g_ring_name), "/sketchybar-test-%d.ring",
+           (int)getpid());
+  ring_bell_path(bell, sizeof(bell), g_ring_name);
+  snprintf(g_socket_path, sizeof(g_socket_path),
+           "/tmp/sketchybar-test-%d.socket", (int)getpid());
+
+  start(ring_thread, benchmark ? count_handler : ring_handler, bell);
+  setenv("SKETCHYBAR_RING", g_ring_name, 1);
+  if (benchmark) {
+    bench_transport("ring");
+    start(socket_thread, count_handler, g_socket_path);
+    wait_for_listener(g_socket_path);
+    unsetenv("SKETCHYBAR_RING");
+    setenv("SKETCHYBAR_SOCKET", g_socket_path, 1);
+    bench_transport("socket");
+  } else {
+    check_producers();
+    check_oversized();
+    check_abandoned(true);
+    check_abandoned(false);
+  }
+
+  shm_unlink(g_ring_name);
+  unlink(bell);
+  unlink(g_socket_path);
+  return benchmark ? 0 : check_exit("ring_transport");
+}
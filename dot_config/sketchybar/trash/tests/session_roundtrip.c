@@ -0,0 +1,76 @@
+// Request round trips against the stand-in bar, per call vs. a long-lived
+// session. The per-call path sets a session up and tears it down around every
+// request, the way sketchybar() used a fresh reply port per message before
+// sessions existed. With --bench, the time per round trip of each.
+
+#include "bar.h"
+
+static const char *g_reply = "{\"label\":{\"value\":\"42%\"}}";
+
+static char *per_call(char *message, uint32_t len) {
+  static char reply[64];
+  struct sketchybar_session session;
+  if (!sketchybar_session_begin(&session))
+    return NULL;
+  char *response = sketchybar_session_send(&session, message, len);
+  if (response)
+    snprintf(reply, sizeof(reply), "%s", response);
+  sketchybar_session_end(&session);
+  return response ? reply : NULL;
+}
+
+static void check_paths(struct sketchybar_session *session) {
+  char message[] = "--query\0cpu\0\0";
+  char *reply = per_call(message, sizeof(message));
+  CHECK(reply && strcmp(reply, g_reply) == 0);
+  reply = sketchybar_session_send(session, message, sizeof(message));
+  CHECK(reply && strcmp(reply, g_reply) == 0);
+  CHECK(strcmp(sketchybar((char *)"--query cpu"), g_reply) == 0);
+  CHECK(bar_wait_messages(3));
+  for (uint32_t i = 0; i < 3; i++)
+    CHECK(strcmp(bar_message(i), "--query cpu") == 0);
+}
+
+static void bench(struct sketchybar_session *session) {
+  char message[] = "--query\0cpu\0\0";
+  const int requests = 20000;
+  double start = check_now();
+  for (int i = 0; i < requests; i++)
+    per_call(message, sizeof(message));
+  double elapsed = check_now() - start;
+  printf("per call: %6.1f us round trip\n", elapsed * 1e6 / requests);
+
+  start = check_now();
+  for (int i = 0; i < requests; i++)
+    sketchybar_session_send(session, message, sizeof(message));
+  elapsed = check_now() - start;
+  printf("session:  %6.1f us round trip\n", elapsed * 1e6 / requests);
+}
+
+int main(int argc, char **argv) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/sketchybar-test-%d.socket",
+           (int)getpid());
+  bar_reply("--query cpu", g_reply);
+  if (!bar_start(path)) {
+    fprintf(stderr, "could not listen on %s\n", path);
+    return 1;
+  }
+  setenv("SKETCHYBAR_SOCKET", path, 1);
+  unsetenv("SKETCHYBAR_RING");
+
+  struct sketchybar_session session;
+  if (!sketchybar_session_begin(&session) || session.fd < 0) {
+    fprintf(stderr, "could not connect to %s\n", path);
+    return 1;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    bench(&session);
+  else
+    check_paths(&session);
+
+  sketchybar_session_end(&session);
+  unlink(path);
+  return argc > 1 ? 0 : check_exit("session_roundtrip");
+}
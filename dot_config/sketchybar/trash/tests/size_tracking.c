@@ -0,0 +1,160 @@
+// --size end to end on the inotify backend: the watcher loop runs in a thread
+// and TRASH_SIZE must follow writes deep inside a trashed directory, which
+// only the watches placed while measuring report. The periodic refresh stays
+// quiet while every directory is watched and re-measures an entry that is
+// not.
+
+#include "monitor.h"
+
+static char g_dir[] = "/tmp/trash-test-XXXXXX";
+static char g_trash[64];
+static char g_folder[96];
+
+static void *watch_thread(void *context) {
+  (void)context;
+  watcher_run(&g_watcher);
+  return NULL;
+}
+
+// What the monitor should report for a tree: its allocated blocks.
+static long long allocated(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) != 0)
+    return 0;
+  long long total = (long long)st.st_blocks * 512;
+  DIR *dir = S_ISDIR(st.st_mode) ? opendir(path) : NULL;
+  struct dirent *dirent;
+  while (dir && (dirent = readdir(dir)) != NULL) {
+    if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+      continue;
+    char child[512];
+    snprintf(child, sizeof(child), "%s/%s", path, dirent->d_name);
+    total += allocated(child);
+  }
+  if (dir)
+    closedir(dir);
+  return total;
+}
+
+static void append(const char *name, size_t bytes) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", g_folder, name);
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  char block[4096];
+  memset(block, 'x', sizeof(block));
+  for (size_t written = 0; fd >= 0 && written < bytes; written += sizeof(block))
+    if (write(fd, block, sizeof(block)) < 0)
+      break;
+  if (fd >= 0)
+    close(fd);
+}
+
+// Seconds until the bar shows `size`, or -1 after `timeout`.
+static double size_until(long long size, double timeout) {
+  double start = check_now();
+  while (__atomic_load_n(&g_bar_size, __ATOMIC_RELAXED) != size) {
+    if (check_now() - start > timeout)
+      return -1;
+    usleep(1000);
+  }
+  return check_now() - start;
+}
+
+static void check_deep_writes(void) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/inner", g_folder);
+  mkdir(g_folder, 0700);
+  mkdir(path, 0700);
+  snprintf(path, sizeof(path), "%s/inner/deeper", g_folder);
+  mkdir(path, 0700);
+  append("inner/deeper/data", 64 * 1024);
+  CHECK(size_until(allocated(g_folder), 2.0) >= 0);
+
+  append("inner/deeper/data", 64 * 1024);
+  CHECK(size_until(allocated(g_folder), 2.0) >= 0);
+
+  // Created after the walk, and watched by the next one.
+  snprintf(path, sizeof(path), "%s/inner/later", g_folder);
+  mkdir(path, 0700);
+  append("inner/later/data", 32 * 1024);
+  CHECK(size_until(allocated(g_folder), 2.0) >= 0);
+  append("inner/later/data", 32 * 1024);
+  CHECK(size_until(allocated(g_folder), 2.0) >= 0);
+}
+
+static int g_folder_sized = -1;
+
+static void inspect(void *context) {
+  (void)context;
+  struct trash_entry **slot = entry_set_find(&g_roots[0].entries, "folder");
+  __atomic_store_n(&g_folder_sized, slot && (*slot)->size >= 0,
+                   __ATOMIC_RELEASE);
+}
+
+// Whether the folder still had its size right after a refresh.
+static bool refresh_keeps_size(void) {
+  __atomic_store_n(&g_folder_sized, -1, __ATOMIC_RELEASE);
+  watcher_post(&g_watcher, refresh_sizes, NULL);
+  watcher_post(&g_watcher, inspect, NULL);
+  int sized;
+  while ((sized = __atomic_load_n(&g_folder_sized, __ATOMIC_ACQUIRE)) < 0)
+    usleep(1000);
+  return sized == 1;
+}
+
+// What hitting the watch limit leaves behind: an entry nothing reports.
+static void lose_watches(void *context) {
+  (void)context;
+  watcher_unwatch_below(&g_watcher, g_folder);
+  struct trash_entry **slot = entry_set_find(&g_roots[0].entries, "folder");
+  if (slot)
+    (*slot)->unwatched = true;
+}
+
+static void check_refresh(void) {
+  CHECK(refresh_keeps_size());
+
+  watcher_post(&g_watcher, lose_watches, NULL);
+  usleep(50000);
+  g_bar_seen = __atomic_load_n(&g_bar_triggers, __ATOMIC_ACQUIRE);
+  long long before = allocated(g_folder);
+  append("inner/deeper/data", 64 * 1024);
+  CHECK(bar_quiet(300));
+  CHECK(__atomic_load_n(&g_bar_size, __ATOMIC_RELAXED) == before);
+
+  CHECK(!refresh_keeps_size());
+  CHECK(size_until(allocated(g_folder), 2.0) >= 0);
+}
+
+int main(void) {
+  if (!mkdtemp(g_dir))
+    return 1;
+  snprintf(g_trash, sizeof(g_trash), "%s/Trash", g_dir);
+  mkdir(g_trash, 0700);
+  bar_begin(g_dir);
+
+  g_track_size = true;
+  struct trash_root *root =
+      add_trash_root(g_roots, &g_root_count, g_trash, "Home");
+  root->path_len = strlen(root->path);
+  snprintf(g_folder, sizeof(g_folder), "%s/folder", root->path);
+  if (!watcher_begin(&g_watcher, trash_events, NULL, NULL, WATCH_LATENCY) ||
+      !watch_trash_roots()) {
+    fprintf(stderr, "could not watch %s\n", g_trash);
+    return 1;
+  }
+  update_sketchybar();
+  pthread_t thread;
+  pthread_create(&thread, NULL, watch_thread, NULL);
+  CHECK(size_until(0, 2.0) >= 0);
+
+  check_deep_writes();
+  check_refresh();
+
+  remove_tree(g_folder);
+  CHECK(size_until(0, 2.0) >= 0);
+  CHECK(__atomic_load_n(&g_bar_count, __ATOMIC_RELAXED) == 0);
+
+  remove_tree(g_dir);
+  return check_exit("size_tracking");
+}
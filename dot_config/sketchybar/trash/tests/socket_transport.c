@@ -0,0 +1,114 @@
+// The Unix socket transport against the stand-in bar in bar.h: scripted
+// replies, ordered pushes, reconnecting and the frame limit. With --bench, push throughput and
+// request round trips, which is the harness for comparing transports.
+
+#include "bar.h"
+
+static char g_path[64];
+
+static void check_request(struct sketchybar_session *session) {
+  char message[] = "--query\0bar\0\0";
+  char *reply = sketchybar_session_send(session, message, sizeof(message));
+  CHECK(reply && strcmp(reply, "{\"position\":\"top\"}") == 0);
+  CHECK(bar_wait_messages(1));
+  CHECK(strcmp(bar_message(0), "--query bar") == 0);
+
+  // Anything the script does not know gets the bar's empty reply.
+  char unknown[] = "--query\0nothing\0\0";
+  reply = sketchybar_session_send(session, unknown, sizeof(unknown));
+  CHECK(reply && strcmp(reply, "") == 0);
+  CHECK(bar_wait_messages(2));
+  CHECK(strcmp(bar_message(1), "--query nothing") == 0);
+}
+
+static void check_pushes(struct sketchybar_session *session) {
+  uint32_t before = bar_messages();
+  char message[32];
+  for (int i = 0; i < 1000; i++) {
+    int len = snprintf(message, sizeof(message), "--set%ccpu%clabel=%d%c", 0,
+                       0, i, 0);
+    CHECK(sketchybar_session_push(session, message, len + 1));
+  }
+  CHECK(bar_wait_messages(before + 1000));
+  // Pushes arrive in order and none are torn.
+  char expected[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(expected, sizeof(expected), "--set cpu label=%d", i);
+    CHECK(strcmp(bar_message(before + i), expected) == 0);
+  }
+}
+
+// The server drops a connection announcing more than SOCKET_FRAME_MAX instead
+// of reserving for it.
+static void check_frame_limit(void) {
+  int fd = socket_connect(g_path);
+  CHECK(fd >= 0);
+  struct socket_frame frame = {UINT32_MAX, 0};
+  CHECK(send(fd, &frame, sizeof(frame), 0) == sizeof(frame));
+  char byte;
+  CHECK(recv(fd, &byte, 1, 0) == 0);
+  close(fd);
+}
+
+// A session whose connection broke reconnects on the next message and bumps
+// its generation so the diff cache starts over.
+static void check_reconnect(struct sketchybar_session *session) {
+  uint32_t generation = session->generation;
+  shutdown(session->fd, SHUT_RDWR);
+  uint32_t before = bar_messages();
+  char message[] = "--query\0bar\0\0";
+  char *reply = sketchybar_session_send(session, message, sizeof(message));
+  CHECK(reply && strcmp(reply, "{\"position\":\"top\"}") == 0);
+  CHECK(bar_wait_messages(before + 1));
+  CHECK(session->generation != generation);
+}
+
+static void bench(struct sketchybar_session *session) {
+  char message[] = "--set\0cpu\0label=42%\0\0";
+  const int pushes = 200000;
+  uint32_t before = bar_messages();
+  double start = check_now();
+  for (int i = 0; i < pushes; i++)
+    sketchybar_session_push(session, message, sizeof(message));
+  bar_wait_messages(before + pushes);
+  double elapsed = check_now() - start;
+  printf("push:    %10.0f messages/s\n", pushes / elapsed);
+
+  const int requests = 20000;
+  start = check_now();
+  for (int i = 0; i < requests; i++)
+    sketchybar_session_send(session, message, sizeof(message));
+  elapsed = check_now() - start;
+  printf("request: %10.1f us round trip\n", elapsed * 1e6 / requests);
+}
+
+int main(int argc, char **argv) {
+  snprintf(g_path, sizeof(g_path), "/tmp/sketchybar-test-%d.socket",
+           (int)getpid());
+  bar_reply("--query bar", "{\"position\":\"top\"}");
+  if (!bar_start(g_path)) {
+    fprintf(stderr, "could not listen on %s\n", g_path);
+    return 1;
+  }
+  setenv("SKETCHYBAR_SOCKET", g_path, 1);
+  unsetenv("SKETCHYBAR_RING");
+
+  struct sketchybar_session session;
+  if (!sketchybar_session_begin(&session) || session.fd < 0) {
+    fprintf(stderr, "could not connect to %s\n", g_path);
+    return 1;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    bench(&session);
+  } else {
+    check_request(&session);
+    check_pushes(&session);
+    check_frame_limit();
+    check_reconnect(&session);
+  }
+
+  sketchybar_session_end(&session);
+  unlink(g_path);
+  return argc > 1 ? 0 : check_exit("socket_transport");
+}
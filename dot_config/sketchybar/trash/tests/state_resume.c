@@ -0,0 +1,182 @@
+// The TMS2 state file and resuming from it: every root's entries and cached
+// sizes survive a save and load, told apart by key when roots share a path;
+// a damaged file restores nothing it cannot read; a replay is published once,
+// after WATCHER_HISTORY_DONE, and reconciled against the disk; and the save
+// timer only writes when events came in.
+
+#include "monitor.h"
+
+static char g_dir[] = "/tmp/trash-test-XXXXXX";
+static char g_trash[64];
+static char g_state_file[128];
+
+static void create(const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", g_trash, name);
+  int fd = open(path, O_WRONLY | O_CREAT, 0600);
+  if (fd >= 0)
+    close(fd);
+}
+
+static void reset_roots(void) {
+  for (int r = 0; r < g_root_count; r++)
+    entry_set_free(&g_roots[r].entries);
+  g_root_count = 0;
+}
+
+// A trash root and a watch on the same directory.
+static void add_roots(void) {
+  struct trash_root *root =
+      add_trash_root(g_roots, &g_root_count, g_trash, "Home");
+  root->path_len = strlen(root->path);
+  root = add_trash_root(g_roots, &g_root_count, g_trash, "pdfs_change");
+  root->path_len = strlen(root->path);
+  root->watch = &g_watches[0];
+}
+
+static void set_entry(struct trash_root *root, const char *name, ino_t ino,
+                      long long size) {
+  struct trash_entry *entry = entry_set_add(&root->entries, name);
+  entry->ino = ino;
+  entry->mtime.tv_sec = 1700000000 + ino;
+  entry->mtime.tv_nsec = 123456789;
+  entry->size = size;
+}
+
+static bool has_entry(struct trash_root *root, const char *name, ino_t ino,
+                      long long size) {
+  struct trash_entry **slot = entry_set_find(&root->entries, name);
+  return slot && (*slot)->ino == ino &&
+         (*slot)->mtime.tv_sec == 1700000000 + (time_t)ino &&
+         (*slot)->mtime.tv_nsec == 123456789 && (*slot)->size == size;
+}
+
+static void load_roots(void) {
+  reset_roots();
+  add_roots();
+  load_state();
+  // No history on inotify, so nothing resumes; entries are restored anyway.
+  CHECK(!restore_root(&g_roots[0]));
+  CHECK(!restore_root(&g_roots[1]));
+  free(g_state);
+  g_state = NULL;
+}
+
+static void check_round_trip(void) {
+  add_roots();
+  set_entry(&g_roots[0], "a", 11, 4096);
+  set_entry(&g_roots[0], "b", 12, -1);
+  set_entry(&g_roots[1], "report.pdf", 13, 81920);
+  save_state();
+
+  load_roots();
+  CHECK(g_roots[0].entries.count == 2);
+  CHECK(has_entry(&g_roots[0], "a", 11, 4096));
+  CHECK(has_entry(&g_roots[0], "b", 12, -1));
+  CHECK(g_roots[1].entries.count == 1);
+  CHECK(has_entry(&g_roots[1], "report.pdf", 13, 81920));
+}
+
+static void write_state(const void *data, size_t length) {
+  FILE *file = fopen(g_state_file, "wb");
+  if (file) {
+    fwrite(data, 1, length, file);
+    fclose(file);
+  }
+}
+
+static void check_damaged(void) {
+  FILE *file = fopen(g_state_file, "rb");
+  char saved[4096];
+  size_t length = file ? fread(saved, 1, sizeof(saved), file) : 0;
+  if (file)
+    fclose(file);
+  CHECK(length > sizeof(struct state_header));
+
+  // Cut inside the last root: the roots before it still restore.
+  write_state(saved, length - 8);
+  load_roots();
+  CHECK(g_roots[0].entries.count == 2);
+  CHECK(g_roots[1].entries.count == 0);
+
+  char old[sizeof(saved)];
+  memcpy(old, saved, length);
+  memcpy(old, "TMS1", 4);
+  write_state(old, length);
+  load_roots();
+  CHECK(g_roots[0].entries.count == 0);
+
+  write_state(saved, length);
+}
+
+// Resuming: the restored entries, then the replay. "missed" was created on
+// disk but the replay never mentions it, so reconciling has to catch it.
+static void check_replay(void) {
+  load_roots();
+  unlink(g_state_file);
+  char path[sizeof(g_roots[0].path) + 8];
+  create("a");
+  create("b");
+  create("fresh");
+  create("missed");
+  g_roots[0].replaying = true;
+  update_sketchybar();
+  CHECK(bar_wait(1));
+  CHECK(g_bar_count == 2);
+
+  snprintf(path, sizeof(path), "%s/fresh", g_roots[0].path);
+  struct watcher_event replay[] = {{path, WATCHER_CREATED}};
+  trash_events(NULL, replay, 1);
+  CHECK(bar_quiet(300));
+  CHECK(g_roots[0].entries.count == 3);
+
+  struct watcher_event done[] = {{"", WATCHER_HISTORY_DONE}};
+  trash_events(NULL, done, 1);
+  CHECK(!g_roots[0].replaying);
+  CHECK(bar_wait(1));
+  CHECK(g_bar_count == 4);
+  CHECK(bar_quiet(300));
+}
+
+static bool state_saved(void) {
+  struct stat st;
+  return stat(g_state_file, &st) == 0;
+}
+
+static void check_save_timer(void) {
+  save_state();
+  unlink(g_state_file);
+  save_state_later(NULL);
+  CHECK(!state_saved());
+
+  char path[sizeof(g_roots[0].path) + 8];
+  create("later");
+  snprintf(path, sizeof(path), "%s/later", g_roots[0].path);
+  struct watcher_event event[] = {{path, WATCHER_CREATED}};
+  trash_events(NULL, event, 1);
+  save_state_later(NULL);
+  CHECK(state_saved());
+}
+
+int main(void) {
+  if (!mkdtemp(g_dir))
+    return 1;
+  snprintf(g_trash, sizeof(g_trash), "%s/Trash", g_dir);
+  snprintf(g_state_file, sizeof(g_state_file),
+           "%s/.cache/trash_monitor.state", g_dir);
+  mkdir(g_trash, 0700);
+  bar_begin(g_dir);
+  g_watch_count = 1;
+  snprintf(g_watches[0].event, sizeof(g_watches[0].event), "pdfs_change");
+  snprintf(g_watches[0].filter, sizeof(g_watches[0].filter), "*.pdf");
+  if (!watcher_begin(&g_watcher, trash_events, NULL, NULL, WATCH_LATENCY))
+    return 1;
+
+  check_round_trip();
+  check_damaged();
+  check_replay();
+  check_save_timer();
+
+  remove_tree(g_dir);
+  return check_exit("state_resume");
+}
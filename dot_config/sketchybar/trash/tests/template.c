@@ -0,0 +1,123 @@
+// Compiled templates must produce exactly what sketchybar() would send for
+// the same formatted command: tokenize(snprintf(format, values)). With
+// --bench, the cost per message of both.
+
+#include "../sketchybar.h"
+#include "check.h"
+
+static char g_expected[SKETCHYBAR_TEMPLATE_SIZE];
+
+static bool same_as_tokenized(const struct sketchybar_template *template,
+                              const char *formatted) {
+  uint32_t length = sketchybar_tokenize(formatted, g_expected);
+  return template->length == length &&
+         memcmp(template->buffer, g_expected, length) == 0 &&
+         template->buffer[length] == '\0';
+}
+
+static void check_trigger(void) {
+  struct sketchybar_template template;
+  CHECK(SKETCHYBAR_TEMPLATE(&template,
+                            "--trigger trash_change TRASH_COUNT=%d "
+                            "TRASH_VOLUMES=%s",
+                            0, ""));
+  CHECK(template.slot_count == 2);
+
+  long long counts[] = {0, 7, -3, 12345678901ll, 42, 5};
+  const char *volumes[] = {"", "Home:7", "Home:1,USB:2", "x", "", "Home:5"};
+  char formatted[256];
+  for (int i = 0; i < 6; i++) {
+    CHECK(sketchybar_template_set_int(&template, 0, counts[i]));
+    CHECK(sketchybar_template_set_string(&template, 1, volumes[i]));
+    snprintf(formatted, sizeof(formatted),
+             "--trigger trash_change TRASH_COUNT=%lld TRASH_VOLUMES=%s",
+             counts[i], volumes[i]);
+    CHECK(same_as_tokenized(&template, formatted));
+  }
+}
+
+// Quotes group words into one token and are dropped, both ways.
+static void check_quotes(void) {
+  struct sketchybar_template template;
+  CHECK(SKETCHYBAR_TEMPLATE(&template, "--set clock label=\"%s\" icon='%u%%'",
+                            "", 0u));
+  CHECK(sketchybar_template_set_string(&template, 0, "Mon 12:30"));
+  CHECK(sketchybar_template_set_int(&template, 1, 100));
+  CHECK(same_as_tokenized(&template, "--set clock label=\"Mon 12:30\" "
+                                     "icon='100%'"));
+}
+
+static void check_trailing_space(void) {
+  struct sketchybar_template template;
+  CHECK(sketchybar_template_compile(&template, "--update "));
+  CHECK(same_as_tokenized(&template, "--update "));
+
+  CHECK(SKETCHYBAR_TEMPLATE(&template, "--set a label=%s", ""));
+  CHECK(same_as_tokenized(&template, "--set a label="));
+}
+
+static void check_rejected(void) {
+  struct sketchybar_template template;
+  CHECK(!sketchybar_template_compile(&template, "--set a width=%f"));
+  CHECK(!sketchybar_template_compile(&template,
+                                     "%d %d %d %d %d %d %d %d %d"));
+
+  char format[SKETCHYBAR_TEMPLATE_SIZE + 8];
+  memset(format, 'x', sizeof(format) - 1);
+  format[sizeof(format) - 1] = '\0';
+  CHECK(!sketchybar_template_compile(&template, format));
+
+  // A value that does not fit leaves the template as it was.
+  CHECK(SKETCHYBAR_TEMPLATE(&template, "--set a label=%s", ""));
+  CHECK(sketchybar_template_set_string(&template, 0, "kept"));
+  char value[SKETCHYBAR_TEMPLATE_SIZE];
+  memset(value, 'v', sizeof(value) - 1);
+  value[sizeof(value) - 1] = '\0';
+  CHECK(!sketchybar_template_set_string(&template, 0, value));
+  CHECK(same_as_tokenized(&template, "--set a label=kept"));
+  CHECK(!sketchybar_template_set_int(&template, 1, 0));
+}
+
+static void bench(void) {
+  const int rounds = 2000000;
+  char formatted[256];
+  char tokens[256];
+  volatile uint32_t sink = 0;
+
+  double start = check_now();
+  for (int i = 0; i < rounds; i++) {
+    snprintf(formatted, sizeof(formatted),
+             "--trigger trash_change TRASH_COUNT=%d TRASH_VOLUMES=%s", i,
+             "Home:1");
+    sink += sketchybar_tokenize(formatted, tokens);
+  }
+  double tokenized = check_now() - start;
+
+  struct sketchybar_template template;
+  SKETCHYBAR_TEMPLATE(&template,
+                      "--trigger trash_change TRASH_COUNT=%d TRASH_VOLUMES=%s",
+                      0, "");
+  start = check_now();
+  for (int i = 0; i < rounds; i++) {
+    sketchybar_template_set_int(&template, 0, i);
+    sketchybar_template_set_string(&template, 1, "Home:1");
+    sink += template.length;
+  }
+  double compiled = check_now() - start;
+  (void)sink;
+
+  printf("snprintf + tokenize %7.1f ns/message\n", tokenized * 1e9 / rounds);
+  printf("template            %7.1f ns/message\n", compiled * 1e9 / rounds);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    bench();
+    return 0;
+  }
+  check_trigger();
+  check_quotes();
+  check_trailing_space();
+  check_rejected();
+  return check_exit("template");
+}
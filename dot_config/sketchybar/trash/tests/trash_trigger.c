@@ -0,0 +1,127 @@
+// How trash_change reaches the bar: over the IPC session, through the spawned
+// sketchybar fallback, and not at all when nothing changed. The stand-in
+// sketchybar CLI is this binary, linked into PATH. With --bench, the
+// update-to-delivery latency of IPC against spawning, and against the
+// system() call the monitor used to make.
+
+#include "monitor.h"
+
+#include <libgen.h>
+
+// Invoked as "sketchybar": sends its arguments like the real CLI does.
+static int act_as_sketchybar(int argc, char **argv) {
+  char message[4096];
+  uint32_t length = 0;
+  for (int i = 1; i < argc; i++) {
+    size_t size = strlen(argv[i]) + 1;
+    if (length + size + 1 > sizeof(message))
+      return 1;
+    memcpy(message + length, argv[i], size);
+    length += size;
+  }
+  message[length++] = '\0';
+
+  struct sketchybar_session session;
+  if (!sketchybar_session_begin(&session))
+    return 1;
+  bool sent = sketchybar_session_send(&session, message, length) != NULL;
+  sketchybar_session_end(&session);
+  return sent ? 0 : 1;
+}
+
+static void check_ipc(void) {
+  CHECK(send_sketchybar_trigger(3, -1, "Home:3"));
+  CHECK(bar_wait(1));
+  CHECK(g_bar_count == 3);
+}
+
+static void check_spawn(void) {
+  CHECK(spawn_sketchybar_trigger(5, 4096, "Home:5:4096"));
+  CHECK(bar_wait(1));
+  CHECK(g_bar_count == 5);
+}
+
+static void check_unchanged(struct trash_root *root) {
+  update_sketchybar_trash();
+  CHECK(bar_wait(1));
+  CHECK(g_bar_count == (int)root->entries.count);
+
+  update_sketchybar_trash();
+  CHECK(bar_quiet(50));
+
+  entry_set_add(&root->entries, "report.pdf");
+  update_sketchybar_trash();
+  CHECK(bar_wait(1));
+  CHECK(g_bar_count == (int)root->entries.count);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+enum path { PATH_IPC, PATH_SPAWN, PATH_SYSTEM };
+
+static void bench_path(const char *name, enum path path, int rounds) {
+  double *latency = calloc(rounds, sizeof(double));
+  for (int i = 0; i < rounds; i++) {
+    double start = check_now();
+    if (path == PATH_IPC) {
+      send_sketchybar_trigger(i, -1, "Home:1");
+    } else if (path == PATH_SPAWN) {
+      spawn_sketchybar_trigger(i, -1, "Home:1");
+    } else {
+      char command[128];
+      snprintf(command, sizeof(command),
+               "sketchybar --trigger trash_change TRASH_COUNT=%d "
+               "TRASH_VOLUMES=Home:1",
+               i);
+      if (system(command) != 0)
+        fprintf(stderr, "system() failed\n");
+    }
+    bar_wait(1);
+    latency[i] = check_now() - start;
+  }
+
+  qsort(latency, rounds, sizeof(double), compare_doubles);
+  double total = 0;
+  for (int i = 0; i < rounds; i++)
+    total += latency[i];
+  printf("%-8s %9.1f us mean %9.1f us p50 %9.1f us p99\n", name,
+         total * 1e6 / rounds, latency[rounds / 2] * 1e6,
+         latency[rounds * 99 / 100] * 1e6);
+  free(latency);
+}
+
+int main(int argc, char **argv) {
+  if (strcmp(basename(argv[0]), "sketchybar") == 0)
+    return act_as_sketchybar(argc, argv);
+
+  char dir[] = "/tmp/trash-test-XXXXXX";
+  char self[PATH_MAX], stub[PATH_MAX], path[PATH_MAX + 64];
+  if (!mkdtemp(dir) || !realpath(argv[0], self))
+    return 1;
+  snprintf(stub, sizeof(stub), "%s/sketchybar", dir);
+  if (symlink(self, stub) != 0)
+    return 1;
+  snprintf(path, sizeof(path), "%s:%s", dir, getenv("PATH"));
+  setenv("PATH", path, 1);
+  bar_begin(dir);
+
+  bool benchmark = argc > 1 && strcmp(argv[1], "--bench") == 0;
+  if (benchmark) {
+    bench_path("ipc", PATH_IPC, 2000);
+    bench_path("spawn", PATH_SPAWN, 200);
+    bench_path("system", PATH_SYSTEM, 200);
+  } else {
+    struct trash_root *root =
+        add_trash_root(g_roots, &g_root_count, dir, "Home");
+    entry_set_add(&root->entries, "notes.txt");
+    check_ipc();
+    check_spawn();
+    check_unchanged(root);
+  }
+
+  remove_tree(dir);
+  return benchmark ? 0 : check_exit("trash_trigger");
+}
@@ -0,0 +1,113 @@
+// Trash roots on several volumes, on the inotify backend: TRASH_VOLUMES
+// lists every volume with its own count, and a volume going away while files
+// keep arriving in another one switches the watched paths without losing any
+// of those files. Volumes are plain directories here; the loop runs in a
+// thread, and the switch happens on it like mounts_changed does.
+
+#include "monitor.h"
+
+#define ARRIVALS 2000
+
+static char g_dir[] = "/tmp/trash-test-XXXXXX";
+static char g_trash[3][64];
+static const char *const g_volumes[] = {"Home", "USB", "Backup"};
+
+static void *watch_thread(void *context) {
+  (void)context;
+  watcher_run(&g_watcher);
+  return NULL;
+}
+
+static void create(int volume, const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", g_trash[volume], name);
+  int fd = open(path, O_WRONLY | O_CREAT, 0600);
+  if (fd >= 0)
+    close(fd);
+}
+
+// Waits for a trash_change carrying exactly these volumes.
+static bool volumes_until(const char *volumes, double timeout) {
+  char expected[128];
+  snprintf(expected, sizeof(expected), " TRASH_VOLUMES=%s", volumes);
+  for (double start = check_now(); check_now() - start < timeout;) {
+    uint32_t count = bar_messages();
+    const char *last = count ? bar_message(count - 1) : "";
+    const char *found = strstr(last, expected);
+    if (found && (!found[strlen(expected)] || found[strlen(expected)] == ' '))
+      return true;
+    usleep(1000);
+  }
+  return false;
+}
+
+static void check_counts(void) {
+  create(0, "a");
+  create(1, "b");
+  create(1, "c");
+  CHECK(volumes_until("Home:1,USB:2,Backup:0", 2.0));
+  create(2, "d");
+  CHECK(volumes_until("Home:1,USB:2,Backup:1", 2.0));
+  CHECK(__atomic_load_n(&g_bar_count, __ATOMIC_RELAXED) == 4);
+}
+
+// What mounts_changed does once refresh_trash_roots dropped a volume.
+static void unmount_usb(void *context) {
+  (void)context;
+  entry_set_free(&g_roots[1].entries);
+  g_roots[1] = g_roots[2];
+  g_root_count = 2;
+  watch_trash_roots();
+  store_snapshot();
+  update_sketchybar();
+}
+
+static void *arrive(void *context) {
+  (void)context;
+  char name[32];
+  for (int i = 0; i < ARRIVALS; i++) {
+    snprintf(name, sizeof(name), "arrival-%d", i);
+    create(0, name);
+    if (i == ARRIVALS / 2)
+      watcher_post(&g_watcher, unmount_usb, NULL);
+  }
+  return NULL;
+}
+
+static void check_unmount(void) {
+  pthread_t thread;
+  pthread_create(&thread, NULL, arrive, NULL);
+  pthread_join(thread, NULL);
+  char volumes[64];
+  snprintf(volumes, sizeof(volumes), "Home:%d,Backup:1", ARRIVALS + 1);
+  CHECK(volumes_until(volumes, 5.0));
+  CHECK(__atomic_load_n(&g_bar_count, __ATOMIC_RELAXED) == ARRIVALS + 2);
+}
+
+int main(void) {
+  if (!mkdtemp(g_dir))
+    return 1;
+  bar_begin(g_dir);
+  for (int i = 0; i < 3; i++) {
+    snprintf(g_trash[i], sizeof(g_trash[i]), "%s/%s", g_dir, g_volumes[i]);
+    mkdir(g_trash[i], 0700);
+    struct trash_root *root =
+        add_trash_root(g_roots, &g_root_count, g_trash[i], g_volumes[i]);
+    root->path_len = strlen(root->path);
+  }
+  if (!watcher_begin(&g_watcher, trash_events, NULL, NULL, WATCH_LATENCY) ||
+      !watch_trash_roots()) {
+    fprintf(stderr, "could not watch %s\n", g_dir);
+    return 1;
+  }
+  update_sketchybar();
+  pthread_t thread;
+  pthread_create(&thread, NULL, watch_thread, NULL);
+  CHECK(volumes_until("Home:0,USB:0,Backup:0", 2.0));
+
+  check_counts();
+  check_unmount();
+
+  remove_tree(g_dir);
+  return check_exit("volume_roots");
+}
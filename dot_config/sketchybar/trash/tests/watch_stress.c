@@ -0,0 +1,135 @@
+// The monitor end to end on the inotify backend: the watcher loop runs in a
+// thread while files come and go in a temp trash, and the stand-in bar must
+// settle on the right count. Covers a root that does not exist yet, one that
+// is deleted and recreated, and a burst of 100k creates and deletes, which
+// overflows the inotify queue. With --bench, event-to-update latencies.
+
+#include "monitor.h"
+
+#define BURST 100000
+
+static char g_dir[] = "/tmp/trash-test-XXXXXX";
+static char g_trash[64];
+
+static void *watch_thread(void *context) {
+  (void)context;
+  watcher_run(&g_watcher);
+  return NULL;
+}
+
+// Seconds until the bar shows `count`, or -1 after `timeout`.
+static double bar_until(int count, double timeout) {
+  double start = check_now();
+  while (__atomic_load_n(&g_bar_count, __ATOMIC_RELAXED) != count) {
+    if (check_now() - start > timeout)
+      return -1;
+    usleep(100);
+  }
+  return check_now() - start;
+}
+
+static void create(const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", g_trash, name);
+  int fd = open(path, O_WRONLY | O_CREAT, 0600);
+  if (fd >= 0)
+    close(fd);
+}
+
+static void delete(const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", g_trash, name);
+  unlink(path);
+}
+
+// The root is missing at startup; its parent is watched until it appears.
+static void check_missing_root(void) {
+  mkdir(g_trash, 0700);
+  create("first");
+  CHECK(bar_until(1, 2.0) >= 0);
+}
+
+static void check_recreated_root(void) {
+  remove_tree(g_trash);
+  CHECK(bar_until(0, 2.0) >= 0);
+  mkdir(g_trash, 0700);
+  create("again");
+  create("and again");
+  CHECK(bar_until(2, 2.0) >= 0);
+}
+
+// Returns the time from the last create until the bar had the full count.
+static double burst(int base) {
+  char name[32];
+  for (int i = 0; i < BURST; i++) {
+    snprintf(name, sizeof(name), "burst-%d", i);
+    create(name);
+  }
+  double created = bar_until(base + BURST, 10.0);
+  CHECK(created >= 0);
+
+  for (int i = 0; i < BURST; i++) {
+    snprintf(name, sizeof(name), "burst-%d", i);
+    delete(name);
+  }
+  double deleted = bar_until(base, 10.0);
+  CHECK(deleted >= 0);
+  return created > deleted ? created : deleted;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// A single change after a quiet period, which goes out without waiting.
+static void bench_single(int base) {
+  double latency[50];
+  char name[32];
+  for (int i = 0; i < 50; i++) {
+    // Past the rate limit interval, so every change starts from idle.
+    usleep(300000);
+    snprintf(name, sizeof(name), "single-%d", i);
+    create(name);
+    latency[i] = bar_until(base + 1, 2.0);
+    delete(name);
+    bar_until(base, 2.0);
+  }
+  qsort(latency, 50, sizeof(double), compare_doubles);
+  printf("single change  %7.2f ms p50 %7.2f ms max\n", latency[25] * 1e3,
+         latency[49] * 1e3);
+}
+
+int main(int argc, char **argv) {
+  if (!mkdtemp(g_dir))
+    return 1;
+  snprintf(g_trash, sizeof(g_trash), "%s/Trash", g_dir);
+  bar_begin(g_dir);
+
+  struct trash_root *root =
+      add_trash_root(g_roots, &g_root_count, g_trash, "Home");
+  root->path_len = strlen(root->path);
+  if (!watcher_begin(&g_watcher, trash_events, NULL, NULL, WATCH_LATENCY) ||
+      !watch_trash_roots()) {
+    fprintf(stderr, "could not watch %s\n", g_trash);
+    return 1;
+  }
+  update_sketchybar();
+  pthread_t thread;
+  pthread_create(&thread, NULL, watch_thread, NULL);
+  CHECK(bar_until(0, 2.0) >= 0);
+
+  check_missing_root();
+  check_recreated_root();
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    bench_single(2);
+    double settled = burst(2);
+    printf("%d files     %7.2f ms until the bar settled\n", BURST,
+           settled * 1e3);
+  } else {
+    burst(2);
+  }
+
+  remove_tree(g_dir);
+  return argc > 1 ? 0 : check_exit("watch_stress");
+}
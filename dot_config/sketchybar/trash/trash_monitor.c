@@ -1,23 +1,48 @@
-#include <CoreServices/CoreServices.h>
 #include <dirent.h>
-#include <dispatch/dispatch.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <fts.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "dirscan.h"
+#include "rate_limit.h"
+#include "sketchybar.h"
+#include "watcher.h"
+
+#ifndef __APPLE__
+#include <mntent.h>
+#endif
+
+extern char **environ;
+
 // --- Global State ---
 static bool g_is_foreground = false;
-static FSEventStreamRef g_stream =
-    NULL; // Global reference to the stream for cleanup
+static struct watcher g_watcher; // Delivers trash changes in batches
 static int g_last_trash_count = -1; // Stores the last known count
+static long long g_last_trash_size = -1;
+static bool g_track_size = false; // --size: also report reclaimable bytes
+static const char *g_config_path = NULL; // --config: extra watched paths
+static const double WATCH_LATENCY = 0.03; // Coalescing window for events
+static const double WATCH_RETRY = 30.0; // Retry roots that could not be watched
 static int g_lock_fd = -1;          // Lock file descriptor
 static const char *LOCK_FILE = "/tmp/trash_monitor.lock";
+static const char *QUERY_SOCKET = "/tmp/trash_monitor.socket";
+static char g_last_volumes[384]; // Last TRASH_VOLUMES sent
+static int g_snapshot_count = -1; // Read by the query thread, atomically
+static long long g_snapshot_size = -1;
 
 // --- Single Instance Lock ---
 static bool acquire_lock(void) {
@@ -38,6 +63,7 @@ static bool acquire_lock(void) {
 
 static void release_lock(void) {
   if (g_lock_fd >= 0) {
+    unlink(QUERY_SOCKET);
     flock(g_lock_fd, LOCK_UN);
     close(g_lock_fd);
     unlink(LOCK_FILE);
@@ -56,151 +82,1631 @@ void log_to_terminal(const char *format, ...) {
   fflush(stdout);
 }
 
-int get_trash_count() {
+static bool is_counted_entry(const char *name) {
+  return dirscan_is_counted(name, strlen(name));
+}
+
+// --- Entry Set ---
+// The top-level trash entries, so FSEvents file events can adjust the count
+// without re-reading the whole directory. Open addressing with tombstones; a
+// NULL slot ends a probe, TOMBSTONE is skipped.
+struct trash_entry {
+  ino_t ino;
+  struct timespec mtime;
+  long long size;      // allocated bytes of the whole tree, -1 until measured
+  uint32_t invalidated; // stamp of the last invalidation, see entry_invalidate
+  bool seen;            // marks survivors during a rescan
+  bool directory;       // its size can change without its own stat changing
+  bool unwatched;       // some directory inside could not be watched
+  char name[];
+};
+
+static struct trash_entry TOMBSTONE[1];
+
+struct entry_set {
+  struct trash_entry **slots;
+  uint32_t capacity;
+  uint32_t count; // live entries
+  uint32_t used;  // live entries + tombstones
+};
+
+// --- Watches ---
+// Besides the trash, any directory listed in the --config file is watched on
+// the same stream and published as its own event. One watch per line:
+//   <event> <count|bytes|newest> <glob> <path>
+// e.g. "downloads_change count * ~/Downloads". Only top-level entries whose
+// name matches the glob are considered (dot files only when the glob starts
+// with a dot). Each change triggers <event> with COUNT=<n>, plus SIZE=<bytes>
+// or NEWEST=<name of the most recently modified entry>.
+enum watch_aggregate { WATCH_COUNT, WATCH_BYTES, WATCH_NEWEST };
+
+struct watch {
+  char event[64];
+  char filter[128];
+  char path[1024];
+  enum watch_aggregate aggregate;
+  bool published;
+  int last_count;
+  long long last_size;
+  char last_newest[256];
+};
+
+#define MAX_WATCHES 32
+
+static struct watch g_watches[MAX_WATCHES];
+static int g_watch_count = 0;
+
+// Reads the watches from a config file; blank lines and lines starting with
+// '#' are skipped, malformed ones are reported and ignored. An event names
+// one watch, so a later line with the same event is ignored too, as is
+// everything past MAX_WATCHES.
+static bool load_watches(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return false;
+
+  char line[1400];
+  int number = 0;
+  while (fgets(line, sizeof(line), file)) {
+    number++;
+    char *caret = line + strspn(line, " \t");
+    caret[strcspn(caret, "\r\n")] = '\0';
+    if (*caret == '\0' || *caret == '#')
+      continue;
+
+    struct watch watch = {0};
+    char aggregate[16];
+    int consumed = 0;
+    if (sscanf(caret, "%63s %15s %127s %n", watch.event, aggregate,
+               watch.filter, &consumed) != 3 ||
+        caret[consumed] == '\0') {
+      log_to_terminal("%s:%d: expected <event> <aggregate> <glob> <path>.\n",
+                      path, number);
+      continue;
+    }
+
+    if (strcmp(aggregate, "count") == 0)
+      watch.aggregate = WATCH_COUNT;
+    else if (strcmp(aggregate, "bytes") == 0)
+      watch.aggregate = WATCH_BYTES;
+    else if (strcmp(aggregate, "newest") == 0)
+      watch.aggregate = WATCH_NEWEST;
+    else {
+      log_to_terminal("%s:%d: unknown aggregate '%s'.\n", path, number,
+                      aggregate);
+      continue;
+    }
+
+    bool duplicate = false;
+    for (int i = 0; i < g_watch_count && !duplicate; i++)
+      duplicate = strcmp(g_watches[i].event, watch.event) == 0;
+    if (duplicate) {
+      log_to_terminal("%s:%d: '%s' is already watched.\n", path, number,
+                      watch.event);
+      continue;
+    }
+    if (g_watch_count == MAX_WATCHES) {
+      log_to_terminal("%s:%d: only %d watches are supported.\n", path,
+                      number, MAX_WATCHES);
+      break;
+    }
+
+    const char *target = caret + consumed;
+    if (target[0] == '~' && (target[1] == '/' || target[1] == '\0'))
+      snprintf(watch.path, sizeof(watch.path), "%s%s", getenv("HOME"),
+               target + 1);
+    else
+      snprintf(watch.path, sizeof(watch.path), "%s", target);
+    g_watches[g_watch_count++] = watch;
+  }
+  fclose(file);
+  return true;
+}
+
+// A watched directory and its entries: a trash root, or a configured watch.
+#define MAX_ROOTS (32 + MAX_WATCHES)
+
+struct trash_root {
+  char path[1024]; // canonical path FSEvents reports under
+  size_t path_len;
+  char volume[256];    // volume name, or the event name of a watch
+  struct watch *watch; // NULL for trash roots
+  struct entry_set entries;
+  long long size;
+  bool needs_scan;
+  bool replaying; // restored, and the events since are still being replayed
+};
+
+static struct trash_root g_roots[MAX_ROOTS];
+static int g_root_count = 0;
+
+// Whether a top-level name is part of the root's count.
+static bool root_accepts(const struct trash_root *root, const char *name) {
+  if (!root->watch)
+    return is_counted_entry(name);
+  return fnmatch(root->watch->filter, name, FNM_PERIOD) == 0;
+}
+
+// Entries are only stat'ed when something needs their inode and mtime: the
+// size cache, or a watch that reports the newest entry.
+static bool root_needs_stat(const struct trash_root *root) {
+  return root->watch ? root->watch->aggregate != WATCH_COUNT : g_track_size;
+}
+
+static bool root_needs_size(const struct trash_root *root) {
+  return root->watch ? root->watch->aggregate == WATCH_BYTES : g_track_size;
+}
+
+// Stamps are unique across roots, so a measurement that comes back for an
+// entry invalidated since (or for another root's entry) is recognised.
+static void entry_invalidate(struct trash_entry *entry) {
+  static uint32_t stamp = 0;
+  entry->size = -1;
+  entry->invalidated = ++stamp;
+}
+
+static uint32_t entry_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+  while (*name) {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static bool is_live(const struct trash_entry *entry) {
+  return entry && entry != TOMBSTONE;
+}
+
+static struct trash_entry **entry_set_find(struct entry_set *set,
+                                           const char *name) {
+  if (!set->capacity)
+    return NULL;
+  uint32_t mask = set->capacity - 1;
+  for (uint32_t i = entry_hash(name) & mask;; i = (i + 1) & mask) {
+    if (!set->slots[i])
+      return NULL;
+    if (is_live(set->slots[i]) && strcmp(set->slots[i]->name, name) == 0)
+      return &set->slots[i];
+  }
+}
+
+static void entry_set_place(struct entry_set *set, struct trash_entry *entry) {
+  uint32_t mask = set->capacity - 1;
+  uint32_t i = entry_hash(entry->name) & mask;
+  while (is_live(set->slots[i]))
+    i = (i + 1) & mask;
+  if (!set->slots[i])
+    set->used++;
+  set->slots[i] = entry;
+  set->count++;
+}
+
+// Grows the table, or just sweeps tombstones when it is mostly dead slots.
+static bool entry_set_reserve(struct entry_set *set) {
+  if ((set->used + 1) * 4 <= set->capacity * 3)
+    return true;
+
+  uint32_t capacity = set->capacity ? set->capacity : 256;
+  if (set->count * 2 >= capacity)
+    capacity *= 2;
+  struct trash_entry **slots = calloc(capacity, sizeof(*slots));
+  if (!slots)
+    return false;
+
+  struct entry_set old = *set;
+  *set = (struct entry_set){slots, capacity, 0, 0};
+  for (uint32_t i = 0; i < old.capacity; i++) {
+    if (is_live(old.slots[i]))
+      entry_set_place(set, old.slots[i]);
+  }
+  free(old.slots);
+  return true;
+}
+
+static struct trash_entry *entry_set_add(struct entry_set *set,
+                                         const char *name) {
+  struct trash_entry **slot = entry_set_find(set, name);
+  if (slot)
+    return *slot;
+
+  size_t length = strlen(name) + 1;
+  struct trash_entry *entry = calloc(1, sizeof(*entry) + length);
+  if (!entry || !entry_set_reserve(set)) {
+    free(entry);
+    return NULL;
+  }
+  memcpy(entry->name, name, length);
+  entry_invalidate(entry);
+  entry_set_place(set, entry);
+  return entry;
+}
+
+static void entry_set_drop(struct entry_set *set, struct trash_entry **slot) {
+  free(*slot);
+  *slot = TOMBSTONE;
+  set->count--;
+}
+
+// A cached size stays valid while the entry keeps its inode and mtime.
+static void entry_update_stat(struct trash_entry *entry, const struct stat *st) {
+#ifdef __APPLE__
+  struct timespec mtime = st->st_mtimespec;
+#else
+  struct timespec mtime = st->st_mtim;
+#endif
+  if (entry->ino != st->st_ino || entry->mtime.tv_sec != mtime.tv_sec ||
+      entry->mtime.tv_nsec != mtime.tv_nsec)
+    entry_invalidate(entry);
+  entry->ino = st->st_ino;
+  entry->mtime = mtime;
+  entry->directory = S_ISDIR(st->st_mode);
+}
+
+// Drops an entry along with the watches measuring it placed inside.
+static void root_drop_entry(struct trash_root *root,
+                            struct trash_entry **slot) {
+  char path[2048];
+  snprintf(path, sizeof(path), "%s/%s", root->path, (*slot)->name);
+  watcher_unwatch_below(&g_watcher, path);
+  entry_set_drop(&root->entries, slot);
+}
+
+#ifndef __APPLE__
+static void invalidate_directory_sizes(struct trash_root *root) {
+  struct entry_set *set = &root->entries;
+  for (uint32_t i = 0; i < set->capacity; i++) {
+    if (is_live(set->slots[i]) && set->slots[i]->directory)
+      entry_invalidate(set->slots[i]);
+  }
+}
+#endif
+
+// Full rescan; only needed when a root appears and when FSEvents lost events.
+// Entries that survive keep their cached sizes.
+struct rescan {
+  const struct trash_root *root;
+  struct entry_set *set;
+  int fd;
+};
+
+static void rescan_visit(void *context, const char *name, size_t length) {
+  (void)length;
+  struct rescan *rescan = context;
+  if (!root_accepts(rescan->root, name))
+    return;
+  struct trash_entry *entry = entry_set_add(rescan->set, name);
+  if (!entry)
+    return;
+  entry->seen = true;
+
+  struct stat st;
+  if (root_needs_stat(rescan->root) &&
+      fstatat(rescan->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+    entry_update_stat(entry, &st);
+}
+
+static void rescan_root(struct trash_root *root) {
+  struct entry_set *set = &root->entries;
+  root->replaying = false;
+  int fd = open(root->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    for (uint32_t i = 0; i < set->capacity; i++) {
+      if (is_live(set->slots[i]))
+        root_drop_entry(root, &set->slots[i]);
+    }
+    return;
+  }
+
+  for (uint32_t i = 0; i < set->capacity; i++) {
+    if (is_live(set->slots[i]))
+      set->slots[i]->seen = false;
+  }
+
+  struct rescan rescan = {root, set, fd};
+  dirscan(fd, rescan_visit, &rescan);
+  close(fd);
+#ifndef __APPLE__
+  // Nothing says whether a surviving directory changed inside.
+  invalidate_directory_sizes(root);
+#endif
+
+  for (uint32_t i = 0; i < set->capacity; i++) {
+    if (is_live(set->slots[i]) && !set->slots[i]->seen)
+      root_drop_entry(root, &set->slots[i]);
+  }
+}
+
+static void entry_set_free(struct entry_set *set) {
+  for (uint32_t i = 0; i < set->capacity; i++) {
+    if (is_live(set->slots[i]))
+      free(set->slots[i]);
+  }
+  free(set->slots);
+  *set = (struct entry_set){0};
+}
+
+// Splits an event path into the top-level entry it belongs to. Returns false
+// for paths outside the root; *nested is set for paths below an entry.
+static bool top_level_name(const struct trash_root *root, const char *path,
+                           char *name, size_t size, bool *nested) {
+  if (strncmp(path, root->path, root->path_len) != 0 ||
+      path[root->path_len] != '/')
+    return false;
+  const char *start = path + root->path_len + 1;
+  const char *slash = strchr(start, '/');
+  size_t length = slash ? (size_t)(slash - start) : strlen(start);
+  if (!length || length >= size)
+    return false;
+  memcpy(name, start, length);
+  name[length] = '\0';
+  *nested = slash != NULL;
+  return true;
+}
+
+// FSEvents coalesces flags (a create and remove of the same path can arrive
+// as one event), so the flags only say "look at this name" and lstat decides.
+// Changes below an entry only matter for its size.
+static void apply_trash_event(struct trash_root *root, const char *path,
+                              const char *name, bool nested,
+                              uint32_t flags) {
+  if (!root_accepts(root, name))
+    return;
+
+  if (nested) {
+    struct trash_entry **slot = entry_set_find(&root->entries, name);
+    if (slot)
+      entry_invalidate(*slot);
+    return;
+  }
+
+  const uint32_t entry_flags =
+      WATCHER_CREATED | WATCHER_REMOVED | WATCHER_RENAMED | WATCHER_MODIFIED;
+  if (!(flags & entry_flags))
+    return;
+
+  struct stat st;
+  if (lstat(path, &st) != 0) {
+    struct trash_entry **slot = entry_set_find(&root->entries, name);
+    if (slot)
+      root_drop_entry(root, slot);
+    return;
+  }
+  struct trash_entry *entry = entry_set_add(&root->entries, name);
+  if (entry && root_needs_stat(root))
+    entry_update_stat(entry, &st);
+}
+
+// --- Trash Roots ---
+static struct trash_root *add_trash_root(struct trash_root *roots, int *count,
+                                         const char *path,
+                                         const char *volume) {
+  struct trash_root *root = &roots[(*count)++];
+  *root = (struct trash_root){0};
+  // Watchers report resolved paths, so compare against the canonical form.
+  if (!realpath(path, root->path))
+    snprintf(root->path, sizeof(root->path), "%s", path);
+  snprintf(root->volume, sizeof(root->volume), "%s", volume);
+  return root;
+}
+
+static bool is_directory(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+#ifdef __APPLE__
+// The per-user trash of the home volume plus /Volumes/*/.Trashes/<uid> of
+// every mounted volume that has one. The boot volume's /Volumes alias is
+// skipped since its trash is ~/.Trash.
+static int discover_trash_roots(struct trash_root *roots, int max) {
   int count = 0;
   const char *home_path = getenv("HOME");
-  if (!home_path)
-    return 0;
+  if (home_path && count < max) {
+    char trash_path[1024];
+    snprintf(trash_path, sizeof(trash_path), "%s/.Trash", home_path);
+    add_trash_root(roots, &count, trash_path, "Home");
+  }
 
+  DIR *dir = opendir("/Volumes");
+  if (dir == NULL)
+    return count;
+
+  struct dirent *dirent;
+  while ((dirent = readdir(dir)) != NULL && count < max) {
+    if (dirent->d_name[0] == '.')
+      continue;
+
+    char mount_path[1024];
+    char resolved[1024];
+    snprintf(mount_path, sizeof(mount_path), "/Volumes/%s", dirent->d_name);
+    if (realpath(mount_path, resolved) && strcmp(resolved, "/") == 0)
+      continue;
+
+    char trash_path[1024];
+    snprintf(trash_path, sizeof(trash_path), "%s/.Trashes/%u", mount_path,
+             (unsigned)getuid());
+    if (is_directory(trash_path))
+      add_trash_root(roots, &count, trash_path, dirent->d_name);
+  }
+  closedir(dir);
+  return count;
+}
+#else
+// The freedesktop.org home trash ($XDG_DATA_HOME/Trash/files) plus
+// $topdir/.Trash-<uid>/files of removable media mounts that have one. Only
+// the usual removable mount points are probed to avoid waking automounts.
+static int discover_trash_roots(struct trash_root *roots, int max) {
+  int count = 0;
+  const char *data_home = getenv("XDG_DATA_HOME");
+  const char *home_path = getenv("HOME");
   char trash_path[1024];
-  snprintf(trash_path, sizeof(trash_path), "%s/.Trash", home_path);
+  if (data_home && *data_home)
+    snprintf(trash_path, sizeof(trash_path), "%s/Trash/files", data_home);
+  else if (home_path)
+    snprintf(trash_path, sizeof(trash_path), "%s/.local/share/Trash/files",
+             home_path);
+  else
+    trash_path[0] = '\0';
+  if (trash_path[0] && count < max)
+    add_trash_root(roots, &count, trash_path, "Home");
 
-  DIR *dir = opendir(trash_path);
-  if (dir == NULL)
+  FILE *mounts = setmntent("/proc/self/mounts", "r");
+  if (!mounts)
+    return count;
+
+  struct mntent *mount;
+  while ((mount = getmntent(mounts)) != NULL && count < max) {
+    const char *dir = mount->mnt_dir;
+    if (strncmp(dir, "/media/", 7) != 0 &&
+        strncmp(dir, "/run/media/", 11) != 0 && strncmp(dir, "/mnt/", 5) != 0)
+      continue;
+
+    snprintf(trash_path, sizeof(trash_path), "%s/.Trash-%u/files", dir,
+             (unsigned)getuid());
+    const char *volume = strrchr(dir, '/') + 1;
+    if (is_directory(trash_path))
+      add_trash_root(roots, &count, trash_path, volume);
+  }
+  endmntent(mounts);
+  return count;
+}
+#endif
+
+static int count_entries(const char *path) {
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
     return 0;
+  int count = (int)dirscan(fd, NULL, NULL);
+  close(fd);
+  return count;
+}
+
+// One-off total over every trash root, for '--count'.
+int get_trash_count() {
+  struct trash_root roots[MAX_ROOTS];
+  int root_count = discover_trash_roots(roots, MAX_ROOTS);
+  int count = 0;
+  for (int i = 0; i < root_count; i++)
+    count += count_entries(roots[i].path);
+  return count;
+}
+
+// --- Persistent State ---
+// Saved on shutdown and once a minute while events come in, so a restart
+// (or a crash) can resume from the last delivered event instead of rebuilding
+// everything. Per root the file holds the watcher history it was recorded
+// against and every entry with its cached size. Roots on the same path are
+// told apart by a key (the volume, or a watch's event and filter):
+//   header | path length, path, key length, key, history, entry count |
+//   entry, name ...
+#define STATE_MAGIC 0x32534d54u // "TMS2"
+#define STATE_HISTORY_SIZE 64
+static const double STATE_SAVE_INTERVAL = 60.0;
+
+struct state_header {
+  uint32_t magic;
+  uint32_t root_count;
+  uint64_t event_id;
+};
+
+struct state_entry {
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  uint32_t name_length; // excluding the NUL stored after the name
+  uint32_t reserved;
+};
+
+static char *g_state = NULL; // loaded at startup, freed once roots restored
+static size_t g_state_length = 0;
+static uint64_t g_state_saved_id = 0; // watcher_event_id as of the last save
+static bool g_state_dirty = false;    // events arrived since the last save
+
+static uint64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void state_path(char *path, size_t size) {
+#ifdef __APPLE__
+  snprintf(path, size, "%s/Library/Caches/trash_monitor.state",
+           getenv("HOME"));
+#else
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  if (cache_home && *cache_home)
+    snprintf(path, size, "%s/trash_monitor.state", cache_home);
+  else
+    snprintf(path, size, "%s/.cache/trash_monitor.state", getenv("HOME"));
+#endif
+}
+
+static void state_key(const struct trash_root *root, char *key,
+                      size_t size) {
+  if (root->watch)
+    snprintf(key, size, "%s %s", root->watch->event, root->watch->filter);
+  else
+    snprintf(key, size, "%s", root->volume);
+}
+
+static bool write_all(FILE *file, const void *data, size_t size) {
+  return fwrite(data, 1, size, file) == size;
+}
+
+static void save_state(void) {
+  char path[1024];
+  char temporary[1040];
+  state_path(path, sizeof(path));
+  snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+  g_state_saved_id = watcher_event_id(&g_watcher);
+  g_state_dirty = false;
+
+  FILE *file = fopen(temporary, "wb");
+  if (!file)
+    return;
+
+  struct state_header header = {STATE_MAGIC, (uint32_t)g_root_count,
+                                g_state_saved_id};
+  bool written = write_all(file, &header, sizeof(header));
+  for (int r = 0; written && r < g_root_count; r++) {
+    const struct trash_root *root = &g_roots[r];
+    const struct entry_set *set = &root->entries;
+    uint32_t path_length = (uint32_t)root->path_len;
+    char key[256];
+    state_key(root, key, sizeof(key));
+    uint32_t key_length = (uint32_t)strlen(key);
+    char history[STATE_HISTORY_SIZE] = {0};
+    watcher_history_id(root->path, history, sizeof(history));
+    written = write_all(file, &path_length, sizeof(path_length)) &&
+              write_all(file, root->path, path_length) &&
+              write_all(file, &key_length, sizeof(key_length)) &&
+              write_all(file, key, key_length) &&
+              write_all(file, history, sizeof(history)) &&
+              write_all(file, &set->count, sizeof(set->count));
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL) {
-    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
-        strcmp(entry->d_name, ".DS_Store") != 0) {
-      count++;
+    for (uint32_t i = 0; written && i < set->capacity; i++) {
+      const struct trash_entry *entry = set->slots[i];
+      if (!is_live(entry))
+        continue;
+      struct state_entry record = {entry->ino, entry->mtime.tv_sec,
+                                   entry->mtime.tv_nsec, entry->size,
+                                   (uint32_t)strlen(entry->name), 0};
+      written = write_all(file, &record, sizeof(record)) &&
+                write_all(file, entry->name, record.name_length + 1);
     }
   }
-  closedir(dir);
-  return count;
+
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temporary, path) != 0)
+    unlink(temporary);
+}
+
+static void load_state(void) {
+  char path[1024];
+  state_path(path, sizeof(path));
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return;
+
+  struct stat st;
+  if (fstat(fileno(file), &st) == 0 &&
+      st.st_size >= (off_t)sizeof(struct state_header) &&
+      (g_state = malloc(st.st_size))) {
+    g_state_length = fread(g_state, 1, st.st_size, file);
+    uint32_t magic;
+    memcpy(&magic, g_state, sizeof(magic));
+    if (g_state_length != (size_t)st.st_size || magic != STATE_MAGIC) {
+      free(g_state);
+      g_state = NULL;
+    }
+  }
+  fclose(file);
+}
+
+static bool state_read(size_t *caret, void *out, size_t size) {
+  if (size > g_state_length - *caret)
+    return false;
+  memcpy(out, g_state + *caret, size);
+  *caret += size;
+  return true;
+}
+
+// Restores a root's entries and cached sizes from the loaded state. Returns
+// true when they are current as of the saved event id in the same history,
+// in which case replaying the events since then is all that is left to do.
+static bool restore_root(struct trash_root *root) {
+  struct state_header header;
+  size_t caret = 0;
+  if (!g_state || !state_read(&caret, &header, sizeof(header)))
+    return false;
+  char key[256];
+  state_key(root, key, sizeof(key));
+
+  for (uint32_t r = 0; r < header.root_count; r++) {
+    uint32_t path_length;
+    uint32_t key_length;
+    uint32_t count;
+    char history[STATE_HISTORY_SIZE];
+    if (!state_read(&caret, &path_length, sizeof(path_length)) ||
+        path_length > g_state_length - caret)
+      return false;
+    bool match = path_length == root->path_len &&
+                 memcmp(g_state + caret, root->path, path_length) == 0;
+    caret += path_length;
+    if (!state_read(&caret, &key_length, sizeof(key_length)) ||
+        key_length > g_state_length - caret)
+      return false;
+    match = match && key_length == strlen(key) &&
+            memcmp(g_state + caret, key, key_length) == 0;
+    caret += key_length;
+    if (!state_read(&caret, history, sizeof(history)) ||
+        !state_read(&caret, &count, sizeof(count)))
+      return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+      struct state_entry record;
+      if (!state_read(&caret, &record, sizeof(record)) ||
+          record.name_length >= g_state_length - caret ||
+          g_state[caret + record.name_length] != '\0')
+        return false;
+      const char *name = g_state + caret;
+      caret += record.name_length + 1;
+      if (!match)
+        continue;
+
+      struct trash_entry *entry = entry_set_add(&root->entries, name);
+      if (!entry)
+        continue;
+      entry->ino = record.ino;
+      entry->mtime.tv_sec = record.mtime_sec;
+      entry->mtime.tv_nsec = record.mtime_nsec;
+      entry->size = record.size;
+    }
+
+    if (match) {
+      char current[STATE_HISTORY_SIZE];
+      history[sizeof(history) - 1] = '\0';
+      if (!header.event_id || !history[0] ||
+          !watcher_history_id(root->path, current, sizeof(current)) ||
+          strcmp(current, history) != 0)
+        return false;
+      g_watcher.since = header.event_id;
+      return true;
+    }
+  }
+  return false;
 }
 
+// Re-discovers the trash roots and appends the configured watches, carrying
+// entry sets over for roots that stayed. Returns true when the set of watched
+// paths changed.
+static bool refresh_trash_roots(void) {
+  struct trash_root roots[MAX_ROOTS];
+  int count = discover_trash_roots(roots, MAX_ROOTS - g_watch_count);
+  for (int w = 0; w < g_watch_count; w++) {
+    struct trash_root *root =
+        add_trash_root(roots, &count, g_watches[w].path, g_watches[w].event);
+    root->watch = &g_watches[w];
+  }
+  bool changed = count != g_root_count;
+
+  for (int i = 0; i < count; i++) {
+    roots[i].path_len = strlen(roots[i].path);
+    roots[i].needs_scan = true;
+    for (int j = 0; j < g_root_count; j++) {
+      if (g_roots[j].path_len && g_roots[j].watch == roots[i].watch &&
+          strcmp(g_roots[j].path, roots[i].path) == 0) {
+        roots[i].entries = g_roots[j].entries;
+        roots[i].replaying = g_roots[j].replaying;
+        roots[i].needs_scan = false;
+        g_roots[j].path_len = 0; // taken
+        break;
+      }
+    }
+    changed |= roots[i].needs_scan;
+  }
+
+  for (int j = 0; j < g_root_count; j++) {
+    if (g_roots[j].path_len)
+      entry_set_free(&g_roots[j].entries);
+  }
+
+  memcpy(g_roots, roots, sizeof(roots[0]) * count);
+  g_root_count = count;
+  for (int i = 0; i < count; i++) {
+    if (g_roots[i].needs_scan) {
+      log_to_terminal("Monitoring %s: %s (%s)\n",
+                      g_roots[i].watch ? "directory" : "trash directory",
+                      g_roots[i].path, g_roots[i].volume);
+      // Restored entries still get rescanned unless events can be replayed;
+      // the rescan keeps their cached sizes.
+      if ((g_roots[i].replaying = restore_root(&g_roots[i])))
+        log_to_terminal("Resuming from saved state.\n");
+      else
+        rescan_root(&g_roots[i]);
+      g_roots[i].needs_scan = false;
+    }
+  }
+  return changed;
+}
+
+static bool root_contains(const struct trash_root *root, const char *path) {
+  return strncmp(path, root->path, root->path_len) == 0 &&
+         (path[root->path_len] == '/' || path[root->path_len] == '\0');
+}
+
+// --- Size Accounting ---
+// Counts allocated blocks rather than apparent sizes, since that is what
+// emptying the trash gives back. Every directory is watched before its
+// children are read, so a change made during or after the walk invalidates
+// the entry again; *unwatched is set when some directory could not be.
+static long long measure_tree(const char *path, bool *unwatched) {
+  char *paths[] = {(char *)path, NULL};
+  FTS *fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR | FTS_XDEV, NULL);
+  if (!fts)
+    return 0;
+
+  long long total = 0;
+  FTSENT *node;
+  while ((node = fts_read(fts)) != NULL) {
+    switch (node->fts_info) {
+    case FTS_D:
+      if (!watcher_watch_below(&g_watcher, node->fts_path))
+        *unwatched = true;
+      // fall through
+    case FTS_F:
+    case FTS_SL:
+    case FTS_SLNONE:
+    case FTS_DEFAULT:
+      total += (long long)node->fts_statp->st_blocks * 512;
+      break;
+    default:
+      break;
+    }
+  }
+  fts_close(fts);
+  return total;
+}
+
+// Tasks own their paths, since the loop keeps changing the entry sets while
+// they are measured.
+struct size_task {
+  char *path; // root path, '/', entry name
+  size_t name_offset;
+  uint32_t invalidated; // the entry's stamp when the task was made
+  long long size;
+  bool unwatched;
+};
+
+struct size_job {
+  size_t count;
+  struct size_task tasks[];
+};
+
+static bool g_measuring = false; // a size_job is out
+
+static void measure_entry(void *context, size_t index) {
+  struct size_task *task = &((struct size_job *)context)->tasks[index];
+  task->size = measure_tree(task->path, &task->unwatched);
+}
+
+#ifndef __APPLE__
+// Stand-in for dispatch_apply_f: one worker per CPU pulling the next index,
+// which balances uneven trees the same way GCD does.
+struct apply_job {
+  size_t count;
+  size_t next;
+  void *context;
+  void (*work)(void *, size_t);
+};
+
+static void *apply_worker(void *argument) {
+  struct apply_job *job = argument;
+  size_t index;
+  while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+         job->count)
+    job->work(job->context, index);
+  return NULL;
+}
+
+static void apply_parallel(size_t count, void *context,
+                           void (*work)(void *, size_t)) {
+  struct apply_job job = {count, 0, context, work};
+  pthread_t threads[16];
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = cpus > 1 ? (size_t)cpus : 1;
+  if (workers > sizeof(threads) / sizeof(threads[0]))
+    workers = sizeof(threads) / sizeof(threads[0]);
+  if (workers > count)
+    workers = count;
+
+  size_t started = 0;
+  while (started < workers &&
+         pthread_create(&threads[started], NULL, apply_worker, &job) == 0)
+    started++;
+  apply_worker(&job);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+}
+#endif
+
+static void total_root_sizes(void) {
+  for (int r = 0; r < g_root_count; r++) {
+    struct entry_set *set = &g_roots[r].entries;
+    g_roots[r].size = 0;
+    if (!root_needs_size(&g_roots[r]))
+      continue;
+    for (uint32_t i = 0; i < set->capacity; i++) {
+      if (is_live(set->slots[i]) && set->slots[i]->size > 0)
+        g_roots[r].size += set->slots[i]->size;
+    }
+  }
+}
+
+static void request_update(void);
+
+// Back on the loop: results for entries that were invalidated (or dropped)
+// in the meantime are thrown away, and those are measured again with the
+// next update.
+static void sizes_measured(void *context) {
+  struct size_job *job = context;
+  for (size_t t = 0; t < job->count; t++) {
+    struct size_task *task = &job->tasks[t];
+    const char *name = task->path + task->name_offset;
+    for (int r = 0; r < g_root_count; r++) {
+      struct trash_root *root = &g_roots[r];
+      if (!root_needs_size(root) || root->path_len + 1 != task->name_offset ||
+          strncmp(root->path, task->path, root->path_len) != 0)
+        continue;
+      struct trash_entry **slot = entry_set_find(&root->entries, name);
+      if (slot && (*slot)->invalidated == task->invalidated) {
+        (*slot)->size = task->size;
+        (*slot)->unwatched = task->unwatched;
+      }
+    }
+    free(task->path);
+  }
+  free(job);
+  g_measuring = false;
+  request_update();
+}
+
+static void measure_job(void *context) {
+  struct size_job *job = context;
+#ifdef __APPLE__
+  dispatch_apply_f(job->count, dispatch_get_global_queue(QOS_CLASS_UTILITY, 0),
+                   job, measure_entry);
+#else
+  apply_parallel(job->count, job, measure_entry);
+#endif
+  watcher_post(&g_watcher, sizes_measured, job);
+}
+
+#ifndef __APPLE__
+static void *measure_thread(void *context) {
+  measure_job(context);
+  return NULL;
+}
+#endif
+
+// Walks only entries without a valid cached size, off the loop: the walks are
+// spread over the global concurrent queue (GCD balances the uneven trees
+// across its workers) and sizes_measured posts the results back. Roots keep
+// their last totals until then; with nothing left to measure, every root
+// that reports bytes is totalled.
+static void measure_trash_roots(void) {
+  if (g_measuring)
+    return;
+  size_t pending = 0;
+  for (int r = 0; r < g_root_count; r++) {
+    struct entry_set *set = &g_roots[r].entries;
+    for (uint32_t i = 0; root_needs_size(&g_roots[r]) && i < set->capacity;
+         i++)
+      pending += is_live(set->slots[i]) && set->slots[i]->size < 0;
+  }
+  if (!pending) {
+    total_root_sizes();
+    return;
+  }
+
+  struct size_job *job =
+      calloc(1, sizeof(*job) + pending * sizeof(job->tasks[0]));
+  for (int r = 0; job && r < g_root_count; r++) {
+    const struct trash_root *root = &g_roots[r];
+    const struct entry_set *set = &root->entries;
+    for (uint32_t i = 0; root_needs_size(root) && i < set->capacity; i++) {
+      const struct trash_entry *entry = set->slots[i];
+      if (!is_live(entry) || entry->size >= 0)
+        continue;
+      struct size_task *task = &job->tasks[job->count];
+      size_t length = root->path_len + strlen(entry->name) + 2;
+      if (!(task->path = malloc(length)))
+        continue;
+      snprintf(task->path, length, "%s/%s", root->path, entry->name);
+      task->name_offset = root->path_len + 1;
+      task->invalidated = entry->invalidated;
+      job->count++;
+    }
+  }
+  if (!job || !job->count) {
+    free(job);
+    return;
+  }
+
+  log_to_terminal("Measuring %zu entries...\n", job->count);
+  g_measuring = true;
+#ifdef __APPLE__
+  dispatch_async_f(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), job,
+                   measure_job);
+#else
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, measure_thread, job) == 0)
+    pthread_detach(thread);
+  else
+    measure_job(job);
+#endif
+}
+
+// --- Bar Updates ---
+// Used only when the bar cannot be reached over IPC (e.g. it is restarting);
+// resolves sketchybar through PATH instead of a hard-coded Homebrew prefix.
+// The monitor blocks or ignores the signals it handles on its loop; the
+// child gets them back with their default actions.
+static bool spawn_sketchybar(char *const argv[]) {
+  posix_spawnattr_t attributes;
+  if (posix_spawnattr_init(&attributes) != 0)
+    return false;
+  sigset_t signals;
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attributes, &signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attributes, &signals);
+  posix_spawnattr_setflags(&attributes,
+                           POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  // launchd hands agents a PATH without Homebrew's prefixes, so fall back to
+  // where Homebrew installs sketchybar before giving up.
+  static const char *const fallbacks[] = {"/opt/homebrew/bin/sketchybar",
+                                          "/usr/local/bin/sketchybar"};
+  pid_t pid;
+  int spawned =
+      posix_spawnp(&pid, "sketchybar", NULL, &attributes, argv, environ);
+  for (size_t i = 0;
+       spawned == ENOENT && i < sizeof(fallbacks) / sizeof(*fallbacks); i++)
+    spawned = posix_spawn(&pid, fallbacks[i], NULL, &attributes, argv, environ);
+  posix_spawnattr_destroy(&attributes);
+  if (spawned != 0) {
+    static bool logged = false;
+    if (!logged)
+      fprintf(stderr, "trash_monitor: cannot spawn sketchybar: %s\n",
+              strerror(spawned));
+    logged = true;
+    return false;
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool spawn_sketchybar_trigger(int count, long long size,
+                                     const char *volumes) {
+  char count_arg[32];
+  char size_arg[40];
+  char volumes_arg[sizeof(g_last_volumes) + 16];
+  snprintf(count_arg, sizeof(count_arg), "TRASH_COUNT=%d", count);
+  snprintf(size_arg, sizeof(size_arg), "TRASH_SIZE=%lld", size);
+  snprintf(volumes_arg, sizeof(volumes_arg), "TRASH_VOLUMES=%s", volumes);
+  char *argv[] = {"sketchybar",  "--trigger",
+                  "trash_change", count_arg,
+                  volumes_arg,   size < 0 ? NULL : size_arg,
+                  NULL};
+  return spawn_sketchybar(argv);
+}
+
+static bool send_sketchybar_trigger(int count, long long size,
+                                    const char *volumes) {
+  static struct sketchybar_template trigger;
+  static struct sketchybar_template sized_trigger;
+  static bool compiled = false;
+  if (!compiled) {
+    compiled = SKETCHYBAR_TEMPLATE(&trigger,
+                                   "--trigger trash_change TRASH_COUNT=%d "
+                                   "TRASH_VOLUMES=%s",
+                                   0, "") &&
+               SKETCHYBAR_TEMPLATE(&sized_trigger,
+                                   "--trigger trash_change TRASH_COUNT=%d "
+                                   "TRASH_VOLUMES=%s TRASH_SIZE=%d",
+                                   0, "", 0);
+  }
+
+  struct sketchybar_session *session = sketchybar_thread_session();
+  struct sketchybar_template *template = size < 0 ? &trigger : &sized_trigger;
+  if (!compiled || !session ||
+      !sketchybar_template_set_int(template, 0, count) ||
+      !sketchybar_template_set_string(template, 1, volumes) ||
+      (size >= 0 && !sketchybar_template_set_int(template, 2, size)))
+    return false;
+  return sketchybar_template_push(session, template);
+}
+
+// Publishes the totals plus TRASH_VOLUMES, a comma separated list of
+// volume:count (volume:count:bytes with --size) for every trash root.
 void update_sketchybar_trash() {
-  int count = get_trash_count();
+  int count = 0;
+  long long size = g_track_size ? 0 : -1;
+  char volumes[sizeof(g_last_volumes)];
+  size_t caret = 0;
+  volumes[0] = '\0';
+  for (int i = 0; i < g_root_count; i++) {
+    const struct trash_root *root = &g_roots[i];
+    if (root->watch)
+      continue;
+    count += (int)root->entries.count;
+    if (g_track_size)
+      size += root->size;
 
-  // Only update if the count has changed
-  if (count == g_last_trash_count) {
+    int written =
+        g_track_size
+            ? snprintf(volumes + caret, sizeof(volumes) - caret, "%s%s:%u:%lld",
+                       caret ? "," : "", root->volume, root->entries.count,
+                       root->size)
+            : snprintf(volumes + caret, sizeof(volumes) - caret, "%s%s:%u",
+                       caret ? "," : "", root->volume, root->entries.count);
+    if (written < 0 || (size_t)written >= sizeof(volumes) - caret)
+      break;
+    caret += written;
+  }
+  volumes[caret] = '\0';
+
+  // Only update if something has changed
+  if (count == g_last_trash_count && size == g_last_trash_size &&
+      strcmp(volumes, g_last_volumes) == 0) {
     log_to_terminal("Trash count unchanged (%d), skipping update.\n", count);
     return;
   }
 
   g_last_trash_count = count; // Update the last known count
+  g_last_trash_size = size;
+  __atomic_store_n(&g_snapshot_size, size, __ATOMIC_RELEASE);
+  memcpy(g_last_volumes, volumes, caret + 1);
+
+  if (send_sketchybar_trigger(count, size, volumes)) {
+    log_to_terminal("Sent trash_change (TRASH_COUNT=%d, TRASH_SIZE=%lld, "
+                    "TRASH_VOLUMES=%s).\n",
+                    count, size, volumes);
+    return;
+  }
+
+  log_to_terminal("IPC to sketchybar failed, spawning sketchybar instead.\n");
+  if (!spawn_sketchybar_trigger(count, size, volumes)) {
+    log_to_terminal("Fallback trigger failed.\n");
+  }
+}
+
+static const char *newest_entry(const struct entry_set *set) {
+  const struct trash_entry *newest = NULL;
+  for (uint32_t i = 0; i < set->capacity; i++) {
+    const struct trash_entry *entry = set->slots[i];
+    if (is_live(entry) &&
+        (!newest || entry->mtime.tv_sec > newest->mtime.tv_sec ||
+         (entry->mtime.tv_sec == newest->mtime.tv_sec &&
+          entry->mtime.tv_nsec > newest->mtime.tv_nsec)))
+      newest = entry;
+  }
+  return newest ? newest->name : "";
+}
 
-  char command[512];
-  const char *sketchybar_path = "/opt/homebrew/bin/sketchybar";
-  snprintf(command, sizeof(command),
-           "'%s' --trigger trash_change TRASH_COUNT=%d", sketchybar_path,
-           count);
-
-  log_to_terminal("Executing command: %s\n", command);
-  int result = system(command);
-
-  if (result != 0) {
-    log_to_terminal("Command may have failed with exit code %d\n", result);
-  } else {
-    log_to_terminal("Command executed.\n");
-  }
-}
-
-void fsevents_callback(ConstFSEventStreamRef streamRef,
-                       void *clientCallBackInfo, size_t numEvents,
-                       void *eventPaths,
-                       const FSEventStreamEventFlags eventFlags[],
-                       const FSEventStreamEventId eventIds[]) {
-  (void)streamRef;
-  (void)clientCallBackInfo;
-  (void)numEvents;
-  (void)eventPaths;
-  (void)eventFlags;
-  (void)eventIds;
-  log_to_terminal(
-      "FSEvents callback triggered. Checking for trash changes...\n");
+static bool spawn_watch_trigger(const struct watch *watch, int count,
+                                long long size, const char *newest) {
+  char count_arg[32];
+  char value_arg[sizeof(watch->last_newest) + 16];
+  snprintf(count_arg, sizeof(count_arg), "COUNT=%d", count);
+  if (watch->aggregate == WATCH_BYTES)
+    snprintf(value_arg, sizeof(value_arg), "SIZE=%lld", size);
+  else
+    snprintf(value_arg, sizeof(value_arg), "NEWEST=%s", newest);
+  char *argv[] = {"sketchybar", "--trigger", (char *)watch->event, count_arg,
+                  watch->aggregate == WATCH_COUNT ? NULL : value_arg, NULL};
+  return spawn_sketchybar(argv);
+}
+
+static bool send_watch_trigger(const struct watch *watch, int count,
+                               long long size, const char *newest) {
+  static struct sketchybar_template triggers[3];
+  static bool compiled = false;
+  if (!compiled) {
+    compiled =
+        SKETCHYBAR_TEMPLATE(&triggers[WATCH_COUNT], "--trigger %s COUNT=%d",
+                            "", 0) &&
+        SKETCHYBAR_TEMPLATE(&triggers[WATCH_BYTES],
+                            "--trigger %s COUNT=%d SIZE=%d", "", 0, 0) &&
+        SKETCHYBAR_TEMPLATE(&triggers[WATCH_NEWEST],
+                            "--trigger %s COUNT=%d NEWEST=%s", "", 0, "");
+  }
+
+  struct sketchybar_session *session = sketchybar_thread_session();
+  struct sketchybar_template *template = &triggers[watch->aggregate];
+  if (!compiled || !session ||
+      !sketchybar_template_set_string(template, 0, watch->event) ||
+      !sketchybar_template_set_int(template, 1, count) ||
+      (watch->aggregate == WATCH_BYTES &&
+       !sketchybar_template_set_int(template, 2, size)) ||
+      (watch->aggregate == WATCH_NEWEST &&
+       !sketchybar_template_set_string(template, 2, newest)))
+    return false;
+  return sketchybar_template_push(session, template);
+}
+
+// Publishes every configured watch whose count or aggregate changed.
+static void update_sketchybar_watches(void) {
+  for (int i = 0; i < g_root_count; i++) {
+    const struct trash_root *root = &g_roots[i];
+    struct watch *watch = root->watch;
+    if (!watch)
+      continue;
+
+    int count = (int)root->entries.count;
+    long long size = watch->aggregate == WATCH_BYTES ? root->size : -1;
+    const char *newest =
+        watch->aggregate == WATCH_NEWEST ? newest_entry(&root->entries) : "";
+    if (watch->published && count == watch->last_count &&
+        size == watch->last_size && strcmp(newest, watch->last_newest) == 0)
+      continue;
+
+    watch->published = true;
+    watch->last_count = count;
+    watch->last_size = size;
+    snprintf(watch->last_newest, sizeof(watch->last_newest), "%s", newest);
+
+    if (send_watch_trigger(watch, count, size, watch->last_newest)) {
+      log_to_terminal("Sent %s (COUNT=%d).\n", watch->event, count);
+      continue;
+    }
+    log_to_terminal("IPC to sketchybar failed, spawning sketchybar instead.\n");
+    if (!spawn_watch_trigger(watch, count, size, watch->last_newest))
+      log_to_terminal("Fallback trigger failed.\n");
+  }
+}
+
+static void update_sketchybar(void) {
+  measure_trash_roots();
+  update_sketchybar_watches();
   update_sketchybar_trash();
 }
 
-void signal_handler(int signum) {
-  log_to_terminal("\nSignal %d received, shutting down...\n", signum);
-  if (g_stream) {
-    FSEventStreamStop(g_stream);
-    FSEventStreamInvalidate(g_stream);
-    FSEventStreamRelease(g_stream);
+// --- Queries ---
+// The daemon answers "count" and "size" on a Unix socket from the state it
+// already holds, so '--count' does not have to rescan every trash directory.
+// The query thread only reads the snapshot, which the main loop refreshes
+// after every change (the size whenever it is published). Like the bar's
+// socket it lives in /tmp, so it is only open to its owner, and both ends
+// check that the other runs as the same user.
+static void store_snapshot(void) {
+  int count = 0;
+  for (int i = 0; i < g_root_count; i++) {
+    if (!g_roots[i].watch)
+      count += (int)g_roots[i].entries.count;
   }
-  release_lock();
-  exit(0);
+  __atomic_store_n(&g_snapshot_count, count, __ATOMIC_RELEASE);
 }
 
-int main(int argc, char **argv) {
-  // If called with '--count', it prints the number of items and exits.
-  if (argc > 1 && strcmp(argv[1], "--count") == 0) {
-    printf("%d", get_trash_count());
-    return 0;
+static void answer_query(int fd) {
+  struct timeval timeout = {0, 100000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  char request[16] = {0};
+  ssize_t length = recv(fd, request, sizeof(request) - 1, 0);
+  if (length <= 0)
+    return;
+
+  char reply[32];
+  if (strncmp(request, "size", 4) == 0)
+    snprintf(reply, sizeof(reply), "%lld",
+             __atomic_load_n(&g_snapshot_size, __ATOMIC_ACQUIRE));
+  else
+    snprintf(reply, sizeof(reply), "%d",
+             __atomic_load_n(&g_snapshot_count, __ATOMIC_ACQUIRE));
+  send(fd, reply, strlen(reply), 0);
+}
+
+static void *query_server(void *argument) {
+  int server = (int)(intptr_t)argument;
+  for (;;) {
+    int fd = accept(server, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return NULL;
+    }
+    if (socket_peer_is_user(fd))
+      answer_query(fd);
+    close(fd);
   }
+}
 
-  if (!acquire_lock()) {
-    return 0;
+static bool start_query_server(void) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", QUERY_SOCKET);
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0)
+    return false;
+  fcntl(server, F_SETFD, FD_CLOEXEC);
+
+  // Holding the lock means any existing socket file is stale. Nobody can
+  // connect before listen, so the mode is tightened in between.
+  unlink(QUERY_SOCKET);
+  pthread_t thread;
+  if (bind(server, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      chmod(QUERY_SOCKET, 0600) < 0 || listen(server, 16) < 0 ||
+      pthread_create(&thread, NULL, query_server, (void *)(intptr_t)server)) {
+    close(server);
+    return false;
   }
+  pthread_detach(thread);
+  return true;
+}
 
-  g_is_foreground = isatty(STDOUT_FILENO);
+// Asks a running daemon; returns false when none answers.
+static bool query_daemon(const char *request, char *reply, size_t size) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", QUERY_SOCKET);
 
-  signal(SIGINT, signal_handler);  // Catch CTRL+C
-  signal(SIGTERM, signal_handler); // Catch kill command
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  struct timeval timeout = {0, 100000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-  log_to_terminal("Trash monitor starting up...\n");
+  bool answered = false;
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+      socket_peer_is_user(fd) &&
+      send(fd, request, strlen(request), 0) == (ssize_t)strlen(request)) {
+    size_t caret = 0;
+    ssize_t length;
+    while (caret + 1 < size &&
+           (length = recv(fd, reply + caret, size - 1 - caret, 0)) > 0)
+      caret += length;
+    reply[caret] = '\0';
+    // A daemon that is still starting up has no snapshot yet.
+    answered = caret > 0 && reply[0] != '-';
+  }
+  close(fd);
+  return answered;
+}
 
-  const char *home_path = getenv("HOME");
-  if (!home_path) {
-    log_to_terminal("FATAL: HOME environment variable not set.\n");
-    return 1;
+// --- Rate Limiting ---
+// See rate_limit.h; updates are published on the watcher's loop.
+static void publish_update(void *context) {
+  (void)context;
+  update_sketchybar();
+}
+
+static void flush_update(void *context);
+
+static void schedule_flush(void *context, uint64_t wait_ns) {
+  (void)context;
+  watcher_after(&g_watcher, wait_ns / 1e9, flush_update, NULL);
+}
+
+static struct rate_limit g_rate_limit = {
+    250000000ull, 0, false, publish_update, schedule_flush, NULL};
+
+static void flush_update(void *context) {
+  (void)context;
+  rate_limit_flush(&g_rate_limit, monotonic_ns());
+}
+
+static void request_update(void) {
+  rate_limit_request(&g_rate_limit, monotonic_ns());
+}
+
+static bool watch_trash_roots(void);
+
+#ifndef __APPLE__
+// Measuring watches every directory inside an entry, so writes deep inside
+// invalidate just that entry. Only entries where some directory could not be
+// watched (the inotify watch limit) are re-measured every SIZE_REFRESH
+// seconds instead, which makes their share of the size approximate for that
+// long.
+static const double SIZE_REFRESH = 60.0;
+
+static bool sizes_needed(void) {
+  for (int r = 0; r < g_root_count; r++) {
+    if (root_needs_size(&g_roots[r]))
+      return true;
   }
+  return false;
+}
 
-  char trash_path[1024];
-  snprintf(trash_path, sizeof(trash_path), "%s/.Trash", home_path);
+static void refresh_sizes(void *context) {
+  (void)context;
+  bool invalidated = false;
+  for (int r = 0; r < g_root_count; r++) {
+    struct entry_set *set = &g_roots[r].entries;
+    for (uint32_t i = 0; root_needs_size(&g_roots[r]) && i < set->capacity;
+         i++) {
+      struct trash_entry *entry = set->slots[i];
+      if (is_live(entry) && entry->unwatched && entry->size >= 0) {
+        entry_invalidate(entry);
+        invalidated = true;
+      }
+    }
+  }
+  if (invalidated)
+    request_update();
+  if (sizes_needed())
+    watcher_after(&g_watcher, SIZE_REFRESH, refresh_sizes, NULL);
+}
+#endif
 
-  CFStringRef path_to_watch = CFStringCreateWithCString(
-      kCFAllocatorDefault, trash_path, kCFStringEncodingUTF8);
-  if (!path_to_watch) {
-    log_to_terminal("FATAL: Could not create CFString for path.\n");
-    return 1;
+static bool roots_replaying(void) {
+  for (int r = 0; r < g_root_count; r++) {
+    if (g_roots[r].replaying)
+      return true;
   }
+  return false;
+}
 
-  CFArrayRef pathsToWatch = CFArrayCreate(NULL, (const void **)&path_to_watch,
-                                          1, &kCFTypeArrayCallBacks);
-  CFRelease(path_to_watch);
+struct tally {
+  const struct trash_root *root;
+  uint32_t count;
+};
 
-  if (!pathsToWatch) {
-    log_to_terminal("FATAL: Could not create CFArray for paths.\n");
-    return 1;
+// dirscan may report a name twice; that only costs a needless rescan.
+static void tally_visit(void *context, const char *name, size_t length) {
+  (void)length;
+  struct tally *tally = context;
+  tally->count += root_accepts(tally->root, name);
+}
+
+// A resumed root holds its restored entries plus every replayed event, which
+// should add up to what is on disk now. Checked once per resume, when the
+// replay is done; a root that does not add up is rescanned.
+static void reconcile_roots(void) {
+  for (int r = 0; r < g_root_count; r++) {
+    struct trash_root *root = &g_roots[r];
+    if (!root->replaying)
+      continue;
+    root->replaying = false;
+    struct tally tally = {root, 0};
+    int fd = open(root->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+      dirscan(fd, tally_visit, &tally);
+      close(fd);
+    }
+    if (tally.count != root->entries.count) {
+      log_to_terminal("Replay left %s at %u entries, %u on disk; "
+                      "rescanning.\n",
+                      root->path, root->entries.count, tally.count);
+      rescan_root(root);
+    }
   }
+}
 
-  FSEventStreamContext context = {0, NULL, NULL, NULL, NULL};
-  g_stream = FSEventStreamCreate( // Assign to global stream
-      kCFAllocatorDefault, fsevents_callback, &context, pathsToWatch,
-      kFSEventStreamEventIdSinceNow, 1.0, kFSEventStreamCreateFlagFileEvents);
+static void trash_events(void *context, const struct watcher_event *events,
+                         size_t count) {
+  (void)context;
+  log_to_terminal("Watcher delivered %zu events.\n", count);
 
-  CFRelease(pathsToWatch);
+  // A root that was deleted or moved lost its watch; watch it again (or its
+  // parent until it is back) before scanning, so nothing falls in between.
+  bool history_done = false;
+  for (size_t i = 0; i < count; i++) {
+    if (events[i].flags & WATCHER_ROOT_CHANGED) {
+      watch_trash_roots();
+      break;
+    }
+  }
+  for (size_t i = 0; i < count; i++)
+    history_done |= (events[i].flags & WATCHER_HISTORY_DONE) != 0;
+
+  for (size_t i = 0; i < count; i++) {
+    // Several roots may share a path (watches with different filters), and
+    // a watch may sit inside another root, so every containing root sees it.
+    const uint32_t flags = events[i].flags;
+    bool root_changed = false;
+    for (int r = 0; r < g_root_count; r++) {
+      struct trash_root *root = &g_roots[r];
+      if (!root_contains(root, events[i].path))
+        continue;
+      // A root change only affects its own root; lost events may span roots.
+      if (flags & WATCHER_ROOT_CHANGED) {
+        rescan_root(root);
+        root_changed = true;
+        continue;
+      }
+
+      char name[1024];
+      bool nested;
+      if (!(flags & WATCHER_RESCAN) &&
+          top_level_name(root, events[i].path, name, sizeof(name), &nested))
+        apply_trash_event(root, events[i].path, name, nested, flags);
+    }
+    if (!root_changed && (flags & (WATCHER_RESCAN | WATCHER_ROOT_CHANGED))) {
+      log_to_terminal("Events were dropped, rescanning all roots.\n");
+      for (int r = 0; r < g_root_count; r++)
+        rescan_root(&g_roots[r]);
+      break;
+    }
+  }
+  if (history_done)
+    reconcile_roots();
+  g_state_dirty = true;
+  store_snapshot();
+  // A replay goes out once it is complete, not one batch at a time.
+  if (!roots_replaying())
+    request_update();
+}
+
+static void retry_watch(void *context);
 
-  if (!g_stream) {
-    log_to_terminal("FATAL: Failed to create FSEventStream.\n");
+// Returns false, and retries later, while some root cannot be watched at all.
+static bool watch_trash_roots(void) {
+  const char *paths[MAX_ROOTS];
+  int count = 0;
+  for (int i = 0; i < g_root_count; i++) {
+    bool duplicate = false;
+    for (int j = 0; j < count && !duplicate; j++)
+      duplicate = strcmp(paths[j], g_roots[i].path) == 0;
+    if (!duplicate)
+      paths[count++] = g_roots[i].path;
+  }
+  if (watcher_set_paths(&g_watcher, paths, count))
+    return true;
+  watcher_after(&g_watcher, WATCH_RETRY, retry_watch, NULL);
+  return false;
+}
+
+// Anything may have happened in the roots that were not watched.
+static void retry_watch(void *context) {
+  (void)context;
+  if (!watch_trash_roots())
+    return;
+  log_to_terminal("All roots are watched again.\n");
+  for (int r = 0; r < g_root_count; r++)
+    rescan_root(&g_roots[r]);
+  store_snapshot();
+  request_update();
+}
+
+static void mounts_changed(void *context) {
+  (void)context;
+  if (!refresh_trash_roots())
+    return;
+  log_to_terminal("Volumes changed, now watching %d roots.\n", g_root_count);
+  watch_trash_roots();
+  store_snapshot();
+  update_sketchybar();
+#ifndef __APPLE__
+  if (sizes_needed())
+    watcher_after(&g_watcher, SIZE_REFRESH, refresh_sizes, NULL);
+#endif
+}
+
+static void save_state_later(void *context) {
+  (void)context;
+  if (g_state_dirty || watcher_event_id(&g_watcher) != g_state_saved_id)
+    save_state();
+  watcher_after(&g_watcher, STATE_SAVE_INTERVAL, save_state_later, NULL);
+}
+
+// Runs on the watcher's loop, not in a signal handler, so saving the state
+// may allocate and take locks.
+static void shut_down(void *context, int signum) {
+  (void)context;
+  log_to_terminal("\nSignal %d received, shutting down...\n", signum);
+  save_state();
+  watcher_end(&g_watcher);
+  release_lock();
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  // If called with '--count', it prints the number of items and exits. The
+  // running daemon answers from memory; without one the trash is scanned.
+  if (argc > 1 && strcmp(argv[1], "--count") == 0) {
+    char reply[32];
+    if (query_daemon("count", reply, sizeof(reply)))
+      printf("%s", reply);
+    else
+      printf("%d", get_trash_count());
+    return 0;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--size") == 0) {
+      // Also report reclaimable bytes as TRASH_SIZE.
+      g_track_size = true;
+    } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+      // Extra directories to publish as their own events (see Watches).
+      g_config_path = argv[++i];
+    } else if (strcmp(argv[i], "--max-rate") == 0 && i + 1 < argc) {
+      // Upper bound on trash_change events per second during bursts.
+      double rate = atof(argv[++i]);
+      if (rate > 0)
+        g_rate_limit.interval_ns = (uint64_t)(1e9 / rate);
+    }
+  }
+
+  if (!acquire_lock()) {
+    return 0;
+  }
+
+  g_is_foreground = isatty(STDOUT_FILENO);
+
+  signal(SIGPIPE, SIG_IGN); // Query clients may hang up early
+
+  log_to_terminal("Trash monitor starting up...\n");
+
+  if (!getenv("HOME")) {
+    log_to_terminal("FATAL: HOME environment variable not set.\n");
     return 1;
   }
 
-  FSEventStreamSetDispatchQueue(g_stream, dispatch_get_main_queue());
-  if (!FSEventStreamStart(g_stream)) {
-    log_to_terminal("FATAL: Failed to start FSEventStream.\n");
-    FSEventStreamInvalidate(g_stream);
-    FSEventStreamRelease(g_stream);
+  if (!watcher_begin(&g_watcher, trash_events, mounts_changed, NULL,
+                     WATCH_LATENCY)) {
+    log_to_terminal("FATAL: Could not create the file watcher.\n");
     return 1;
   }
+  // Before any thread starts, so none of them takes these signals.
+  watcher_on_signal(&g_watcher, SIGINT, shut_down, NULL);  // CTRL+C
+  watcher_on_signal(&g_watcher, SIGTERM, shut_down, NULL); // kill
 
-  log_to_terminal("Monitoring trash directory: %s\n", trash_path);
+  if (g_config_path && !load_watches(g_config_path))
+    log_to_terminal("Could not read %s, watching the trash only.\n",
+                    g_config_path);
+  load_state();
+  refresh_trash_roots();
+  free(g_state);
+  g_state = NULL;
+  if (!watch_trash_roots())
+    log_to_terminal("Could not watch every root, retrying every %.0fs.\n",
+                    WATCH_RETRY);
 
-  update_sketchybar_trash();
-  dispatch_main();
+  update_sketchybar();
+  store_snapshot();
+  watcher_after(&g_watcher, STATE_SAVE_INTERVAL, save_state_later, NULL);
+#ifndef __APPLE__
+  if (sizes_needed())
+    watcher_after(&g_watcher, SIZE_REFRESH, refresh_sizes, NULL);
+#endif
+  if (!start_query_server())
+    log_to_terminal("Could not listen on %s, --count will scan.\n",
+                    QUERY_SOCKET);
+  watcher_run(&g_watcher);
 
   // Unreachable
   return 0;
@@ -0,0 +1,997 @@
+#pragma once
+
+// Directory watching for trash_monitor. The monitor only sees batches of
+// watcher_events; the backend decides how changes are observed and how they
+// are coalesced. FSEvents is used on macOS, inotify everywhere else.
+//
+//   struct watcher watcher;
+//   watcher_begin(&watcher, on_events, on_mounts, context, 1.0);
+//   watcher_set_paths(&watcher, paths, count);
+//   watcher_run(&watcher); // does not return
+//
+// on_events receives every change that happened within `latency` seconds of
+// the first one as a single batch; the first change after a quiet period is
+// delivered without waiting. on_mounts is called when volumes were mounted or
+// unmounted, so the caller can pick new paths. watcher_after runs a one-shot
+// callback on the same loop, and watcher_on_signal turns a signal into a
+// callback there too, where it is safe to do real work. watcher_post hands a
+// callback to the loop from any other thread.
+//
+// Changes below the direct children of a path are reported as well where the
+// backend can (FSEvents always). inotify only sees directories it was told
+// about: watcher_watch_below adds one, from any thread, and
+// watcher_unwatch_below drops a directory and everything added below it.
+//
+// Paths do not have to exist yet. watcher_set_paths returns false when some
+// path could not be watched at all; calling it again with the same paths is
+// cheap and retries just those.
+//
+// Backends with an event history (FSEvents) can resume: set `since` to a
+// watcher_event_id from an earlier run before the first watcher_set_paths
+// and the changes made in between are replayed, followed by an event with
+// WATCHER_HISTORY_DONE. watcher_history_id names the history a path belongs
+// to; an id saved with a different history is meaningless.
+
+#ifdef __APPLE__
+#include <CoreServices/CoreServices.h>
+#include <dispatch/dispatch.h>
+#else
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WATCHER_MAX_PATHS 64
+#define WATCHER_MAX_TIMERS 8
+#define WATCHER_MAX_SIGNALS 4
+
+enum watcher_flags {
+  WATCHER_CREATED = 1 << 0,
+  WATCHER_REMOVED = 1 << 1,
+  WATCHER_RENAMED = 1 << 2,
+  WATCHER_MODIFIED = 1 << 3,
+  // Events were lost; anything under the watched paths may have changed.
+  WATCHER_RESCAN = 1 << 4,
+  // The watched directory itself was created, moved or deleted.
+  WATCHER_ROOT_CHANGED = 1 << 5,
+  // Every change replayed from the history has been delivered.
+  WATCHER_HISTORY_DONE = 1 << 6,
+};
+
+struct watcher_event {
+  const char *path;
+  uint32_t flags;
+};
+
+typedef void (*watcher_event_fn)(void *context,
+                                 const struct watcher_event *events,
+                                 size_t count);
+typedef void (*watcher_mounts_fn)(void *context);
+typedef void (*watcher_timer_fn)(void *context);
+typedef void (*watcher_signal_fn)(void *context, int signum);
+typedef void (*watcher_post_fn)(void *context);
+
+struct watcher {
+  watcher_event_fn on_events;
+  watcher_mounts_fn on_mounts;
+  void *context;
+  double latency;
+  uint64_t since; // 0 for "from now on"
+
+  struct watcher_event *batch;
+  size_t batch_capacity;
+
+  struct watcher_signal {
+    watcher_signal_fn fn;
+    void *context;
+    int signum;
+#ifdef __APPLE__
+    dispatch_source_t source;
+#endif
+  } signals[WATCHER_MAX_SIGNALS];
+
+#ifdef __APPLE__
+  FSEventStreamRef stream;
+  dispatch_source_t mounts;
+  FSEventStreamEventId start_id;
+#else
+  int fd;
+  int mounts_fd;
+  int signal_fd;
+  int post_fds[2]; // watcher_posts written by any thread, read on the loop
+  sigset_t signal_mask;
+  // wds[i] watches paths[i] itself, or its nearest existing parent while
+  // waiting[i] is set; -1 when neither could be watched.
+  int wds[WATCHER_MAX_PATHS];
+  bool waiting[WATCHER_MAX_PATHS];
+  char paths[WATCHER_MAX_PATHS][PATH_MAX];
+  int path_count;
+  bool rearm;
+
+  // Directories from watcher_watch_below, sorted by wd. Filled by other
+  // threads, so only touched with below_lock held.
+  pthread_mutex_t below_lock;
+  struct {
+    int wd;
+    char *path;
+  } *below;
+  size_t below_count;
+  size_t below_capacity;
+
+  struct {
+    watcher_timer_fn fn;
+    void *context;
+    uint64_t deadline;
+  } timers[WATCHER_MAX_TIMERS];
+
+  // Events of the batch being collected; paths live in the arena and are
+  // referenced by offset until delivery since the arena may move.
+  struct {
+    size_t offset;
+    uint32_t flags;
+  } *pending;
+  size_t pending_count;
+  size_t pending_capacity;
+  char *arena;
+  size_t arena_length;
+  size_t arena_capacity;
+  bool overflow;
+#endif
+};
+
+static inline bool watcher_reserve_batch(struct watcher *watcher,
+                                         size_t count) {
+  if (count <= watcher->batch_capacity)
+    return true;
+  size_t capacity = watcher->batch_capacity ? watcher->batch_capacity : 64;
+  while (capacity < count)
+    capacity *= 2;
+  void *batch = realloc(watcher->batch, capacity * sizeof(*watcher->batch));
+  if (!batch)
+    return false;
+  watcher->batch = (struct watcher_event *)batch;
+  watcher->batch_capacity = capacity;
+  return true;
+}
+
+#ifdef __APPLE__
+
+/* ------------------------------------------------------------------ */
+/* FSEvents backend                                                     */
+/* ------------------------------------------------------------------ */
+
+static inline uint32_t watcher_translate_flags(FSEventStreamEventFlags flags) {
+  uint32_t result = 0;
+  if (flags & kFSEventStreamEventFlagItemCreated)
+    result |= WATCHER_CREATED;
+  if (flags & kFSEventStreamEventFlagItemRemoved)
+    result |= WATCHER_REMOVED;
+  if (flags & kFSEventStreamEventFlagItemRenamed)
+    result |= WATCHER_RENAMED;
+  if (flags & (kFSEventStreamEventFlagItemModified |
+               kFSEventStreamEventFlagItemInodeMetaMod))
+    result |= WATCHER_MODIFIED;
+  if (flags & (kFSEventStreamEventFlagMustScanSubDirs |
+               kFSEventStreamEventFlagUserDropped |
+               kFSEventStreamEventFlagKernelDropped))
+    result |= WATCHER_RESCAN;
+  if (flags & kFSEventStreamEventFlagRootChanged)
+    result |= WATCHER_ROOT_CHANGED;
+  if (flags & kFSEventStreamEventFlagHistoryDone)
+    result |= WATCHER_HISTORY_DONE;
+  return result;
+}
+
+static inline void watcher_fsevents_callback(
+    ConstFSEventStreamRef stream, void *info, size_t count, void *paths,
+    const FSEventStreamEventFlags flags[], const FSEventStreamEventId ids[]) {
+  (void)stream;
+  (void)ids;
+  struct watcher *watcher = (struct watcher *)info;
+  if (!watcher_reserve_batch(watcher, count)) {
+    struct watcher_event rescan = {"", WATCHER_RESCAN};
+    watcher->on_events(watcher->context, &rescan, 1);
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    watcher->batch[i] = (struct watcher_event){
+        ((char **)paths)[i], watcher_translate_flags(flags[i])};
+  }
+  watcher->on_events(watcher->context, watcher->batch, count);
+}
+
+static inline void watcher_stop_stream(struct watcher *watcher) {
+  if (watcher->stream) {
+    FSEventStreamStop(watcher->stream);
+    FSEventStreamInvalidate(watcher->stream);
+    FSEventStreamRelease(watcher->stream);
+    watcher->stream = NULL;
+  }
+}
+
+// The id of the last change delivered, to resume from in a later run.
+static inline uint64_t watcher_event_id(struct watcher *watcher) {
+  if (!watcher->stream)
+    return 0;
+  FSEventStreamEventId id = FSEventStreamGetLatestEventId(watcher->stream);
+  return id == kFSEventStreamEventIdSinceNow ? watcher->start_id : id;
+}
+
+// One stream covers every path; it is rebuilt whenever the paths change.
+// The new stream starts from the last event the old one delivered, so changes
+// still waiting out the latency window are replayed instead of lost.
+static inline bool watcher_set_paths(struct watcher *watcher,
+                                     const char *const *paths, int count) {
+  if (!watcher->since)
+    watcher->since = watcher_event_id(watcher);
+  watcher_stop_stream(watcher);
+
+  CFStringRef strings[WATCHER_MAX_PATHS];
+  int string_count = 0;
+  for (int i = 0; i < count && i < WATCHER_MAX_PATHS; i++) {
+    strings[string_count] = CFStringCreateWithCString(
+        kCFAllocatorDefault, paths[i], kCFStringEncodingUTF8);
+    if (strings[string_count])
+      string_count++;
+  }
+
+  CFArrayRef array = CFArrayCreate(NULL, (const void **)strings, string_count,
+                                   &kCFTypeArrayCallBacks);
+  for (int i = 0; i < string_count; i++)
+    CFRelease(strings[i]);
+  if (!array)
+    return false;
+
+  FSEventStreamEventId since =
+      watcher->since ? watcher->since : kFSEventStreamEventIdSinceNow;
+  watcher->start_id = watcher->since ? watcher->since
+                                     : FSEventsGetCurrentEventId();
+  watcher->since = 0;
+
+  // WatchRoot is what reports a watched path itself being moved or deleted.
+  FSEventStreamContext context = {0, watcher, NULL, NULL, NULL};
+  watcher->stream = FSEventStreamCreate(
+      kCFAllocatorDefault, watcher_fsevents_callback, &context, array, since,
+      watcher->latency,
+      kFSEventStreamCreateFlagFileEvents | kFSEventStreamCreateFlagNoDefer |
+          kFSEventStreamCreateFlagWatchRoot);
+  CFRelease(array);
+  if (!watcher->stream)
+    return false;
+
+  FSEventStreamSetDispatchQueue(watcher->stream, dispatch_get_main_queue());
+  if (!FSEventStreamStart(watcher->stream)) {
+    FSEventStreamInvalidate(watcher->stream);
+    FSEventStreamRelease(watcher->stream);
+    watcher->stream = NULL;
+    return false;
+  }
+  return true;
+}
+
+// FSEvents keeps one history per volume, identified by a UUID that changes
+// whenever that history is discarded.
+static inline bool watcher_history_id(const char *path, char *out,
+                                      size_t size) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return false;
+  CFUUIDRef uuid = FSEventsCopyUUIDForDevice(st.st_dev);
+  if (!uuid)
+    return false;
+  CFStringRef string = CFUUIDCreateString(kCFAllocatorDefault, uuid);
+  CFRelease(uuid);
+  if (!string)
+    return false;
+  bool copied = CFStringGetCString(string, out, size, kCFStringEncodingUTF8);
+  CFRelease(string);
+  return copied;
+}
+
+static inline void watcher_mounts_settled(void *context) {
+  struct watcher *watcher = (struct watcher *)context;
+  watcher->on_mounts(watcher->context);
+}
+
+// Mounting or unmounting adds or removes a directory in /Volumes. The mount
+// point can appear before the volume is mounted on it, so report again
+// shortly after.
+static inline void watcher_mounts_changed(void *context) {
+  watcher_mounts_settled(context);
+  dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, 2 * NSEC_PER_SEC),
+                   dispatch_get_main_queue(), context, watcher_mounts_settled);
+}
+
+static inline bool watcher_begin(struct watcher *watcher,
+                                 watcher_event_fn on_events,
+                                 watcher_mounts_fn on_mounts, void *context,
+                                 double latency) {
+  *watcher = (struct watcher){0};
+  watcher->on_events = on_events;
+  watcher->on_mounts = on_mounts;
+  watcher->context = context;
+  watcher->latency = latency;
+  if (!on_mounts)
+    return true;
+
+  // A missing mount watcher only means new volumes are not picked up.
+  int fd = open("/Volumes", O_EVTONLY);
+  if (fd < 0)
+    return true;
+  watcher->mounts = dispatch_source_create(DISPATCH_SOURCE_TYPE_VNODE, fd,
+                                           DISPATCH_VNODE_WRITE,
+                                           dispatch_get_main_queue());
+  if (!watcher->mounts) {
+    close(fd);
+    return true;
+  }
+  dispatch_set_context(watcher->mounts, watcher);
+  dispatch_source_set_event_handler_f(watcher->mounts, watcher_mounts_changed);
+  dispatch_resume(watcher->mounts);
+  return true;
+}
+
+static inline void watcher_end(struct watcher *watcher) {
+  watcher_stop_stream(watcher);
+  if (watcher->mounts) {
+    dispatch_source_cancel(watcher->mounts);
+    watcher->mounts = NULL;
+  }
+  for (int i = 0; i < WATCHER_MAX_SIGNALS; i++) {
+    if (watcher->signals[i].source)
+      dispatch_source_cancel(watcher->signals[i].source);
+    watcher->signals[i] = (struct watcher_signal){0};
+  }
+  free(watcher->batch);
+  watcher->batch = NULL;
+}
+
+static inline void watcher_after(struct watcher *watcher, double seconds,
+                                 watcher_timer_fn timer, void *context) {
+  (void)watcher;
+  dispatch_after_f(
+      dispatch_time(DISPATCH_TIME_NOW, (int64_t)(seconds * NSEC_PER_SEC)),
+      dispatch_get_main_queue(), context, timer);
+}
+
+static inline void watcher_post(struct watcher *watcher, watcher_post_fn fn,
+                                void *context) {
+  (void)watcher;
+  dispatch_async_f(dispatch_get_main_queue(), context, fn);
+}
+
+// Streams are recursive, so everything below the paths is reported already.
+static inline bool watcher_watch_below(struct watcher *watcher,
+                                       const char *path) {
+  (void)watcher;
+  (void)path;
+  return true;
+}
+
+static inline void watcher_unwatch_below(struct watcher *watcher,
+                                         const char *path) {
+  (void)watcher;
+  (void)path;
+}
+
+static inline void watcher_signal_fired(void *context) {
+  struct watcher_signal *entry = (struct watcher_signal *)context;
+  entry->fn(entry->context, entry->signum);
+}
+
+// The signal's default action is ignored and a dispatch source delivers it
+// on the main queue instead.
+static inline bool watcher_on_signal(struct watcher *watcher, int signum,
+                                     watcher_signal_fn fn, void *context) {
+  struct watcher_signal *slot = NULL;
+  for (int i = 0; i < WATCHER_MAX_SIGNALS && !slot; i++) {
+    if (!watcher->signals[i].fn)
+      slot = &watcher->signals[i];
+  }
+  if (!slot)
+    return false;
+
+  dispatch_source_t source = dispatch_source_create(
+      DISPATCH_SOURCE_TYPE_SIGNAL, signum, 0, dispatch_get_main_queue());
+  if (!source)
+    return false;
+  signal(signum, SIG_IGN);
+  *slot = (struct watcher_signal){fn, context, signum, source};
+  dispatch_set_context(source, slot);
+  dispatch_source_set_event_handler_f(source, watcher_signal_fired);
+  dispatch_resume(source);
+  return true;
+}
+
+static inline void watcher_run(struct watcher *watcher) {
+  (void)watcher;
+  dispatch_main();
+}
+
+#else
+
+/* ------------------------------------------------------------------ */
+/* inotify backend                                                      */
+/* ------------------------------------------------------------------ */
+
+// inotify is not recursive, so only direct children of the watched
+// directories, and of those added with watcher_watch_below, are reported. The
+// batch is capped; past that the backend reports a single rescan instead of
+// growing without bound.
+#define WATCHER_INOTIFY_MASK                                                   \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |           \
+   IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define WATCHER_MAX_PENDING 65536
+
+static inline uint64_t watcher_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static inline void watcher_queue(struct watcher *watcher, const char *root,
+                                 const char *name, uint32_t flags) {
+  if (watcher->overflow)
+    return;
+  if (watcher->pending_count == WATCHER_MAX_PENDING) {
+    watcher->overflow = true;
+    return;
+  }
+
+  size_t length = strlen(root) + (name ? strlen(name) + 1 : 0) + 1;
+  if (watcher->arena_length + length > watcher->arena_capacity) {
+    size_t capacity = watcher->arena_capacity ? watcher->arena_capacity : 4096;
+    while (capacity < watcher->arena_length + length)
+      capacity *= 2;
+    char *arena = (char *)realloc(watcher->arena, capacity);
+    if (!arena) {
+      watcher->overflow = true;
+      return;
+    }
+    watcher->arena = arena;
+    watcher->arena_capacity = capacity;
+  }
+  if (watcher->pending_count == watcher->pending_capacity) {
+    size_t capacity =
+        watcher->pending_capacity ? watcher->pending_capacity * 2 : 64;
+    void *pending =
+        realloc(watcher->pending, capacity * sizeof(*watcher->pending));
+    if (!pending) {
+      watcher->overflow = true;
+      return;
+    }
+    watcher->pending = (__typeof__(watcher->pending))pending;
+    watcher->pending_capacity = capacity;
+  }
+
+  char *path = watcher->arena + watcher->arena_length;
+  if (name)
+    snprintf(path, length, "%s/%s", root, name);
+  else
+    snprintf(path, length, "%s", root);
+  watcher->pending[watcher->pending_count].offset = watcher->arena_length;
+  watcher->pending[watcher->pending_count].flags = flags;
+  watcher->pending_count++;
+  watcher->arena_length += length;
+}
+
+static inline void watcher_flush(struct watcher *watcher) {
+  if (watcher->overflow) {
+    struct watcher_event rescan = {"", WATCHER_RESCAN};
+    watcher->on_events(watcher->context, &rescan, 1);
+  } else if (watcher->pending_count &&
+             watcher_reserve_batch(watcher, watcher->pending_count)) {
+    for (size_t i = 0; i < watcher->pending_count; i++) {
+      watcher->batch[i] = (struct watcher_event){
+          watcher->arena + watcher->pending[i].offset,
+          watcher->pending[i].flags};
+    }
+    watcher->on_events(watcher->context, watcher->batch,
+                       watcher->pending_count);
+  } else if (watcher->pending_count) {
+    struct watcher_event rescan = {"", WATCHER_RESCAN};
+    watcher->on_events(watcher->context, &rescan, 1);
+  }
+
+  watcher->pending_count = 0;
+  watcher->arena_length = 0;
+  watcher->overflow = false;
+}
+
+static inline bool watcher_slot_wd(struct watcher *watcher, int wd) {
+  for (int i = 0; i < watcher->path_count; i++) {
+    if (watcher->wds[i] == wd)
+      return true;
+  }
+  return false;
+}
+
+// Where wd is, or would go, in the below table. Needs below_lock.
+static inline size_t watcher_below_index(const struct watcher *watcher,
+                                         int wd) {
+  size_t low = 0;
+  size_t high = watcher->below_count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (watcher->below[middle].wd < wd)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+static inline bool watcher_wd_in_use(struct watcher *watcher, int wd) {
+  if (watcher_slot_wd(watcher, wd))
+    return true;
+  pthread_mutex_lock(&watcher->below_lock);
+  size_t i = watcher_below_index(watcher, wd);
+  bool below = i < watcher->below_count && watcher->below[i].wd == wd;
+  pthread_mutex_unlock(&watcher->below_lock);
+  return below;
+}
+
+static inline void watcher_release_wd(struct watcher *watcher, int wd) {
+  if (wd >= 0 && !watcher_wd_in_use(watcher, wd))
+    inotify_rm_watch(watcher->fd, wd);
+}
+
+// A path that does not exist (yet) is watched through its nearest existing
+// parent, which sees it being created. Several slots may end up on the same
+// directory, and inotify hands them all the same wd.
+static inline bool watcher_arm(struct watcher *watcher, int slot) {
+  int old = watcher->wds[slot];
+  char parent[PATH_MAX];
+  snprintf(parent, sizeof(parent), "%s", watcher->paths[slot]);
+
+  int wd = inotify_add_watch(watcher->fd, parent, WATCHER_INOTIFY_MASK);
+  watcher->waiting[slot] = wd < 0;
+  while (wd < 0 && (errno == ENOENT || errno == ENOTDIR)) {
+    char *slash = strrchr(parent, '/');
+    if (!slash || (slash == parent && !parent[1]))
+      break;
+    slash[slash == parent] = '\0';
+    wd = inotify_add_watch(watcher->fd, parent, WATCHER_INOTIFY_MASK);
+  }
+
+  watcher->wds[slot] = wd;
+  if (old != wd)
+    watcher_release_wd(watcher, old);
+  return wd >= 0;
+}
+
+// Moves waiting slots onto their paths once these exist, and re-arms slots
+// whose directory went away. A path that appears is reported as a root change
+// so the caller scans what was created before the watch was in place.
+static inline void watcher_rearm(struct watcher *watcher) {
+  watcher->rearm = false;
+  for (int i = 0; i < watcher->path_count; i++) {
+    if (watcher->wds[i] >= 0 && !watcher->waiting[i])
+      continue;
+    if (watcher_arm(watcher, i) && !watcher->waiting[i])
+      watcher_queue(watcher, watcher->paths[i], NULL, WATCHER_ROOT_CHANGED);
+  }
+}
+
+static inline void watcher_queue_event(struct watcher *watcher,
+                                       const char *root,
+                                       const struct inotify_event *event) {
+  uint32_t flags = 0;
+  if (event->mask & IN_CREATE)
+    flags |= WATCHER_CREATED;
+  if (event->mask & IN_DELETE)
+    flags |= WATCHER_REMOVED;
+  if (event->mask & (IN_MOVED_FROM | IN_MOVED_TO))
+    flags |= WATCHER_RENAMED;
+  if (event->mask & (IN_MODIFY | IN_ATTRIB))
+    flags |= WATCHER_MODIFIED;
+  if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+    flags |= WATCHER_ROOT_CHANGED;
+  if (flags)
+    watcher_queue(watcher, root, event->len ? event->name : NULL, flags);
+}
+
+// Changes in a directory below the paths are reported like those in a path,
+// but the directory going away is not a root change; its entry is dropped
+// once inotify lets go of the wd.
+static inline void watcher_read_below(struct watcher *watcher,
+                                      const struct inotify_event *event,
+                                      bool report) {
+  pthread_mutex_lock(&watcher->below_lock);
+  size_t i = watcher_below_index(watcher, event->wd);
+  if (i < watcher->below_count && watcher->below[i].wd == event->wd) {
+    if (event->mask & IN_IGNORED) {
+      free(watcher->below[i].path);
+      watcher->below_count--;
+      memmove(&watcher->below[i], &watcher->below[i + 1],
+              (watcher->below_count - i) * sizeof(*watcher->below));
+    } else if (report && !(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+      watcher_queue_event(watcher, watcher->below[i].path, event);
+    }
+  }
+  pthread_mutex_unlock(&watcher->below_lock);
+}
+
+// Drains the inotify queue into the pending batch. Changes in a waiting
+// slot's parent are not reported, they only make the slot try its path again.
+static inline void watcher_read(struct watcher *watcher) {
+  char buffer[64 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t length = read(watcher->fd, buffer, sizeof(buffer));
+    if (length <= 0)
+      break;
+
+    for (char *caret = buffer; caret < buffer + length;) {
+      struct inotify_event *event = (struct inotify_event *)caret;
+      caret += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        watcher_queue(watcher, "", NULL, WATCHER_RESCAN);
+        watcher->rearm = true;
+        continue;
+      }
+
+      // A moved directory keeps its watch under the new name, so it is
+      // dropped and the path resolved again.
+      bool gone = event->mask & (IN_IGNORED | IN_MOVE_SELF);
+      if ((event->mask & IN_MOVE_SELF) && watcher_wd_in_use(watcher, event->wd))
+        inotify_rm_watch(watcher->fd, event->wd);
+      bool matched = false;
+      for (int i = 0; i < watcher->path_count; i++) {
+        if (watcher->wds[i] != event->wd)
+          continue;
+        matched = true;
+        if (!watcher->waiting[i])
+          watcher_queue_event(watcher, watcher->paths[i], event);
+        if (gone)
+          watcher->wds[i] = -1;
+        if (gone || watcher->waiting[i])
+          watcher->rearm = true;
+      }
+      watcher_read_below(watcher, event, !matched);
+    }
+  }
+
+  if (watcher->rearm)
+    watcher_rearm(watcher);
+}
+
+// Only the difference to the current paths is applied, so watches that stay
+// never miss an event; paths that are kept but not watched directly are
+// retried.
+static inline bool watcher_set_paths(struct watcher *watcher,
+                                     const char *const *paths, int count) {
+  if (count > WATCHER_MAX_PATHS)
+    count = WATCHER_MAX_PATHS;
+
+  int dropped[WATCHER_MAX_PATHS];
+  int dropped_count = 0;
+  for (int i = 0; i < watcher->path_count;) {
+    bool kept = false;
+    for (int j = 0; j < count && !kept; j++)
+      kept = strcmp(watcher->paths[i], paths[j]) == 0;
+    if (kept) {
+      i++;
+      continue;
+    }
+    dropped[dropped_count++] = watcher->wds[i];
+    int last = --watcher->path_count;
+    watcher->wds[i] = watcher->wds[last];
+    watcher->waiting[i] = watcher->waiting[last];
+    memcpy(watcher->paths[i], watcher->paths[last], sizeof(watcher->paths[i]));
+  }
+  for (int i = 0; i < dropped_count; i++)
+    watcher_release_wd(watcher, dropped[i]);
+
+  bool watching = true;
+  for (int j = 0; j < count; j++) {
+    int slot = 0;
+    while (slot < watcher->path_count &&
+           strcmp(watcher->paths[slot], paths[j]) != 0)
+      slot++;
+    if (slot == watcher->path_count) {
+      watcher->path_count++;
+      snprintf(watcher->paths[slot], sizeof(watcher->paths[slot]), "%s",
+               paths[j]);
+      watcher->wds[slot] = -1;
+      watcher->waiting[slot] = false;
+    }
+    if (watcher->wds[slot] < 0 || watcher->waiting[slot])
+      watching &= watcher_arm(watcher, slot);
+  }
+  return watching;
+}
+
+static inline bool watcher_reserve_below(struct watcher *watcher) {
+  if (watcher->below_count < watcher->below_capacity)
+    return true;
+  size_t capacity = watcher->below_capacity ? watcher->below_capacity * 2 : 64;
+  void *below = realloc(watcher->below, capacity * sizeof(*watcher->below));
+  if (!below)
+    return false;
+  watcher->below = (__typeof__(watcher->below))below;
+  watcher->below_capacity = capacity;
+  return true;
+}
+
+// The lock is held across inotify_add_watch so the loop cannot see the wd's
+// IN_IGNORED before the entry it removes is in the table.
+static inline bool watcher_watch_below(struct watcher *watcher,
+                                       const char *path) {
+  pthread_mutex_lock(&watcher->below_lock);
+  int wd = inotify_add_watch(watcher->fd, path, WATCHER_INOTIFY_MASK);
+  char *copy = wd >= 0 ? strdup(path) : NULL;
+  size_t i = copy ? watcher_below_index(watcher, wd) : 0;
+  bool watched = copy != NULL;
+  if (!copy) {
+  } else if (i < watcher->below_count && watcher->below[i].wd == wd) {
+    // The same directory again, maybe under a new name.
+    free(watcher->below[i].path);
+    watcher->below[i].path = copy;
+  } else if (watcher_reserve_below(watcher)) {
+    memmove(&watcher->below[i + 1], &watcher->below[i],
+            (watcher->below_count - i) * sizeof(*watcher->below));
+    watcher->below[i].wd = wd;
+    watcher->below[i].path = copy;
+    watcher->below_count++;
+  } else {
+    free(copy);
+    watched = false;
+  }
+  pthread_mutex_unlock(&watcher->below_lock);
+  return watched;
+}
+
+static inline void watcher_unwatch_below(struct watcher *watcher,
+                                         const char *path) {
+  size_t length = strlen(path);
+  pthread_mutex_lock(&watcher->below_lock);
+  size_t kept = 0;
+  for (size_t i = 0; i < watcher->below_count; i++) {
+    const char *below = watcher->below[i].path;
+    if (strncmp(below, path, length) != 0 ||
+        (below[length] != '/' && below[length] != '\0')) {
+      watcher->below[kept++] = watcher->below[i];
+      continue;
+    }
+    if (!watcher_slot_wd(watcher, watcher->below[i].wd))
+      inotify_rm_watch(watcher->fd, watcher->below[i].wd);
+    free(watcher->below[i].path);
+  }
+  watcher->below_count = kept;
+  pthread_mutex_unlock(&watcher->below_lock);
+}
+
+static inline bool watcher_begin(struct watcher *watcher,
+                                 watcher_event_fn on_events,
+                                 watcher_mounts_fn on_mounts, void *context,
+                                 double latency) {
+  *watcher = (struct watcher){0};
+  watcher->on_events = on_events;
+  watcher->on_mounts = on_mounts;
+  watcher->context = context;
+  watcher->latency = latency;
+  watcher->mounts_fd = -1;
+  watcher->signal_fd = -1;
+  watcher->post_fds[0] = watcher->post_fds[1] = -1;
+  sigemptyset(&watcher->signal_mask);
+  pthread_mutex_init(&watcher->below_lock, NULL);
+
+  watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watcher->fd < 0 || pipe(watcher->post_fds) != 0)
+    return false;
+  fcntl(watcher->post_fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(watcher->post_fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl(watcher->post_fds[0], F_SETFL, O_NONBLOCK);
+
+  // /proc/self/mounts signals POLLPRI whenever the mount table changes.
+  if (on_mounts)
+    watcher->mounts_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+  return true;
+}
+
+static inline void watcher_end(struct watcher *watcher) {
+  if (watcher->fd >= 0)
+    close(watcher->fd);
+  if (watcher->mounts_fd >= 0)
+    close(watcher->mounts_fd);
+  if (watcher->signal_fd >= 0)
+    close(watcher->signal_fd);
+  for (int i = 0; i < 2; i++) {
+    if (watcher->post_fds[i] >= 0)
+      close(watcher->post_fds[i]);
+  }
+  for (size_t i = 0; i < watcher->below_count; i++)
+    free(watcher->below[i].path);
+  free(watcher->below);
+  pthread_mutex_destroy(&watcher->below_lock);
+  free(watcher->pending);
+  free(watcher->arena);
+  free(watcher->batch);
+  *watcher = (struct watcher){0};
+  watcher->fd = -1;
+  watcher->mounts_fd = -1;
+  watcher->signal_fd = -1;
+  watcher->post_fds[0] = watcher->post_fds[1] = -1;
+}
+
+// inotify has no history, so nothing can be resumed.
+static inline uint64_t watcher_event_id(struct watcher *watcher) {
+  (void)watcher;
+  return 0;
+}
+
+static inline bool watcher_history_id(const char *path, char *out,
+                                      size_t size) {
+  (void)path;
+  (void)out;
+  (void)size;
+  return false;
+}
+
+// Up to WATCHER_MAX_TIMERS timers are pending at a time; scheduling the same
+// callback and context again replaces its pending timer.
+static inline void watcher_after(struct watcher *watcher, double seconds,
+                                 watcher_timer_fn timer, void *context) {
+  int slot = -1;
+  for (int i = 0; i < WATCHER_MAX_TIMERS; i++) {
+    if (watcher->timers[i].fn == timer &&
+        watcher->timers[i].context == context) {
+      slot = i;
+      break;
+    }
+    if (!watcher->timers[i].fn && slot < 0)
+      slot = i;
+  }
+  if (slot < 0)
+    return;
+  watcher->timers[slot].fn = timer;
+  watcher->timers[slot].context = context;
+  watcher->timers[slot].deadline =
+      watcher_now_ms() + (uint64_t)(seconds * 1000);
+}
+
+// The signal is blocked and read from a signalfd in the poll loop. Threads
+// inherit the mask, so call this before starting any; a thread created
+// earlier would still take the signal the default way.
+static inline bool watcher_on_signal(struct watcher *watcher, int signum,
+                                     watcher_signal_fn fn, void *context) {
+  struct watcher_signal *slot = NULL;
+  for (int i = 0; i < WATCHER_MAX_SIGNALS && !slot; i++) {
+    if (!watcher->signals[i].fn)
+      slot = &watcher->signals[i];
+  }
+  if (!slot)
+    return false;
+
+  sigset_t mask = watcher->signal_mask;
+  sigaddset(&mask, signum);
+  int fd = signalfd(watcher->signal_fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0)
+    return false;
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  watcher->signal_fd = fd;
+  watcher->signal_mask = mask;
+  *slot = (struct watcher_signal){fn, context, signum};
+  return true;
+}
+
+struct watcher_post {
+  watcher_post_fn fn;
+  void *context;
+};
+
+// Pipe writes up to PIPE_BUF are atomic, so posts from several threads never
+// interleave and every read returns whole ones.
+static inline void watcher_post(struct watcher *watcher, watcher_post_fn fn,
+                                void *context) {
+  struct watcher_post post = {fn, context};
+  while (write(watcher->post_fds[1], &post, sizeof(post)) < 0 &&
+         errno == EINTR)
+    ;
+}
+
+static inline void watcher_read_posts(struct watcher *watcher) {
+  struct watcher_post post;
+  while (read(watcher->post_fds[0], &post, sizeof(post)) == sizeof(post))
+    post.fn(post.context);
+}
+
+static inline void watcher_read_signals(struct watcher *watcher) {
+  struct signalfd_siginfo info;
+  while (read(watcher->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    for (int i = 0; i < WATCHER_MAX_SIGNALS; i++) {
+      struct watcher_signal *entry = &watcher->signals[i];
+      if (entry->fn && entry->signum == (int)info.ssi_signo)
+        entry->fn(entry->context, entry->signum);
+    }
+  }
+}
+
+static inline int watcher_timeout(uint64_t deadline, uint64_t now) {
+  return deadline > now ? (int)(deadline - now) : 0;
+}
+
+// Like an FSEvents stream with a latency and NoDefer: a change after a quiet
+// period is delivered at once, and it starts a window in which further
+// changes are collected and delivered together when it closes.
+static inline void watcher_run(struct watcher *watcher) {
+  uint64_t deadline = 0;
+  uint64_t window_end = 0;
+  for (;;) {
+    // Unused slots hold -1, which poll skips.
+    struct pollfd fds[4] = {{watcher->fd, POLLIN, 0},
+                            {watcher->mounts_fd, POLLPRI, 0},
+                            {watcher->signal_fd, POLLIN, 0},
+                            {watcher->post_fds[0], POLLIN, 0}};
+    int timeout = -1;
+    uint64_t now = watcher_now_ms();
+    if (watcher->pending_count || watcher->overflow)
+      timeout = watcher_timeout(deadline, now);
+    for (int i = 0; i < WATCHER_MAX_TIMERS; i++) {
+      if (!watcher->timers[i].fn)
+        continue;
+      int timer_timeout = watcher_timeout(watcher->timers[i].deadline, now);
+      if (timeout < 0 || timer_timeout < timeout)
+        timeout = timer_timeout;
+    }
+
+    int ready = poll(fds, 4, timeout);
+    if (ready < 0 && errno != EINTR)
+      return;
+
+    if (ready > 0 && (fds[2].revents & POLLIN))
+      watcher_read_signals(watcher);
+
+    if (ready > 0 && (fds[3].revents & POLLIN))
+      watcher_read_posts(watcher);
+
+    if (ready > 0 && (fds[0].revents & POLLIN)) {
+      bool idle = !watcher->pending_count && !watcher->overflow;
+      watcher_read(watcher);
+      if (idle && (watcher->pending_count || watcher->overflow)) {
+        now = watcher_now_ms();
+        // Outside a window the batch goes out now and opens a new window.
+        deadline = now < window_end ? window_end : now;
+        window_end = now + (uint64_t)(watcher->latency * 1000);
+      }
+    }
+
+    if (ready > 0 && (fds[1].revents & (POLLPRI | POLLERR))) {
+      // Let the collected events refer to the old paths before switching.
+      watcher_flush(watcher);
+      watcher->on_mounts(watcher->context);
+    }
+
+    if ((watcher->pending_count || watcher->overflow) &&
+        watcher_now_ms() >= deadline)
+      watcher_flush(watcher);
+
+    for (int i = 0; i < WATCHER_MAX_TIMERS; i++) {
+      if (!watcher->timers[i].fn ||
+          watcher_now_ms() < watcher->timers[i].deadline)
+        continue;
+      watcher_timer_fn timer = watcher->timers[i].fn;
+      watcher->timers[i].fn = NULL;
+      timer(watcher->timers[i].context);
+    }
+  }
+}
+
+#endif